@@ -11,24 +11,70 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <alloca.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <dlfcn.h>
+#include <limits.h>
 #include <math.h>
 #include <ffi.h>
 
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
 #include "helper.h"
 #include "config.h"
 #include "token.h"
 #include "lex.h"
 
-#define MAX_RECORD_FIELDS   30
-#define MAX_FUNC_ARGS       30
+/* fields and parameters are parsed on the C stack up to this count */
+#define CPARSE_LIST_INLINE  32
+
+#define CFUNC_VA_CACHE_SIZE 8
+#define CFUNC_CB_POOL_SIZE  16
+
+/* type strings resolved by lua_check_ct, the cache is reset beyond that */
+#define CTCACHE_SIZE        1024
+#define CCACHE_LRU_SIZE     64
+#define CCORO_POOL_SIZE     8
+
+/* tables passed to pointer parameters are converted on the C stack up to this size */
+#define CALL_SCRATCH_STACK  (16 * 1024)
+
+/*
+ * Storage valid for the duration of a call. Larger ones are a userdata pushed
+ * on the Lua stack, whose index is stored to *slot for the caller to remove.
+ */
+#define CALL_SCRATCH(L, size, slot) \
+    ((size) <= CALL_SCRATCH_STACK ? alloca(size) : call_scratch_push(L, size, slot))
+
+/*
+ * Direct call stubs: integer and pointer arguments are passed in general
+ * purpose registers by these ABIs, so a function pointer can be called
+ * with every argument widened to 64 bits.
+ */
+#if (defined(__x86_64__) || defined(__aarch64__)) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CSTUB_MAX_ARGS      6
+
+/* trampolines are only generated for the System V x86-64 ABI so far */
+#if defined(ENABLE_JIT) && defined(__x86_64__)
+#define CJIT
+#define CJIT_BUCKETS        64
+#define CJIT_MAX_ARGS       255
+#endif
+#endif
 
 #define CDATA_MT    "cdata"
 #define CTYPE_MT    "ctype"
 #define CLIB_MT     "clib"
+#define CSCANNER_MT "cscanner"
+#define CFIELDS_MT  "cfields"
 
 enum {
     CTYPE_BOOL,
@@ -116,40 +162,166 @@ struct crecord_field {
     char name[0];
 };
 
+/* a member of a record or of its anonymous records */
+struct crecord_index {
+    const char *name;       /* interned Lua string, anchored in cfield_registry */
+    uint32_t hash;          /* of the name contents */
+    struct ctype *ct;
+    size_t offset;          /* from the start of the record */
+};
+
 struct crecord {
     ffi_type ft;
     int mt_ref;
+    int nfield;
+    int nindex;
+    int cache_size;             /* bound of CCACHE_LRU */
+    uint8_t cache;              /* CCACHE_* of arrays and pointers of the record */
+    size_t index_mask;
+    struct crecord_index *index;    /* open addressing on the name pointer */
     uint8_t mflags;
-    uint8_t nfield:5;
     uint8_t is_union:1;
     uint8_t anonymous:1;
     uint8_t packed:1;
     struct crecord_field *fields[0];
 };
 
+enum {
+    CALL_BACKEND_AUTO,
+    CALL_BACKEND_LIBFFI,
+    CALL_BACKEND_STUB,
+    CALL_BACKEND_JIT
+};
+
+typedef void (*cstub_t)(void *fn, uint64_t *args, void *ret);
+typedef void (*cconv_from_t)(lua_State *L, struct ctype *ct, void *ptr, int idx);
+typedef int (*cconv_to_t)(lua_State *L, struct ctype *ct, void *ptr);
+
+/* callback return converters must not raise, false means conversion failed */
+typedef bool (*cconv_ret_t)(lua_State *L, struct ctype *ct, void *ptr, int idx);
+
+struct cfunc_va_cif {
+    ffi_cif cif;
+    size_t stamp;
+    int narg;
+    ffi_type *args[0];
+};
+
+/* prepared cifs of a variadic function, keyed by the argument types */
+struct cfunc_va_cache {
+    struct cfunc_va_cif *entries[CFUNC_VA_CACHE_SIZE];
+    size_t tick;
+    size_t hits;
+    size_t misses;
+};
+
+/* parameter annotations */
+enum {
+    CFUNC_ARG_OUT = 1 << 0,     /* __out: scratch storage, value returned after the call */
+    CFUNC_ARG_INOUT = 1 << 1,   /* __inout: tables are updated after the call */
+    CFUNC_ARG_TABLE = 1 << 2    /* pointer which accepts a table */
+};
+
 struct cfunc {
     uint8_t va:1;
-    uint8_t narg:5;
+    uint8_t prepared:1;
+    uint8_t resolved:1;
+    uint8_t backend;
+    int narg;
+    int nout;           /* number of __out parameters */
+    int ntable;         /* number of pointer parameters which accept tables */
+    cstub_t stub;       /* stub or trampoline, NULL to call through libffi */
+    cstub_t jit;        /* generated trampoline, once compiled */
     struct ctype *rtype;
+    ffi_cif cif;        /* prepared on first call, unused for variadic */
+    ffi_type **fts;     /* ffi types of the fixed arguments */
+    size_t *offsets;    /* offsets of the fixed arguments in the frame */
+    size_t frame_size;
+    struct cfunc_va_cache *va_cache;
+    struct ccallback *cb_pool;  /* idle callbacks, ready to be reused */
+    struct ccallback *tramps;   /* shared callbacks dispatching on a handle */
+    struct cqueue *queue;       /* of the owning state, set once resolved */
+    size_t cb_idle;
+    size_t cb_created;
+    size_t cb_reused;
+    cconv_from_t *convs;    /* converters of the fixed arguments */
+    cconv_to_t rconv;       /* NULL for records and unsupported types */
+    cconv_to_t *cb_convs;   /* converters of callback arguments */
+    cconv_ret_t cb_rconv;   /* converter of callback return values */
+    uint8_t *flags;         /* CFUNC_ARG_* of the fixed arguments */
     struct ctype *args[0];
 };
 
+/* how callbacks pass pointer arguments to Lua */
+enum {
+    CB_PTR_CDATA,   /* a new cdata per argument */
+    CB_PTR_RAW,     /* light userdata */
+    CB_PTR_CURSOR   /* a cdata per parameter, reused by every invocation */
+};
+
+/* which threads may invoke a callback */
+enum {
+    CB_THREAD_NONE,     /* only the thread owning the Lua state */
+    CB_THREAD_ASYNC,    /* others queue the call and return at once */
+    CB_THREAD_SYNC      /* others queue the call and wait until it is handled */
+};
+
+struct cqueue_node {
+    struct cqueue_node *next;
+};
+
+/* lock-free multi-producer single-consumer queue of foreign thread calls */
+struct cqueue {
+    struct cqueue_node *head;   /* last pushed, swapped by producers */
+    struct cqueue_node *tail;   /* next to pop, consumer only */
+    struct cqueue_node stub;
+    pthread_t owner;            /* the thread which last called into C or polled */
+    bool closed;                /* set on collection, later calls are not queued */
+    int inflight;               /* foreign threads between checking closed and pushing */
+    lua_State *main;            /* runs callbacks invoked outside of any call, anchored */
+    lua_State *current;         /* inside a call into C, owner thread only */
+    int fd;                     /* eventfd signalled on push, -1 if unavailable */
+};
+
+struct ccallback_cursor {
+    struct cdata *cd;
+    int ref;
+};
+
 struct ccallback {
     lua_State *L;
     struct cfunc *func;
-    ffi_cif cif;
-    ffi_type *args[MAX_FUNC_ARGS];
-    ffi_closure *closure;
+    struct ccallback *next;     /* next idle callback in the pool of func */
+    ffi_closure *closure;       /* prepared once with the cif of func */
     void *code;
     int fn_ref;
     int err_ref;
+    int ctx;                    /* 1-based handle parameter of trampolines, else 0 */
+    uint8_t ptr_mode;
+    uint8_t thread;
+    bool orphan;                /* collected while calls were queued */
+    int pending;                /* queued calls, the callback is kept until they ran */
+    struct cqueue *queue;       /* of the owning state */
+    struct ccallback_cursor cursors[0];     /* one per parameter, CB_PTR_CURSOR only */
 };
 
 static bool ctype_equal(const struct ctype *ct1, const struct ctype *ct2);
 
+/* how child cdata of records, arrays and pointers are cached */
+enum {
+    CCACHE_DEFAULT,     /* as set for the element record type, else strong */
+    CCACHE_STRONG,      /* kept as long as the parent */
+    CCACHE_WEAK,        /* kept while referenced elsewhere */
+    CCACHE_LRU,         /* the most recently used ones, up to a bound */
+    CCACHE_OFF,         /* a new cdata per access */
+    CCACHE_CURSOR       /* a single cdata per parent, moved on each access */
+};
+
 struct cdata {
     struct ctype *ct;
     int gc_ref;
+    uint8_t cache;      /* CCACHE_* set for this cdata */
+    uint8_t children;   /* CCACHE_* of the cache in the user value, 0 if none */
     void *ptr;
     struct ccallback *cb;
 };
@@ -159,9 +331,20 @@ struct clib {
 };
 
 static const char *crecord_registry;
+static const char *cfield_registry;
 static const char *carray_registry;
 static const char *cfunc_registry;
 static const char *ctype_registry;
+static const char *ctype_hash_registry;
+static const char *carray_hash_registry;
+static const char *ctcache_registry;
+static const char *cjit_registry;
+static const char *chandle_registry;
+static const char *cqueue_registry;
+static const char *cfunc_cleanup_registry;
+static const char *ccoro_registry;
+static const char *cthread_registry;
+static const char *ccache_registry;
 static const char *ctdef_registry;
 static const char *clib_registry;
 
@@ -201,6 +384,11 @@ static void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup)
 
 #define ispseudo(i) ((i) <= LUA_REGISTRYINDEX)
 
+#define lua_rawlen lua_objlen
+
+#define lua_getuservalue lua_getfenv
+#define lua_setuservalue lua_setfenv
+
 static int lua_absindex(lua_State *L, int idx)
 {
     return (idx > 0 || ispseudo(idx)) ? idx : lua_gettop(L) + idx + 1;
@@ -252,6 +440,14 @@ static int lua_type_error(lua_State *L, int narg, char const *tname)
     return 0;
 }
 
+static void *call_scratch_push(lua_State *L, size_t size, int *slot)
+{
+    void *p = lua_newuserdata(L, size);
+
+    *slot = lua_gettop(L);
+    return p;
+}
+
 static ffi_type *ffi_type_of(size_t size, bool s)
 {
     switch (size) {
@@ -408,6 +604,32 @@ static inline bool ctype_ptr_to(struct ctype *ct, int type)
     return ct->type != CTYPE_PTR ? false : ct->ptr->type == type;
 }
 
+/* the function type of a function or function pointer cdata */
+static inline struct cfunc *cdata_func(struct cdata *cd)
+{
+    struct ctype *ct = cd->ct;
+
+    if (ct->type == CTYPE_PTR)
+        ct = ct->ptr;
+
+    return ct->type == CTYPE_FUNC ? ct->func : NULL;
+}
+
+/* element type and base address of a cdata array or pointer */
+static struct ctype *cdata_elems(struct cdata *cd, uint8_t **base)
+{
+    switch (cdata_type(cd)) {
+    case CTYPE_ARRAY:
+        *base = cdata_ptr(cd);
+        return cd->ct->array->ct;
+    case CTYPE_PTR:
+        *base = cdata_ptr_ptr(cd);
+        return cd->ct->ptr;
+    default:
+        return NULL;
+    }
+}
+
 static bool ctype_is_int(struct ctype *ct)
 {
     return ct->type < CTYPE_FLOAT;
@@ -418,6 +640,22 @@ static bool ctype_is_num(struct ctype *ct)
     return ct->type < CTYPE_VOID;
 }
 
+static bool ctype_is_int64(struct ctype *ct)
+{
+    return ctype_is_int(ct) && ct->ft->size == 8;
+}
+
+/* pointers to data a Lua table can be converted to */
+static bool ctype_ptr_table(struct ctype *ct)
+{
+    if (ct->type != CTYPE_PTR)
+        return false;
+
+    ct = ct->ptr;
+
+    return ctype_is_num(ct) || ct->type == CTYPE_PTR || ct->type == CTYPE_RECORD;
+}
+
 static void cdata_ptr_set(struct cdata *cd, void *ptr)
 {
     int type = cdata_type(cd);
@@ -451,40 +689,184 @@ static struct ctype *ctype_new(lua_State *L, bool keep)
     return ct;
 }
 
+/* open addressing hash set of interned objects, which are never removed */
+struct cintern_slot {
+    uint32_t hash;
+    void *obj;
+};
+
+struct cintern {
+    size_t size;        /* power of two, 0 until the first insertion */
+    size_t count;
+    struct cintern_slot *slots;
+};
+
+typedef bool (*cintern_eq_t)(const void *obj, const void *key);
+
+static int cintern_gc(lua_State *L)
+{
+    struct cintern *t = lua_touserdata(L, 1);
+
+    free(t->slots);
+    t->slots = NULL;
+    t->size = t->count = 0;
+
+    return 0;
+}
+
+static void cintern_init(lua_State *L, const void *key)
+{
+    struct cintern *t = lua_newuserdata(L, sizeof(struct cintern));
+
+    memset(t, 0, sizeof(struct cintern));
+
+    lua_newtable(L);
+    lua_pushcfunction(L, cintern_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+}
+
+static struct cintern *cintern_get(lua_State *L, const void *key)
+{
+    struct cintern *t;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, key);
+    t = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return t;
+}
+
+static void *cintern_find(struct cintern *t, uint32_t hash, cintern_eq_t eq, const void *key)
+{
+    size_t mask = t->size - 1;
+    size_t i;
+
+    if (!t->size)
+        return NULL;
+
+    for (i = hash & mask; t->slots[i].obj; i = (i + 1) & mask) {
+        if (t->slots[i].hash == hash && eq(t->slots[i].obj, key))
+            return t->slots[i].obj;
+    }
+
+    return NULL;
+}
+
+static void cintern_put(struct cintern_slot *slots, size_t size, uint32_t hash, void *obj)
+{
+    size_t i;
+
+    for (i = hash & (size - 1); slots[i].obj; i = (i + 1) & (size - 1))
+        ;
+
+    slots[i].hash = hash;
+    slots[i].obj = obj;
+}
+
+static void cintern_add(lua_State *L, struct cintern *t, uint32_t hash, void *obj)
+{
+    if ((t->count + 1) * 4 > t->size * 3) {
+        size_t size = t->size ? t->size * 2 : 64;
+        struct cintern_slot *slots = calloc(size, sizeof(struct cintern_slot));
+        size_t i;
+
+        if (!slots)
+            luaL_error(L, "no mem");
+
+        for (i = 0; i < t->size; i++) {
+            if (t->slots[i].obj)
+                cintern_put(slots, size, t->slots[i].hash, t->slots[i].obj);
+        }
+
+        free(t->slots);
+        t->slots = slots;
+        t->size = size;
+    }
+
+    cintern_put(t->slots, t->size, hash, obj);
+    t->count++;
+}
+
+static uint32_t chash_mix(uint32_t h, uint64_t v)
+{
+    h ^= (uint32_t)(v ^ (v >> 32)) + 0x9e3779b9 + (h << 6) + (h >> 2);
+    return h;
+}
+
+/*
+ * Return, argument, pointed-to and element types are interned before the
+ * types built on them, so they are hashed and compared by address.
+ */
+static uint32_t cfunc_hash(const struct cfunc *func)
+{
+    uint32_t h = chash_mix(func->va, func->narg);
+    int i;
+
+    h = chash_mix(h, (uintptr_t)func->rtype);
+
+    for (i = 0; i < func->narg; i++) {
+        h = chash_mix(h, (uintptr_t)func->args[i]);
+        h = chash_mix(h, func->flags[i]);
+    }
+
+    return h;
+}
+
+/* consistent with ctype_equal */
+static uint32_t ctype_hash(const struct ctype *ct)
+{
+    uint32_t h = chash_mix(ct->type, ct->is_const);
+
+    switch (ct->type) {
+    case CTYPE_RECORD:
+        return chash_mix(h, (uintptr_t)ct->rc);
+    case CTYPE_ARRAY:
+        return chash_mix(h, (uintptr_t)ct->array);
+    case CTYPE_PTR:
+        return chash_mix(h, (uintptr_t)ct->ptr);
+    case CTYPE_FUNC:
+        return chash_mix(h, cfunc_hash(ct->func));
+    default:
+        return h;
+    }
+}
+
 static bool cfunc_equal(const struct cfunc *f1, const struct cfunc *f2)
 {
     int i;
 
-    if (f1->va != f2->va || f1->narg != f2->narg)
-        return false;
+    if (f1 == f2)
+        return true;
 
-    if (!ctype_equal(f1->rtype, f2->rtype))
+    if (f1->va != f2->va || f1->narg != f2->narg || f1->rtype != f2->rtype)
         return false;
 
     for (i = 0; i < f1->narg; i++)
-        if (!ctype_equal(f1->args[i], f2->args[i]))
+        if (f1->args[i] != f2->args[i] || f1->flags[i] != f2->flags[i])
             return false;
 
     return true;
 }
 
+/* interned types are equal only to themselves, this compares the others */
 static bool ctype_equal(const struct ctype *ct1, const struct ctype *ct2)
 {
-    if (ct1->type != ct2->type)
-        return false;
+    if (ct1 == ct2)
+        return true;
 
-    if (ct1->is_const != ct2->is_const)
+    if (ct1->type != ct2->type || ct1->is_const != ct2->is_const)
         return false;
 
     switch (ct1->type) {
     case CTYPE_RECORD:
         return ct1->rc == ct2->rc;
     case CTYPE_ARRAY:
-        if (ct1->array->size != ct2->array->size)
-            return false;
-        return ctype_equal(ct1->array->ct, ct2->array->ct);
+        return ct1->array == ct2->array;
     case CTYPE_PTR:
-        return ctype_equal(ct1->ptr, ct2->ptr);
+        return ct1->ptr == ct2->ptr;
     case CTYPE_FUNC:
         return cfunc_equal(ct1->func, ct2->func);
     default:
@@ -494,52 +876,62 @@ static bool ctype_equal(const struct ctype *ct1, const struct ctype *ct2)
     return true;
 }
 
-static struct ctype *ctype_lookup(lua_State *L, struct ctype *match, bool keep)
+/* equal types, ignoring top-level qualifiers */
+static bool ctype_same_value(struct ctype *ct1, struct ctype *ct2)
 {
-    struct ctype *ct;
+    struct ctype a = *ct1, b = *ct2;
 
-    lua_rawgetp(L, LUA_REGISTRYINDEX, &ctype_registry);
+    a.is_const = b.is_const = 0;
 
-    lua_pushnil(L);
+    return ctype_equal(&a, &b);
+}
 
-    while (lua_next(L, -2) != 0) {
-        ct = lua_touserdata(L, -1);
-        if (ctype_equal(match, ct)) {
-            if (keep) {
-                lua_replace(L, -3);
-                lua_pop(L, 1);
-            } else {
-                lua_pop(L, 3);
-            }
-            return ct;
+static bool ctype_intern_eq(const void *obj, const void *key)
+{
+    return ctype_equal(obj, key);
+}
+
+static struct ctype *ctype_lookup(lua_State *L, struct ctype *match, bool keep)
+{
+    struct cintern *t = cintern_get(L, &ctype_hash_registry);
+    uint32_t hash = ctype_hash(match);
+    struct ctype *ct = cintern_find(t, hash, ctype_intern_eq, match);
+
+    if (ct) {
+        if (keep) {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, &ctype_registry);
+            lua_rawgetp(L, -1, ct);
+            lua_remove(L, -2);
         }
-        lua_pop(L, 1);
+        return ct;
     }
 
-    lua_pop(L, 1);
-
     ct = ctype_new(L, keep);
     *ct = *match;
 
+    cintern_add(L, t, hash, ct);
+
     return ct;
 }
 
-static struct carray *carray_lookup(lua_State *L, size_t size, struct ctype *ct)
+static bool carray_intern_eq(const void *obj, const void *key)
 {
-    struct carray *a;
+    const struct carray *a = obj, *b = key;
 
-    lua_rawgetp(L, LUA_REGISTRYINDEX, &carray_registry);
+    return a->size == b->size && a->ct == b->ct;
+}
 
-    lua_pushnil(L);
+static struct carray *carray_lookup(lua_State *L, size_t size, struct ctype *ct)
+{
+    struct cintern *t = cintern_get(L, &carray_hash_registry);
+    struct carray match = { .size = size, .ct = ctype_lookup(L, ct, false) };
+    uint32_t hash = chash_mix(size, (uintptr_t)match.ct);
+    struct carray *a = cintern_find(t, hash, carray_intern_eq, &match);
 
-    while (lua_next(L, -2) != 0) {
-        a = lua_touserdata(L, -1);
-        if (a->size == size && ctype_equal(a->ct, ct)) {
-            lua_pop(L, 3);
-            return a;
-        }
-        lua_pop(L, 1);
-    }
+    if (a)
+        return a;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &carray_registry);
 
     a = lua_newuserdata(L, sizeof(struct carray));
     if (!a)
@@ -555,25 +947,21 @@ static struct carray *carray_lookup(lua_State *L, size_t size, struct ctype *ct)
     }
 
     a->size = size;
-    a->ct = ctype_lookup(L, ct, false);
+    a->ct = match.ct;
+
+    cintern_add(L, t, hash, a);
 
     return a;
 }
 
+/* crecord_registry maps names to records, and records back to their names */
 static const char *cstruct_lookup_name(lua_State *L, struct crecord *st)
 {
     lua_rawgetp(L, LUA_REGISTRYINDEX, &crecord_registry);
+    lua_rawgetp(L, -1, st);
+    lua_remove(L, -2);
 
-    lua_pushnil(L);
-    while (lua_next(L, -2) != 0) {
-        if (lua_topointer(L, -1) == st) {
-            lua_pop(L, 1);
-            lua_remove(L, -2);
-            return lua_tostring(L, -1);
-        }
-        lua_pop(L, 1);
-    }
-    return NULL;
+    return lua_tostring(L, -1);
 }
 
 static void ctype_tostring(lua_State *L, struct ctype *ct, luaL_Buffer *b, bool *first_ptr)
@@ -608,6 +996,10 @@ static void ctype_tostring(lua_State *L, struct ctype *ct, luaL_Buffer *b, bool
         for (i = 0; i < ct->func->narg; i++) {
             if (i > 0)
                 luaL_addchar(b, ',');
+            if (ct->func->flags[i] & CFUNC_ARG_OUT)
+                luaL_addstring(b, "__out ");
+            else if (ct->func->flags[i] & CFUNC_ARG_INOUT)
+                luaL_addstring(b, "__inout ");
             ctype_tostring(L, ct->func->args[i], b, first_ptr);
         }
         luaL_addchar(b, ')');
@@ -628,6 +1020,8 @@ static struct cdata *cdata_new(lua_State *L, struct ctype *ct, void *ptr)
     struct cdata *cd = lua_newuserdata(L, sizeof(struct cdata) + (ptr ? 0 : ctype_sizeof(ct)));
 
     cd->gc_ref = LUA_REFNIL;
+    cd->cache = CCACHE_DEFAULT;
+    cd->children = 0;
     cd->ptr = ptr;
     cd->ct = ct;
     cd->cb = NULL;
@@ -635,15 +1029,85 @@ static struct cdata *cdata_new(lua_State *L, struct ctype *ct, void *ptr)
     luaL_getmetatable(L, CDATA_MT);
     lua_setmetatable(L, -2);
 
-    lua_newtable(L);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, cd);
-
     if (!ptr)
         memset(cdata_ptr(cd), 0, ctype_sizeof(ct));
 
     return cd;
 }
 
+union cint_value {
+    int8_t i8;
+    uint8_t u8;
+    int16_t i16;
+    uint16_t u16;
+    int32_t i32;
+    uint32_t u32;
+    int64_t i64;
+    uint64_t u64;
+};
+
+/* integer cdata are computed on 64 bits, sign or zero extended */
+static uint64_t cint_load(struct ctype *ct, void *ptr)
+{
+    union cint_value v;
+
+    memcpy(&v, ptr, ct->ft->size);
+
+    switch (ct->ft->type) {
+    case FFI_TYPE_SINT8:
+        return v.i8;
+    case FFI_TYPE_UINT8:
+        return v.u8;
+    case FFI_TYPE_SINT16:
+        return v.i16;
+    case FFI_TYPE_UINT16:
+        return v.u16;
+    case FFI_TYPE_SINT32:
+        return v.i32;
+    case FFI_TYPE_UINT32:
+        return v.u32;
+    default:
+        return v.u64;
+    }
+}
+
+static void cint_store(struct ctype *ct, void *ptr, uint64_t value)
+{
+    union cint_value v;
+
+    switch (ct->ft->type) {
+    case FFI_TYPE_SINT8:
+    case FFI_TYPE_UINT8:
+        v.u8 = ct->type == CTYPE_BOOL ? !!value : value;
+        break;
+    case FFI_TYPE_SINT16:
+    case FFI_TYPE_UINT16:
+        v.u16 = value;
+        break;
+    case FFI_TYPE_SINT32:
+    case FFI_TYPE_UINT32:
+        v.u32 = value;
+        break;
+    default:
+        v.u64 = value;
+        break;
+    }
+
+    memcpy(ptr, &v, ct->ft->size);
+}
+
+/* pushes an int64_t cdata, or an uint64_t one */
+static void cint_push(lua_State *L, bool u, uint64_t value)
+{
+    struct ctype match = { .type = u ? CTYPE_UINT64_T : CTYPE_INT64_T };
+    struct cdata *cd;
+
+    match.ft = ffi_type_of(8, !u);
+
+    cd = cdata_new(L, ctype_lookup(L, &match, false), NULL);
+    memcpy(cdata_ptr(cd), &value, sizeof(value));
+}
+
 static int __cdata_tostring(lua_State *L, struct cdata *cd)
 {
     void *ptr = cdata_type(cd) == CTYPE_PTR ? cdata_ptr_ptr(cd) : cdata_ptr(cd);
@@ -674,6 +1138,20 @@ static int cdata_tostring(lua_State *L)
         return 1;
     }
 
+    /* the value, as its address tells nothing and numbers may lose precision */
+    if (ctype_is_int64(ct)) {
+        uint64_t v = cint_load(ct, cdata_ptr(cd));
+        char buf[32];
+
+        if (ct->ft->type == FFI_TYPE_UINT64)
+            snprintf(buf, sizeof(buf), "%lluULL", (unsigned long long)v);
+        else
+            snprintf(buf, sizeof(buf), "%lldLL", (long long)(int64_t)v);
+
+        lua_pushstring(L, buf);
+        return 1;
+    }
+
     return __cdata_tostring(L, cd);
 }
 
@@ -874,6 +1352,11 @@ static bool cdata_from_lua_cdata(lua_State *L, struct ctype *ct, void *ptr, int
         }
         break;
     default:
+        if (ctype_is_int(cd->ct) && ctype_is_int(ct)) {
+            cint_store(ct, ptr, cint_load(cd->ct, cdata_ptr(cd)));
+            return true;
+        }
+
         if (ctype_is_num(cd->ct)) {
             cdata_to_lua(L, cd->ct, cdata_ptr(cd));
             cdata_from_lua_num(L, ct, ptr, -1, cast);
@@ -992,7 +1475,12 @@ static void ccallback_raise_argument_errors(lua_State *L, int first_idx, int nar
     int i;
 
     for (i = 0; i < narg; i++) {
-        struct cdata *cd = luaL_testudata(L, first_idx + i, CDATA_MT);
+        struct cdata *cd;
+
+        if (lua_type(L, first_idx + i) != LUA_TUSERDATA)
+            continue;
+
+        cd = luaL_testudata(L, first_idx + i, CDATA_MT);
 
         if (!cd || !cd->cb || cd->cb->err_ref == LUA_REFNIL)
             continue;
@@ -1004,1932 +1492,5742 @@ static void ccallback_raise_argument_errors(lua_State *L, int first_idx, int nar
     }
 }
 
-static void ccallback_invoke(ffi_cif *cif, void *ret, void **args, void *userdata)
+/*
+ * Child cdata are cached in a table created on first access and held by the
+ * user value of the parent. The table of CCACHE_LRU holds the current and
+ * the previous generation of children, the count of the current one and the
+ * bound. Once the count reaches the bound, the current generation becomes
+ * the previous one, hits in the previous generation are moved to the current.
+ * The table of CCACHE_CURSOR holds the cursor.
+ */
+static int ccache_policy(struct cdata *cd, int *size)
 {
-    struct ccallback *cb = userdata;
-    struct cfunc *func = cb->func;
-    struct ctype *rtype = func->rtype;
-    lua_State *L = cb->L;
-    int top = lua_gettop(L);
-    int i;
-
-    lua_rawgeti(L, LUA_REGISTRYINDEX, cb->fn_ref);
-
-    for (i = 0; i < func->narg; i++)
-        cdata_to_lua(L, func->args[i], args[i]);
+    struct ctype *ct = cd->ct;
+    struct ctype *elem = NULL;
 
-    if (lua_pcall(L, func->narg, rtype->type == CTYPE_VOID ? 0 : 1, 0)) {
-        if (lua_isnil(L, -1)) {
-            lua_pushliteral(L, "unknown");
-            ccallback_set_error(L, cb, -1);
-        } else {
-            ccallback_set_error(L, cb, -1);
-        }
+    *size = CCACHE_LRU_SIZE;
 
-        if (rtype->type != CTYPE_VOID)
-            memset(ret, 0, ctype_sizeof(rtype));
+    if (cd->cache != CCACHE_DEFAULT)
+        return cd->cache;
 
-        lua_settop(L, top);
-        return;
-    }
+    if (ct->type == CTYPE_ARRAY)
+        elem = ct->array->ct;
+    else if (ct->type == CTYPE_PTR)
+        elem = ct->ptr;
 
-    if (rtype->type != CTYPE_VOID && !cdata_from_lua_cb_ret(L, rtype, ret, -1)) {
-        lua_pushliteral(L, "callback return value conversion failed");
-        ccallback_set_error(L, cb, -1);
-        memset(ret, 0, ctype_sizeof(rtype));
+    if (elem && elem->type == CTYPE_RECORD && elem->rc->cache != CCACHE_DEFAULT) {
+        *size = elem->rc->cache_size;
+        return elem->rc->cache;
     }
 
-    lua_settop(L, top);
+    return CCACHE_STRONG;
 }
 
-static void ccallback_release(lua_State *L, struct ccallback *cb)
+/* pushes the cache of the cdata at idx, replacing it if of another policy */
+static void ccache_push(lua_State *L, struct cdata *cd, int idx, int policy, int size)
 {
-    if (!cb)
+    if (cd->children == policy) {
+        lua_getuservalue(L, idx);
         return;
+    }
 
-    if (cb->fn_ref != LUA_REFNIL)
-        luaL_unref(L, LUA_REGISTRYINDEX, cb->fn_ref);
+    idx = lua_absindex(L, idx);
+    lua_newtable(L);
 
-    if (cb->closure)
-        ffi_closure_free(cb->closure);
+    if (policy == CCACHE_WEAK) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &ccache_registry);
+        lua_setmetatable(L, -2);
+    } else if (policy == CCACHE_LRU) {
+        lua_newtable(L);
+        lua_rawseti(L, -2, 1);
+        lua_newtable(L);
+        lua_rawseti(L, -2, 2);
+        lua_pushinteger(L, 0);
+        lua_rawseti(L, -2, 3);
+        lua_pushinteger(L, size);
+        lua_rawseti(L, -2, 4);
+    }
 
-    free(cb);
+    lua_pushvalue(L, -1);
+    lua_setuservalue(L, idx);
+    cd->children = policy;
 }
 
-static struct ccallback *ccallback_new(lua_State *L, struct cfunc *func, int idx)
+/* adds the child on top with the key at index 2 to the LRU cache at -2 */
+static void ccache_lru_add(lua_State *L)
 {
-    struct ccallback *cb;
-    int status;
-    int i;
+    lua_Integer count;
 
-    if (func->va)
-        luaL_error(L, "cannot create callback for variadic function type");
+    lua_rawgeti(L, -2, 1);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
 
-    cb = calloc(1, sizeof(struct ccallback));
-    if (!cb)
-        luaL_error(L, "no mem");
+    lua_rawgeti(L, -2, 3);
+    count = lua_tointeger(L, -1) + 1;
+    lua_pop(L, 1);
 
-    cb->L = L;
-    cb->func = func;
-    cb->fn_ref = LUA_REFNIL;
-    cb->err_ref = LUA_REFNIL;
+    lua_rawgeti(L, -2, 4);
 
-    lua_pushvalue(L, idx);
-    cb->fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (count >= lua_tointeger(L, -1)) {
+        count = 0;
+        lua_rawgeti(L, -3, 1);
+        lua_rawseti(L, -4, 2);
+        lua_newtable(L);
+        lua_rawseti(L, -4, 1);
+    }
 
-    for (i = 0; i < func->narg; i++)
-        cb->args[i] = ctype_ft(func->args[i]);
+    lua_pop(L, 1);
+    lua_pushinteger(L, count);
+    lua_rawseti(L, -3, 3);
+}
 
-    status = ffi_prep_cif(&cb->cif, FFI_DEFAULT_ABI, func->narg,
-            ctype_ft(func->rtype), cb->args);
-    if (status)
-        goto err;
+/* pushes the cached child of the cdata at index 1 with the key at index 2 */
+static bool ccache_get(lua_State *L, struct cdata *cd)
+{
+    switch (cd->children) {
+    case CCACHE_STRONG:
+    case CCACHE_WEAK:
+        lua_getuservalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        break;
+    case CCACHE_LRU:
+        lua_getuservalue(L, 1);
+        lua_rawgeti(L, -1, 1);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
 
-    cb->closure = ffi_closure_alloc(sizeof(ffi_closure), &cb->code);
-    if (!cb->closure)
-        goto err;
+        if (!lua_isnil(L, -1))
+            break;
 
-    status = ffi_prep_closure_loc(cb->closure, &cb->cif, ccallback_invoke, cb, cb->code);
-    if (status)
-        goto err;
+        lua_pop(L, 1);
+        lua_rawgeti(L, -1, 2);
+        lua_pushvalue(L, 2);
+        lua_rawget(L, -2);
+        lua_remove(L, -2);
 
-    return cb;
+        if (!lua_isnil(L, -1))
+            ccache_lru_add(L);
+        break;
+    default:
+        return false;
+    }
 
-err:
-    ccallback_release(L, cb);
-    luaL_error(L, "ffi callback setup fail: %d", status);
-    return NULL;
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 2);
+        return false;
+    }
+
+    lua_remove(L, -2);
+    return true;
 }
 
-static bool cdata_from_lua_table(lua_State *L, struct ctype *ct, void *ptr, int idx, bool cast)
+static void cdata_clear_children(lua_State *L, struct cdata *cd, int idx);
+
+/*
+ * Pushes the child of type ct at ptr of the cdata at index 1, with the key
+ * at index 2. Only cdata are cached, scalars are pushed as Lua values.
+ */
+static int ccache_push_child(lua_State *L, struct cdata *cd, struct ctype *ct, void *ptr)
 {
-    int i = 0;
+    struct cdata *child;
+    int policy, size;
 
-    if (ct->type == CTYPE_ARRAY) {
-        lua_pushnil(L);
+    if (ccache_get(L, cd))
+        return 1;
 
-        while (lua_next(L, idx)) {
-            if (lua_isinteger(L, -2)) {
-                i = lua_tointeger(L, -2) - 1;
-                if (i < ct->array->size)
-                    cdata_from_lua(L, ct->array->ct, ptr + ctype_sizeof(ct->array->ct) * i,
-                            lua_absindex(L, -1), cast);
-            }
+    policy = ccache_policy(cd, &size);
+
+    if (policy == CCACHE_CURSOR && (ct->type == CTYPE_RECORD || ct->type == CTYPE_ARRAY)) {
+        ccache_push(L, cd, 1, policy, size);
+        lua_rawgeti(L, -1, 1);
+
+        child = luaL_testudata(L, -1, CDATA_MT);
+        if (child && child->ct == ct) {
+            child->ptr = ptr;
+            cdata_clear_children(L, child, -1);
+        } else {
             lua_pop(L, 1);
+            cdata_new(L, ct, ptr);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, 1);
         }
 
-        return true;
-    } else if (ct->type == CTYPE_RECORD) {
-        while (i < ct->rc->nfield) {
-            struct crecord_field *field = ct->rc->fields[i++];
+        lua_remove(L, -2);
+        return 1;
+    }
 
-            lua_rawgeti(L, idx, i);
-            if (lua_isnil(L, -1)) {
-                lua_pop(L, 1);
-                lua_getfield(L, idx, field->name);
-            }
+    cdata_to_lua(L, ct, ptr);
 
-            if (!lua_isnil(L, -1))
-                cdata_from_lua(L, field->ct, ptr + field->offset, lua_absindex(L, -1), cast);
-            lua_pop(L, 1);
-        }
-        return true;
+    if (policy == CCACHE_OFF || policy == CCACHE_CURSOR || !luaL_testudata(L, -1, CDATA_MT))
+        return 1;
+
+    ccache_push(L, cd, 1, policy, size);
+    lua_insert(L, -2);
+
+    if (policy == CCACHE_LRU) {
+        ccache_lru_add(L);
+    } else {
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
     }
 
-    return false;
+    lua_remove(L, -2);
+    return 1;
 }
 
-static int cdata_from_lua(lua_State *L, struct ctype *ct, void *ptr, int idx, bool cast)
+/* drops the cached child cdata, they may point into the previous value */
+static void cdata_clear_children(lua_State *L, struct cdata *cd, int idx)
 {
-    switch (ct->type) {
-    case CTYPE_FUNC:
-    case CTYPE_VOID:
-        luaL_error(L, "invalid C type");
-        break;
-    case CTYPE_ARRAY:
-    case CTYPE_RECORD:
-        if (cast)
-            luaL_error(L, "invalid C type");
-        break;
-    default:
-        break;
-    }
-
-    switch (lua_type(L, idx)) {
-    case LUA_TNIL:
-        if (ct->type == CTYPE_PTR) {
-            *(void **)ptr = NULL;
-            return 0;
-        }
-        break;
-    case LUA_TNUMBER:
-    case LUA_TBOOLEAN:
-        if (cdata_from_lua_num(L, ct, ptr, idx, cast))
-            return 0;
-        break;
-    case LUA_TSTRING:
-        if (cast || ((ctype_ptr_to(ct, CTYPE_CHAR) || ctype_ptr_to(ct, CTYPE_VOID))
-            && ct->ptr->is_const)) {
-            *(const char **)ptr = (const char *)lua_tostring(L, idx);
-            return 0;
-        }
+    switch (cd->children) {
+    case CCACHE_STRONG:
+    case CCACHE_WEAK:
+        lua_getuservalue(L, idx);
 
-        if (ct->type == CTYPE_ARRAY && ct->array->ct->type == CTYPE_CHAR) {
-            size_t len;
-            const char *str = lua_tolstring(L, idx, &len);
-            memcpy(ptr, str, len + 1);
-            return 0;
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, -4);
         }
-        break;
-    case LUA_TUSERDATA:
-        if (luaL_testudata(L, idx, CDATA_MT)) {
-            if (cdata_from_lua_cdata(L, ct, ptr, idx, cast))
-                return 0;
-        } else if (ct->type == CTYPE_PTR) {
-            void *ud = lua_touserdata(L, idx);
 
-            if (luaL_testudata(L, idx, LUA_FILEHANDLE)) {
-                *(void **)ptr = *(void **)ud;
-                return 0;
-            }
-
-            if (cast || ctype_ptr_to(ct, CTYPE_VOID)) {
-                *(void **)ptr = ud;
-                return 0;
-            }
-        }
-        break;
-    case LUA_TLIGHTUSERDATA:
-        if (ct->type == CTYPE_PTR) {
-            *(void **)ptr = lua_touserdata(L, idx);
-            return 0;
-        }
-        break;
-    case LUA_TTABLE:
-        if (cdata_from_lua_table(L, ct, ptr, idx, cast))
-            return 0;
+        lua_pop(L, 1);
         break;
-    case LUA_TFUNCTION:
-        if (cast && ct->type == CTYPE_PTR && ct->ptr->type == CTYPE_FUNC)
-            return luaL_argerror(L, idx, "cast callback with ffi.cast so callback lifetime can be tracked");
+    case CCACHE_LRU:
+        lua_getuservalue(L, idx);
+        lua_newtable(L);
+        lua_rawseti(L, -2, 1);
+        lua_newtable(L);
+        lua_rawseti(L, -2, 2);
+        lua_pushinteger(L, 0);
+        lua_rawseti(L, -2, 3);
+        lua_pop(L, 1);
         break;
     default:
+        /* a cursor is moved on each access anyway */
         break;
     }
+}
 
-    if (luaL_testudata(L, idx, CDATA_MT)) {
-        struct cdata *cd = lua_touserdata(L, idx);
-        __ctype_tostring(L, cd->ct);
-        __ctype_tostring(L, ct);
-        lua_pushfstring(L, "cannot convert '%s' to '%s'", lua_tostring(L, -2), lua_tostring(L, -1));
-    } else {
-        __ctype_tostring(L, ct);
-        lua_pushfstring(L, "cannot convert '%s' to '%s'", luaL_typename(L, idx), lua_tostring(L, -1));
-    }
-    return luaL_argerror(L, idx, lua_tostring(L, -1));
+static void ccallback_push_cursor(lua_State *L, struct ccallback_cursor *cur, void *arg)
+{
+    *(void **)cdata_ptr(cur->cd) = *(void **)arg;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cur->ref);
+    cdata_clear_children(L, cur->cd, -1);
 }
 
-static int cdata_index_ptr(lua_State *L, struct cdata *cd, struct ctype *ct, bool to)
+/*
+ * Handles name Lua functions in a dense table of the registry, so that a
+ * single trampoline per function type can serve any number of them.
+ */
+static bool ccallback_push_handle(lua_State *L, void *handle)
 {
-    void *ptr = cdata_type(cd) == CTYPE_PTR ? cdata_ptr_ptr(cd) : cdata_ptr(cd);
-    int idx;
+    uintptr_t h = (uintptr_t)handle;
 
-    if (ct->type == CTYPE_VOID) {
-        __ctype_tostring(L, cd->ct);
-        return luaL_error(L, "ctype '%s' cannot be indexed", lua_tostring(L, -1));
-    }
+    if (!h || h > INT_MAX)
+        return false;
 
-    if (!lua_isinteger(L, 2)) {
-        __ctype_tostring(L, cd->ct);
-        return luaL_error(L, "ctype '%s' cannot be indexed with %s", lua_tostring(L, -1), luaL_typename(L, 2));
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &chandle_registry);
+    lua_rawgeti(L, -1, h);
+    lua_remove(L, -2);
+
+    if (lua_type(L, -1) != LUA_TFUNCTION) {
+        lua_pop(L, 1);
+        return false;
     }
 
-    idx = lua_tointeger(L, 2);
+    return true;
+}
 
-    if (to) {
-        lua_rawgetp(L, LUA_REGISTRYINDEX, cd);
-        lua_rawgeti(L, -1, idx);
-        if (!lua_isnil(L, -1)) {
-            lua_remove(L, -2);
-            return 1;
-        }
-        lua_pop(L, 2);
+/* resumes co with narg arguments, *nres receives the number of values returned */
+static int ccoro_resume(lua_State *co, lua_State *from, int narg, int *nres)
+{
+#if LUA_VERSION_NUM > 503
+    return lua_resume(co, from, narg, nres);
+#else
+    int status;
 
-        cdata_to_lua(L, ct, ptr + ctype_sizeof(ct) * idx);
+#if LUA_VERSION_NUM > 501
+    status = lua_resume(co, from, narg);
+#else
+    status = lua_resume(co, narg);
+#endif
 
-        if (luaL_testudata(L, -1, CDATA_MT)) {
-            lua_rawgetp(L, LUA_REGISTRYINDEX, cd);
-            lua_pushvalue(L, -2);
-            lua_rawseti(L, -2, idx);
-            lua_pop(L, 1);
-        }
-        return 1;
-    } else {
-        return cdata_from_lua(L, ct, ptr + ctype_sizeof(ct) * idx, 3, false);
-    }
+    *nres = lua_gettop(co);
+    return status;
+#endif
 }
 
-static struct crecord_field *cdata_crecord_find_field(
-        struct crecord_field **fields, int nfield, const char *name, size_t *offset)
+/* pushes an idle coroutine of the pool onto L, which keeps it alive while it runs */
+static lua_State *ccoro_acquire(lua_State *L)
 {
-    int i;
+    lua_State *co;
+    int n;
 
-    for (i = 0; i < nfield; i++) {
-        struct crecord_field *field = fields[i];
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &ccoro_registry);
+    n = lua_rawlen(L, -1);
 
-        if (field->name[0]) {
-            if (!strcmp(field->name, name)) {
-                *offset += field->offset;
-                return field;
-            }
-        } else {
-            field = cdata_crecord_find_field(field->ct->rc->fields, field->ct->rc->nfield, name, offset);
-            if (field) {
-                *offset += fields[i]->offset;
-                return field;
-            }
-        }
+    if (n > 0) {
+        lua_rawgeti(L, -1, n);
+        lua_pushnil(L);
+        lua_rawseti(L, -3, n);
+        co = lua_tothread(L, -1);
+    } else {
+        co = lua_newthread(L);
     }
 
-    return NULL;
+    lua_remove(L, -2);
+
+    return co;
 }
 
-static int cdata_index_crecord(lua_State *L, struct cdata *cd, struct ctype *ct, bool to)
+/* returns the finished coroutine at idx of L to the pool while it has room */
+static void ccoro_release(lua_State *L, int idx)
 {
-    void *ptr = cdata_type(cd) == CTYPE_PTR ? cdata_ptr_ptr(cd) : cdata_ptr(cd);
-    struct crecord *rc = ct->rc;
-    struct crecord_field *field;
-    size_t offset = 0;
-    const char *name;
+    int n;
 
-    if (lua_type(L, 2) != LUA_TSTRING)
-        return luaL_error(L, "struct must be indexed with string");
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &ccoro_registry);
+    n = lua_rawlen(L, -1);
 
-    name = lua_tostring(L, 2);
+    if (n < CCORO_POOL_SIZE) {
+        lua_pushvalue(L, idx);
+        lua_rawseti(L, -2, n + 1);
+    }
 
-    if (to) {
-        lua_rawgetp(L, LUA_REGISTRYINDEX, cd);
-        lua_getfield(L, -1, name);
-        if (!lua_isnil(L, -1)) {
-            lua_remove(L, -2);
-            return 1;
-        }
-        lua_pop(L, 2);
+    lua_pop(L, 1);
+}
+
+/*
+ * Runs the callback on L, the running thread. A callback may only yield if
+ * nobody waits for its result: it then gets a pooled coroutine, which is
+ * left to whoever resumes it.
+ */
+static void ccallback_call(struct ccallback *cb, lua_State *L, void *ret, void **args,
+        bool can_yield)
+{
+    struct cfunc *func = cb->func;
+    struct ctype *rtype = func->rtype;
+    int top = lua_gettop(L);
+    lua_State *co = can_yield ? ccoro_acquire(L) : L;
+    int status, nres;
+    int i;
+
+    /* the function, its arguments and a temporary of the converters */
+    if (!lua_checkstack(co, func->narg + 2)) {
+        lua_pushliteral(L, "stack overflow in callback");
+        goto err;
     }
 
-    field = cdata_crecord_find_field(rc->fields, rc->nfield, name, &offset);
-    if (!field) {
-        if (to) {
-            if (rc->mflags & METATYPE_FLAG_INDEX) {
-                lua_rawgeti(L, LUA_REGISTRYINDEX, rc->mt_ref);
-                lua_getfield(L, -1, "__index");
+    if (cb->ctx) {
+        if (!ccallback_push_handle(co, *(void **)args[cb->ctx - 1])) {
+            lua_pushliteral(L, "invalid callback handle");
+            goto err;
+        }
+    } else {
+        lua_rawgeti(co, LUA_REGISTRYINDEX, cb->fn_ref);
+    }
 
-                if (lua_isfunction(L, -1))
-                    return 1;
+    for (i = 0; i < func->narg; i++) {
+        struct ctype *ct = func->args[i];
 
-                if (lua_istable(L, -1)) {
-                    lua_getfield(L, -1, name);
-                    if (!lua_isnil(L, -1))
-                        return 1;
-                }
-            }
+        if (cb->ptr_mode != CB_PTR_CDATA && ct->type == CTYPE_PTR) {
+            if (cb->ptr_mode == CB_PTR_RAW)
+                lua_pushlightuserdata(co, *(void **)args[i]);
+            else
+                ccallback_push_cursor(co, &cb->cursors[i], args[i]);
+            continue;
         }
 
-        __ctype_tostring(L, ct);
-        return luaL_error(L, "ctype '%s' has no member named '%s'", lua_tostring(L, -1), name);
+        func->cb_convs[i](co, ct, args[i]);
     }
 
-    if (to) {
-        cdata_to_lua(L, field->ct, ptr + offset);
-        if (luaL_testudata(L, -1, CDATA_MT)) {
-            lua_rawgetp(L, LUA_REGISTRYINDEX, cd);
-            lua_pushvalue(L, -2);
-            lua_setfield(L, -2, name);
-            lua_pop(L, 1);
+    if (can_yield) {
+        status = ccoro_resume(co, L, func->narg, &nres);
+
+        if (status == LUA_YIELD) {
+            lua_settop(L, top);
+            return;
         }
-        return 1;
     } else {
-        return cdata_from_lua(L, field->ct, ptr + offset, 3, false);
+        status = lua_pcall(L, func->narg, LUA_MULTRET, 0);
+        nres = lua_gettop(L) - top;
     }
-}
 
-static int cdata_index_common(lua_State *L, bool to)
-{
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    struct ctype *ct = cd->ct;
+    if (status) {
+        if (lua_isnil(co, -1))
+            lua_pushliteral(L, "unknown");
+        else
+            lua_xmove(co, L, 1);
+        goto err;
+    }
 
-    if (!to && ct->is_const)
-        return luaL_error(L, "assignment of read-only variable");
+    if (rtype->type != CTYPE_VOID) {
+        if (!nres)
+            lua_pushnil(co);
 
-    switch (ct->type) {
-    case CTYPE_RECORD:
-        return cdata_index_crecord(L, cd, ct, to);
-    case CTYPE_PTR:
-        if (ctype_ptr_to(ct, CTYPE_RECORD) && lua_type(L, 2) == LUA_TSTRING)
-            return cdata_index_crecord(L, cd, ct->ptr, to);
-        return cdata_index_ptr(L, cd, ct->ptr, to);
-    case CTYPE_ARRAY:
-        return cdata_index_ptr(L, cd, ct->array->ct, to);
-    default:
-        __ctype_tostring(L, cd->ct);
-        return luaL_error(L, "ctype '%s' cannot be indexed", lua_tostring(L, -1));
+        if (!func->cb_rconv(co, rtype, ret, lua_gettop(co) - (nres ? nres - 1 : 0))) {
+            lua_pushliteral(L, "callback return value conversion failed");
+            goto err;
+        }
     }
-}
 
-static int cdata_index(lua_State *L)
-{
-    return cdata_index_common(L, true);
+    if (can_yield) {
+        lua_settop(co, 0);
+        ccoro_release(L, top + 1);
+    }
+
+    lua_settop(L, top);
+    return;
+
+err:
+    ccallback_set_error(L, cb, -1);
+
+    if (rtype->type != CTYPE_VOID)
+        memset(ret, 0, ctype_sizeof(rtype));
+
+    lua_settop(L, top);
 }
 
-static int cdata_newindex(lua_State *L)
+struct cqueue_msg {
+    struct cqueue_node node;
+    struct ccallback *cb;
+    void *ret;
+    bool sync;
+    pthread_mutex_t lock;       /* sync only */
+    pthread_cond_t cond;
+    bool done;
+    void *args[0];              /* followed by copies of the argument values */
+};
+
+#define CQUEUE_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+static void cqueue_push(struct cqueue *q, struct cqueue_node *n)
 {
-    return cdata_index_common(L, false);
+    struct cqueue_node *prev;
+
+    __atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
 }
 
-static int cdata_eq(lua_State *L)
+/* returns NULL when empty, or while a producer is between its two steps */
+static struct cqueue_node *cqueue_pop(struct cqueue *q)
 {
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    int type = cdata_type(cd);
-    struct cdata *a;
-    bool eq = false;
+    struct cqueue_node *tail = q->tail;
+    struct cqueue_node *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (!next)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
 
-    switch (type) {
-    case CTYPE_RECORD:
-    case CTYPE_ARRAY:
-    case CTYPE_FUNC:
-        break;
-    case CTYPE_PTR:
-        if (lua_isnil(L, 2)) {
-            eq = cdata_ptr_ptr(cd) == NULL;
-            break;
-        }
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
 
-        a = luaL_testudata(L, 2, CDATA_MT);
-        if (a && cdata_type(a) == CTYPE_PTR)
-            eq = cdata_ptr_ptr(cd) == cdata_ptr_ptr(a);
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+        return NULL;
 
-        break;
-    default:
-        cdata_to_lua(L, cd->ct, cdata_ptr(cd));
-        eq = lua_equal(L, 2, -1);
-        lua_pop(L, 1);
+    cqueue_push(q, &q->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        q->tail = next;
+        return tail;
     }
 
-    lua_pushboolean(L, eq);
-    return 1;
+    return NULL;
 }
 
-static ffi_type *lua_to_vararg(lua_State *L, int idx)
+/*
+ * The state may be driven by different threads over time, the one currently
+ * inside Lua is recorded whenever it calls into C or polls.
+ */
+static inline lua_State *cqueue_enter(struct cqueue *q, lua_State *L)
 {
-    struct cdata *cd;
+    pthread_t self = pthread_self();
+    lua_State *prev = q->current;
 
-    switch (lua_type(L, idx)) {
-    case LUA_TBOOLEAN:
-        return &ffi_type_sint; /* cannot be less than the size of int, due to limited in libffi */
-    case LUA_TNUMBER:
-        if (lua_isinteger(L, idx))
-            return ffi_type_of(sizeof(lua_Integer), false);
-        return &ffi_type_double;
-    case LUA_TNIL:
-    case LUA_TSTRING:
-    case LUA_TLIGHTUSERDATA:
-        return &ffi_type_pointer;
-    case LUA_TUSERDATA:
-        cd = luaL_testudata(L, idx, CDATA_MT);
-        if (!cd || cdata_type(cd) == CTYPE_RECORD || cdata_type(cd) == CTYPE_ARRAY)
-            return &ffi_type_pointer;
-        return ctype_ft(cd->ct);
-    default:
-        return NULL;
-    }
+    __atomic_store(&q->owner, &self, __ATOMIC_RELAXED);
+    q->current = L;
+
+    return prev;
 }
 
-static int cdata_call(lua_State *L)
+static inline bool cqueue_is_owner(struct cqueue *q)
 {
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    ffi_type *args[MAX_FUNC_ARGS] = {};
-    void *values[MAX_FUNC_ARGS] = {};
-    struct ctype *ct = cd->ct;
-    int i, status, narg;
-    struct cfunc *func;
-    struct ctype *rtype;
-    ffi_cif cif;
-    void *sym;
+    pthread_t owner;
 
-    if (ct->type != CTYPE_FUNC) {
-        __ctype_tostring(L, ct);
-        return luaL_error(L, "'%s' is not callable", lua_tostring(L, -1));
+    __atomic_load(&q->owner, &owner, __ATOMIC_RELAXED);
+    return pthread_equal(pthread_self(), owner);
+}
+
+static void cqueue_notify(struct cqueue *q)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t ret;
+
+    /* fails only when the counter is saturated, the consumer is woken anyway */
+    if (q->fd >= 0) {
+        ret = write(q->fd, &one, sizeof(one));
+        (void)ret;
     }
+#endif
+}
 
-    sym = cdata_ptr_ptr(cd);
-    if (!sym)
-        return luaL_error(L, "attempt to call null function pointer");
+/*
+ * Called on a foreign thread: nothing here may touch the Lua state. The
+ * argument values are copied, as they live in the caller's frame.
+ */
+static void cqueue_deliver(struct ccallback *cb, void *ret, void **args)
+{
+    struct cfunc *func = cb->func;
+    size_t size = CQUEUE_ALIGN(sizeof(struct cqueue_msg) + sizeof(void *) * func->narg);
+    struct cqueue *q = cb->queue;
+    bool sync = cb->thread == CB_THREAD_SYNC;
+    struct cqueue_msg *msg;
+    uint8_t *data;
+    int i;
 
-    func = ct->func;
-    rtype = func->rtype;
+    for (i = 0; i < func->narg; i++)
+        size += CQUEUE_ALIGN(ctype_sizeof(func->args[i]));
 
-    narg = lua_gettop(L) - 1;
+    /* counted before checking closed, so that cqueue_gc waits for the push */
+    __atomic_add_fetch(&q->inflight, 1, __ATOMIC_SEQ_CST);
 
-    if (func->va) {
-        if (narg < func->narg)
-            return luaL_error(L, "wrong number of arguments for function call");
-    } else if (narg != func->narg) {
-        return luaL_error(L, "wrong number of arguments for function call");
+    msg = __atomic_load_n(&q->closed, __ATOMIC_SEQ_CST) ? NULL : malloc(size);
+    if (!msg) {
+        __atomic_sub_fetch(&q->inflight, 1, __ATOMIC_SEQ_CST);
+        if (ret)
+            memset(ret, 0, ctype_sizeof(func->rtype));
+        return;
     }
 
+    data = (uint8_t *)CQUEUE_ALIGN((uintptr_t)&msg->args[func->narg]);
+
     for (i = 0; i < func->narg; i++) {
-        args[i] = ctype_ft(func->args[i]);
-        values[i] = alloca(args[i]->size);
-        cdata_from_lua(L, func->args[i], values[i], i + 2, false);
+        size_t n = ctype_sizeof(func->args[i]);
+
+        memcpy(data, args[i], n);
+        msg->args[i] = data;
+        data += CQUEUE_ALIGN(n);
     }
 
-    if (func->va) {
-        for (i = func->narg; i < narg; i++) {
-            args[i] = lua_to_vararg(L, i + 2);
-            if (!args[i])
-                return luaL_error(L, "unsupported type '%s'", luaL_typename(L, i + 2));
-            values[i] = alloca(args[i]->size);
-        }
+    msg->cb = cb;
+    msg->ret = ret;
+    msg->sync = sync;
 
-        for (i = func->narg; i < narg; i++) {
-            switch (lua_type(L, i + 2)) {
-            case LUA_TBOOLEAN:
-            case LUA_TNUMBER:
-                ft_from_lua_num(L, args[i], values[i], i + 2);
-                break;
-            case LUA_TNIL:
-                *(void **)values[i] = NULL;
-                break;
-            case LUA_TSTRING:
-                *(void **)values[i] = (void *)luaL_checkstring(L, i + 2);
-                break;
-            case LUA_TLIGHTUSERDATA:
-                *(void **)values[i] = (void *)lua_topointer(L, i + 2);
-                break;
-            case LUA_TUSERDATA:
-                cd = luaL_testudata(L, i + 2, CDATA_MT);
-                if (!cd)
-                    *(void **)values[i] = lua_touserdata(L, i + 2);
-                else if (cdata_type(cd) == CTYPE_RECORD || cdata_type(cd) == CTYPE_ARRAY)
-                    *(void **)values[i] = cdata_ptr(cd);
-                else if (cdata_type(cd) == CTYPE_FUNC || cdata_type(cd) == CTYPE_PTR)
-                    *(void **)values[i] = cdata_ptr_ptr(cd);
-                else {
-                    cdata_to_lua(L, cd->ct, cdata_ptr(cd));
-                    ft_from_lua_num(L, args[i], values[i], -1);
-                    lua_pop(L, 1);
-                }
-                break;
-            }
-        }
+    if (sync) {
+        msg->done = false;
+        pthread_mutex_init(&msg->lock, NULL);
+        pthread_cond_init(&msg->cond, NULL);
     }
 
-    if (func->va)
-        status = ffi_prep_cif_var(&cif, FFI_DEFAULT_ABI, func->narg, narg, ctype_ft(rtype), args);
-    else
-        status = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, func->narg, ctype_ft(rtype), args);
-    if (status)
-        return luaL_error(L, "ffi_prep_cif fail: %d", status);
-
-    if (rtype->type == CTYPE_RECORD || rtype->type == CTYPE_PTR) {
-        if (rtype->type == CTYPE_PTR) {
-            void *rvalue;
-            ffi_call(&cif, FFI_FN(sym), &rvalue, values);
-            ccallback_raise_argument_errors(L, 2, narg);
-            cdata_ptr_set(cdata_new(L, rtype, NULL), rvalue);
-        } else {
-            cd = cdata_new(L, rtype, NULL);
-            ffi_call(&cif, FFI_FN(sym), cdata_ptr(cd), values);
-            ccallback_raise_argument_errors(L, 2, narg);
-        }
+    __atomic_add_fetch(&cb->pending, 1, __ATOMIC_ACQ_REL);
 
-        return 1;
-    }
+    /* once pushed, an async msg and cb may be freed by ffi.poll at any time */
+    cqueue_push(q, &msg->node);
+    cqueue_notify(q);
+
+    __atomic_sub_fetch(&q->inflight, 1, __ATOMIC_SEQ_CST);
+
+    if (!sync)
+        return;
 
-    if (rtype->type <= CTYPE_RECORD) {
-        void *rvalue = NULL;
+    pthread_mutex_lock(&msg->lock);
+    while (!msg->done)
+        pthread_cond_wait(&msg->cond, &msg->lock);
+    pthread_mutex_unlock(&msg->lock);
 
-        if (rtype->type != CTYPE_VOID)
-            rvalue = alloca(ctype_sizeof(rtype));
+    pthread_mutex_destroy(&msg->lock);
+    pthread_cond_destroy(&msg->cond);
+    free(msg);
+}
 
-        ffi_call(&cif, FFI_FN(sym), rvalue, values);
-        ccallback_raise_argument_errors(L, 2, narg);
+/* hands a handled call back to its waiting thread, or frees it */
+static void cqueue_msg_done(struct cqueue_msg *msg)
+{
+    __atomic_sub_fetch(&msg->cb->pending, 1, __ATOMIC_ACQ_REL);
 
-        return cdata_to_lua(L, rtype, rvalue);
+    if (!msg->sync) {
+        free(msg);
+        return;
     }
 
-    return luaL_error(L, "unsupported return type '%s'", ctype_name(rtype));
+    pthread_mutex_lock(&msg->lock);
+    msg->done = true;
+    pthread_cond_signal(&msg->cond);
+    pthread_mutex_unlock(&msg->lock);
 }
 
-static int cdata_len(lua_State *L)
+static void ccallback_invoke(ffi_cif *cif, void *ret, void **args, void *userdata)
 {
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct ccallback *cb = userdata;
+    struct cqueue *q = cb->queue;
 
-    if (cd->ct->type != CTYPE_ARRAY) {
-        __ctype_tostring(L, cd->ct);
-        return luaL_error(L, "attempt to get length of non-array cdata<%s>", lua_tostring(L, -1));
+    if (cb->thread != CB_THREAD_NONE && !cqueue_is_owner(q)) {
+        cqueue_deliver(cb, ret, args);
+        return;
     }
 
-    lua_pushinteger(L, cd->ct->array->size);
+    ccallback_call(cb, q->current ? q->current : cb->L, ret, args, false);
+}
 
-    return 1;
+static void ccallback_release(lua_State *L, struct ccallback *cb);
+
+static void cqueue_wait_inflight(struct cqueue *q)
+{
+    while (__atomic_load_n(&q->inflight, __ATOMIC_SEQ_CST))
+        sched_yield();
 }
 
-static int cdata_gc(lua_State *L)
+/* the calls left over are dropped, waiting threads get a zeroed result */
+static int cqueue_gc(lua_State *L)
 {
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    int gc_ref = cd->gc_ref;
+    struct cqueue *q = *(struct cqueue **)lua_touserdata(L, 1);
+    struct cqueue_node *node;
 
-    if (gc_ref != LUA_REFNIL) {
-        lua_rawgeti(L, LUA_REGISTRYINDEX, gc_ref);
-        lua_pushvalue(L, 1);
-        if (lua_pcall(L, 1, 0, 0))
-            lua_pop(L, 1);
-        luaL_unref(L, LUA_REGISTRYINDEX, gc_ref);
-    }
+    __atomic_store_n(&q->closed, true, __ATOMIC_SEQ_CST);
 
-    if (cd->cb) {
-        ccallback_release(L, cd->cb);
-        cd->cb = NULL;
+    /* nothing is pushed once these are done */
+    cqueue_wait_inflight(q);
+
+    while ((node = cqueue_pop(q))) {
+        struct cqueue_msg *msg = (struct cqueue_msg *)node;
+        struct ccallback *cb = msg->cb;
+
+        if (msg->sync && cb->func->rtype->type != CTYPE_VOID)
+            memset(msg->ret, 0, ctype_sizeof(cb->func->rtype));
+
+        cqueue_msg_done(msg);
+
+        if (cb->orphan && !__atomic_load_n(&cb->pending, __ATOMIC_ACQUIRE))
+            ccallback_release(L, cb);
     }
 
-    lua_pushnil(L);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, cd);
+    if (q->fd >= 0)
+        close(q->fd);
+
+    q->fd = -1;
 
     return 0;
 }
 
-static const luaL_Reg cdata_methods[] = {
-    {"__tostring", cdata_tostring},
-    {"__index", cdata_index},
-    {"__newindex", cdata_newindex},
-    {"__eq", cdata_eq},
-    {"__call", cdata_call},
-    {"__len", cdata_len},
-    {"__gc", cdata_gc},
-    {NULL, NULL}
-};
-
-static int lua_ctype_tostring(lua_State *L)
+static void cqueue_init(lua_State *L)
 {
-    struct ctype *ct = luaL_checkudata(L, 1, CTYPE_MT);
+    struct cqueue **qp;
+    struct cqueue *q;
 
-    lua_pushliteral(L, "ctype<");
-    __ctype_tostring(L, ct);
-    lua_pushliteral(L, ">");
-    lua_concat(L, 3);
-
-    return 1;
-}
-
-static int ctype_gc(lua_State *L)
-{
-    struct ctype *ct = luaL_checkudata(L, 1, CTYPE_MT);
-    int type = ct->type;
-
-    if (type == CTYPE_RECORD && ct->rc->anonymous) {
-        int i;
-        for (i = 0; i < ct->rc->nfield; i++)
-            free(ct->rc->fields[i]);
+    /* foreign threads may still be delivering while the state closes */
+    qp = lua_newuserdata(L, sizeof(struct cqueue *));
+    q = *qp = calloc(1, sizeof(struct cqueue));
+    if (!q)
+        luaL_error(L, "no mem");
 
-        if (ct->rc->mt_ref != LUA_REFNIL)
-            luaL_unref(L, LUA_REGISTRYINDEX, ct->rc->mt_ref);
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+    q->owner = pthread_self();
+    q->closed = false;
+    q->inflight = 0;
+    q->current = NULL;
+    q->fd = -1;
+
+    /* a thread of its own, the loading one may be a coroutine that ends */
+    q->main = lua_newthread(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &cthread_registry);
+
+#ifdef __linux__
+    q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
 
-        free(ct->rc);
-    }
+    lua_newtable(L);
+    lua_pushcfunction(L, cqueue_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
 
-    return 0;
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &cqueue_registry);
 }
 
-static const luaL_Reg ctype_methods[] = {
-    {"__tostring", lua_ctype_tostring},
-    {"__gc", ctype_gc},
-    {NULL, NULL}
-};
-
-static int clib_index(lua_State *L)
+static struct cqueue *cqueue_get(lua_State *L)
 {
-    struct clib *lib = luaL_checkudata(L, 1, CLIB_MT);
-    const char *name = luaL_checkstring(L, 2);
-    struct ctype match = { .type = CTYPE_FUNC };
-    struct ctype *ct;
-    void *sym;
+    struct cqueue *q;
 
-    lua_rawgetp(L, LUA_REGISTRYINDEX, lib);
-    lua_getfield(L, -1, name);
-    if (!lua_isnil(L, -1))
-        goto done;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &cqueue_registry);
+    q = *(struct cqueue **)lua_touserdata(L, -1);
     lua_pop(L, 1);
 
-    lua_rawgetp(L, LUA_REGISTRYINDEX, &cfunc_registry);
-    lua_getfield(L, -1, name);
-
-    if (lua_isnil(L, -1))
-        return luaL_error(L, "missing declaration for function '%s", name);
-
-    match.func = (struct cfunc *)lua_topointer(L, -1);
-    lua_pop(L, 2);
-
-    ct = ctype_lookup(L, &match, false);
-
-    sym = dlsym(lib->h, name);
-    if (!sym)
-        return luaL_error(L, "undefined function '%s'", name);
-
-    cdata_ptr_set(cdata_new(L, ct, NULL), sym);
-    lua_pushvalue(L, -1);
-    lua_setfield(L, -3, name);
-
-done:
-    lua_remove(L, -2);
-    return 1;
+    return q;
 }
 
-static int clib_tostring(lua_State *L)
+/* once the callbacks pointing to it are freed, after cqueue_gc */
+static void cqueue_free(struct cqueue *q)
 {
-    struct clib *lib = luaL_checkudata(L, 1, CLIB_MT);
-    if (lib->h == RTLD_DEFAULT)
-        lua_pushliteral(L, "library: default");
-    else
-        lua_pushfstring(L, "library: %p", lib->h);
-    return 1;
+    cqueue_wait_inflight(q);
+    free(q);
 }
 
-static int clib_gc(lua_State *L)
+static void ccallback_free(struct ccallback *cb)
 {
-    struct clib *lib = luaL_checkudata(L, 1, CLIB_MT);
-    void *h = lib->h;
-
-    if (h != RTLD_DEFAULT)
-        dlclose(h);
-
-    lua_pushnil(L);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, lib);
-
-    return 0;
-}
-
-static const luaL_Reg clib_methods[] = {
-    {"__index", clib_index},
-    {"__tostring", clib_tostring},
-    {"__gc", clib_gc},
-    {NULL, NULL}
-};
+    if (cb->closure)
+        ffi_closure_free(cb->closure);
 
-static int cparse_expected_error(lua_State *L, int tok, const char *s)
-{
-    if (tok)
-        return luaL_error(L, "%d:'%s' expected before '%s'", yyget_lineno(), s, yyget_text());
-    else
-        return luaL_error(L, "%d:identifier expected", yyget_lineno());
+    free(cb);
 }
 
-static void ctype_to_ptr(lua_State *L, struct ctype *ct)
+/* callbacks go back to the pool of their function type while it has room */
+static void ccallback_release(lua_State *L, struct ccallback *cb)
 {
-    struct ctype *ptr = ctype_lookup(L, ct, false);
-    ct->type = CTYPE_PTR;
-    ct->is_const = false;
-    ct->ptr = ptr;
-}
-
-extern char *lex_err;
+    struct cfunc *func;
+    int i;
 
-static inline int cparse_check_tok(lua_State *L, int tok)
-{
-    if (!tok && lex_err)
-        return luaL_error(L, "%d:%s", yyget_lineno(), lex_err);
-    return tok;
-}
+    if (!cb || cb->ctx)
+        return;
 
-static int cparse_pointer(lua_State *L, int tok, struct ctype *ct)
-{
-    while (cparse_check_tok(L, tok) == '*') {
-        ctype_to_ptr(L, ct);
-        tok = yylex();
+    /* still queued calls must run the right function, ffi.poll releases it later */
+    if (__atomic_load_n(&cb->pending, __ATOMIC_ACQUIRE)) {
+        cb->orphan = true;
+        return;
     }
 
-    if (cparse_check_tok(L, tok) == TOK_CONST) {
-        ct->is_const = true;
-        tok = yylex();
-    }
+    cb->orphan = false;
+    func = cb->func;
 
-    return tok;
-}
+    if (cb->fn_ref != LUA_REFNIL)
+        luaL_unref(L, LUA_REGISTRYINDEX, cb->fn_ref);
 
-static int cparse_array(lua_State *L, int tok, bool *flexible, int *size)
-{
-    *size = -1;
+    if (cb->err_ref != LUA_REFNIL)
+        luaL_unref(L, LUA_REGISTRYINDEX, cb->err_ref);
 
-    if (cparse_check_tok(L, tok) != '[') {
-        *flexible = false;
-        return tok;
+    for (i = 0; i < func->narg; i++) {
+        if (cb->cursors[i].ref != LUA_REFNIL)
+            luaL_unref(L, LUA_REGISTRYINDEX, cb->cursors[i].ref);
+        cb->cursors[i].ref = LUA_REFNIL;
+        cb->cursors[i].cd = NULL;
     }
 
-    tok = yylex();
-
-    if (!*flexible && cparse_check_tok(L, tok) != TOK_INTEGER)
-        return luaL_error(L, "%d:flexible array not supported at here", yyget_lineno());
-
-    *flexible = false;
-
-    if (cparse_check_tok(L, tok) == TOK_INTEGER || cparse_check_tok(L, tok) == '?') {
-        if (cparse_check_tok(L, tok) == TOK_INTEGER) {
-            *size = atoi(yyget_text());
-            if (*size < 0)
-                return luaL_error(L, "%d:size of array is negative", yyget_lineno());
-        } else {
-            *flexible = true;
-        }
-        tok = yylex();
-    } else {
-        *flexible = true;
+    if (func->cb_idle >= CFUNC_CB_POOL_SIZE) {
+        ccallback_free(cb);
+        return;
     }
 
-    if (cparse_check_tok(L, tok) != ']')
-        return cparse_expected_error(L, tok, "]");
-
-    return yylex();
+    cb->fn_ref = LUA_REFNIL;
+    cb->err_ref = LUA_REFNIL;
+    cb->next = func->cb_pool;
+    func->cb_pool = cb;
+    func->cb_idle++;
 }
 
-static int cparse_packed_attribute(lua_State *L, int tok, bool *is_packed)
+static ffi_cif *cfunc_cif(lua_State *L, struct cfunc *func);
+
+static struct ccallback *ccallback_new(lua_State *L, struct cfunc *func, int idx,
+        int ptr_mode, int thread)
 {
-    while (cparse_check_tok(L, tok) == TOK_NAME && !strcmp(yyget_text(), "__attribute__")) {
-        int depth = 2;
+    struct ccallback *cb;
+    ffi_cif *cif;
+    int status;
+    int i;
 
-        tok = yylex();
-        if (cparse_check_tok(L, tok) != '(')
-            return cparse_expected_error(L, tok, "(");
+    if (func->va)
+        luaL_error(L, "cannot create callback for variadic function type");
 
-        tok = yylex();
-        if (cparse_check_tok(L, tok) != '(')
-            return cparse_expected_error(L, tok, "(");
+    if (thread == CB_THREAD_ASYNC && func->rtype->type != CTYPE_VOID)
+        luaL_error(L, "async callbacks must return void");
 
-        tok = yylex();
+    cif = cfunc_cif(L, func);
 
-        while (depth > 0) {
-            if (!cparse_check_tok(L, tok))
-                return luaL_error(L, "%d:unterminated __attribute__", yyget_lineno());
+    if (func->cb_pool) {
+        cb = func->cb_pool;
+        func->cb_pool = cb->next;
+        func->cb_idle--;
+        func->cb_reused++;
+    } else {
+        cb = calloc(1, sizeof(struct ccallback) + sizeof(struct ccallback_cursor) * func->narg);
+        if (!cb)
+            luaL_error(L, "no mem");
 
-            if (tok == TOK_NAME && depth == 2
-                    && (!strcmp(yyget_text(), "packed") || !strcmp(yyget_text(), "__packed__"))) {
-                *is_packed = true;
-            }
+        cb->func = func;
 
-            if (tok == '(')
-                depth++;
-            else if (tok == ')')
-                depth--;
+        for (i = 0; i < func->narg; i++)
+            cb->cursors[i].ref = LUA_REFNIL;
 
-            tok = yylex();
+        cb->closure = ffi_closure_alloc(sizeof(ffi_closure), &cb->code);
+        if (!cb->closure) {
+            ccallback_free(cb);
+            luaL_error(L, "no mem");
         }
-    }
-
-    return tok;
-}
-
-static int cparse_basetype(lua_State *L, int tok, struct ctype *ct);
 
-static void init_ft_struct(lua_State *L, ffi_type *ft, ffi_type **elements, size_t *offsets)
-{
-    int status;
+        status = ffi_prep_closure_loc(cb->closure, cif, ccallback_invoke, cb, cb->code);
+        if (status) {
+            ccallback_free(cb);
+            luaL_error(L, "ffi callback setup fail: %d", status);
+        }
 
-    ft->type = FFI_TYPE_STRUCT;
-    ft->elements = elements;
+        func->cb_created++;
+    }
 
-    status = ffi_get_struct_offsets(FFI_DEFAULT_ABI, ft, offsets);
-    if (status)
-        luaL_error(L, "ffi_get_struct_offsets fail: %d", status);
-}
+    cb->L = cqueue_get(L)->main;
+    cb->next = NULL;
+    cb->err_ref = LUA_REFNIL;
+    cb->ptr_mode = ptr_mode;
+    cb->ctx = 0;
+    cb->thread = thread;
+    cb->queue = cqueue_get(L);
+    cb->fn_ref = LUA_REFNIL;
 
-static void cparse_new_array(lua_State *L, size_t array_size, struct ctype *ct)
-{
-    struct carray *a = carray_lookup(L, array_size, ct);
+    if (idx) {
+        lua_pushvalue(L, idx);
+        cb->fn_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
 
-    ct->type = CTYPE_ARRAY;
-    ct->is_const = false;
-    ct->array = a;
-}
+    if (ptr_mode == CB_PTR_CURSOR) {
+        for (i = 0; i < func->narg; i++) {
+            if (func->args[i]->type != CTYPE_PTR)
+                continue;
 
-static void check_void_forbidden(lua_State *L, struct ctype *ct, int tok)
-{
-    if (ct->type != CTYPE_VOID)
-        return;
+            cb->cursors[i].cd = cdata_new(L, func->args[i], NULL);
+            cb->cursors[i].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+    }
 
-    if (tok)
-        luaL_error(L, "%d:void type in forbidden context near '%s'",
-                yyget_lineno(), yyget_text());
-    else
-        luaL_error(L, "%d:void type in forbidden context", yyget_lineno());
+    return cb;
 }
 
-static int cparse_record(lua_State *L, struct ctype *ct, bool is_union);
-
-static int cparse_record_field(lua_State *L, struct crecord_field **fields)
+static bool cdata_from_lua_table(lua_State *L, struct ctype *ct, void *ptr, int idx, bool cast)
 {
-    int nfield = 0;
-    int tok, i;
-
-    while (true) {
-        struct crecord_field *field;
-        struct ctype bt = {}, ct;
-        bool flexible = false;
-        int array_size;
-        char *name;
-
-        tok = yylex();
+    int i = 0;
 
-        if (cparse_check_tok(L, tok) == '}')
-            return nfield;
+    if (ct->type == CTYPE_ARRAY) {
+        lua_pushnil(L);
 
-        if (cparse_check_tok(L, tok) == TOK_STRUCT || cparse_check_tok(L, tok) == TOK_UNION) {
-            tok = cparse_record(L, &bt, cparse_check_tok(L, tok) == TOK_UNION);
-            if (tok == ';') {
-                field = calloc(1, sizeof(struct crecord_field) + 1);
-                if (!field)
-                    return luaL_error(L, "no mem");
-                ct = bt;
-                goto add;
+        while (lua_next(L, idx)) {
+            if (lua_isinteger(L, -2)) {
+                i = lua_tointeger(L, -2) - 1;
+                if (i < ct->array->size)
+                    cdata_from_lua(L, ct->array->ct, ptr + ctype_sizeof(ct->array->ct) * i,
+                            lua_absindex(L, -1), cast);
             }
-        } else {
-            tok = cparse_basetype(L, tok, &bt);
+            lua_pop(L, 1);
         }
 
-again:
-        ct = bt;
-
-        tok = cparse_pointer(L, tok, &ct);
-
-        check_void_forbidden(L, &ct, tok);
-
-        if (cparse_check_tok(L, tok) != TOK_NAME)
-            return cparse_expected_error(L, tok, "identifier");
-
-        name = yyget_text();
-
-        for (i = 0; i < nfield; i++)
-            if (!strcmp(fields[i]->name, name))
-                return luaL_error(L, "%d:duplicate member'%s'", yyget_lineno(), name);
-
-        field = calloc(1, sizeof(struct crecord_field) + yyget_leng() + 1);
-        if (!field)
-            return luaL_error(L, "no mem");
-
-        memcpy(field->name, name, yyget_leng());
-
-        tok = cparse_array(L, yylex(), &flexible, &array_size);
-
-        if (array_size >= 0)
-            cparse_new_array(L, array_size, &ct);
+        return true;
+    } else if (ct->type == CTYPE_RECORD) {
+        while (i < ct->rc->nfield) {
+            struct crecord_field *field = ct->rc->fields[i++];
 
-add:
-        field->ct = ctype_lookup(L, &ct, false);
-        fields[nfield++] = field;
+            lua_rawgeti(L, idx, i);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_getfield(L, idx, field->name);
+            }
 
-        if (cparse_check_tok(L, tok) == ',') {
-            tok = yylex();
-            goto again;
+            if (!lua_isnil(L, -1))
+                cdata_from_lua(L, field->ct, ptr + field->offset, lua_absindex(L, -1), cast);
+            lua_pop(L, 1);
         }
-
-        if (cparse_check_tok(L, tok) != ';')
-            return cparse_expected_error(L, tok, ";");
+        return true;
     }
-}
 
-static inline bool ctype_is_zero_array(struct ctype *ct)
-{
-    return ct->type == CTYPE_ARRAY && ct->array->size == 0;
+    return false;
 }
 
-static void cparse_record_packed_layout(struct crecord *rc)
+static int cdata_from_lua(lua_State *L, struct ctype *ct, void *ptr, int idx, bool cast)
 {
-    size_t size = 0;
-    int i;
+    switch (ct->type) {
+    case CTYPE_FUNC:
+    case CTYPE_VOID:
+        luaL_error(L, "invalid C type");
+        break;
+    case CTYPE_ARRAY:
+    case CTYPE_RECORD:
+        if (cast)
+            luaL_error(L, "invalid C type");
+        break;
+    default:
+        break;
+    }
 
-    rc->ft.type = FFI_TYPE_STRUCT;
-    rc->ft.alignment = 1;
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        if (ct->type == CTYPE_PTR) {
+            *(void **)ptr = NULL;
+            return 0;
+        }
+        break;
+    case LUA_TNUMBER:
+    case LUA_TBOOLEAN:
+        if (cdata_from_lua_num(L, ct, ptr, idx, cast))
+            return 0;
+        break;
+    case LUA_TSTRING:
+        if (cast || ((ctype_ptr_to(ct, CTYPE_CHAR) || ctype_ptr_to(ct, CTYPE_VOID))
+            && ct->ptr->is_const)) {
+            *(const char **)ptr = (const char *)lua_tostring(L, idx);
+            return 0;
+        }
 
-    if (rc->is_union) {
-        for (i = 0; i < rc->nfield; i++) {
-            size_t field_size = ctype_sizeof(rc->fields[i]->ct);
+        if (ct->type == CTYPE_ARRAY && ct->array->ct->type == CTYPE_CHAR) {
+            size_t len;
+            const char *str = lua_tolstring(L, idx, &len);
+            memcpy(ptr, str, len + 1);
+            return 0;
+        }
+        break;
+    case LUA_TUSERDATA:
+        if (luaL_testudata(L, idx, CDATA_MT)) {
+            if (cdata_from_lua_cdata(L, ct, ptr, idx, cast))
+                return 0;
+        } else if (ct->type == CTYPE_PTR) {
+            void *ud = lua_touserdata(L, idx);
 
-            rc->fields[i]->offset = 0;
+            if (luaL_testudata(L, idx, LUA_FILEHANDLE)) {
+                *(void **)ptr = *(void **)ud;
+                return 0;
+            }
 
-            if (field_size > size)
-                size = field_size;
+            if (cast || ctype_ptr_to(ct, CTYPE_VOID)) {
+                *(void **)ptr = ud;
+                return 0;
+            }
         }
-
-        rc->ft.size = size;
-        return;
+        break;
+    case LUA_TLIGHTUSERDATA:
+        if (ct->type == CTYPE_PTR) {
+            *(void **)ptr = lua_touserdata(L, idx);
+            return 0;
+        }
+        break;
+    case LUA_TTABLE:
+        if (cdata_from_lua_table(L, ct, ptr, idx, cast))
+            return 0;
+        break;
+    case LUA_TFUNCTION:
+        if (cast && ct->type == CTYPE_PTR && ct->ptr->type == CTYPE_FUNC)
+            return luaL_argerror(L, idx, "cast callback with ffi.cast so callback lifetime can be tracked");
+        break;
+    default:
+        break;
     }
 
-    for (i = 0; i < rc->nfield; i++) {
-        rc->fields[i]->offset = size;
-
-        if (!ctype_is_zero_array(rc->fields[i]->ct))
-            size += ctype_sizeof(rc->fields[i]->ct);
+    if (luaL_testudata(L, idx, CDATA_MT)) {
+        struct cdata *cd = lua_touserdata(L, idx);
+        __ctype_tostring(L, cd->ct);
+        __ctype_tostring(L, ct);
+        lua_pushfstring(L, "cannot convert '%s' to '%s'", lua_tostring(L, -2), lua_tostring(L, -1));
+    } else {
+        __ctype_tostring(L, ct);
+        lua_pushfstring(L, "cannot convert '%s' to '%s'", luaL_typename(L, idx), lua_tostring(L, -1));
     }
-
-    rc->ft.size = size;
+    return luaL_argerror(L, idx, lua_tostring(L, -1));
 }
 
-static int cparse_record(lua_State *L, struct ctype *ct, bool is_union)
+static int cdata_index_ptr(lua_State *L, struct cdata *cd, struct ctype *ct, bool to)
 {
-    bool named = false;
-    bool packed = false;
-    int tok = yylex();
-
-    ct->type = CTYPE_RECORD;
-
-    tok = cparse_packed_attribute(L, tok, &packed);
+    void *ptr = cdata_type(cd) == CTYPE_PTR ? cdata_ptr_ptr(cd) : cdata_ptr(cd);
+    int idx;
 
-    if (cparse_check_tok(L, tok) == TOK_NAME) {
-        named = true;
-        lua_pushstring(L, yyget_text());
-        tok = yylex();
+    if (ct->type == CTYPE_VOID) {
+        __ctype_tostring(L, cd->ct);
+        return luaL_error(L, "ctype '%s' cannot be indexed", lua_tostring(L, -1));
     }
 
-    tok = cparse_packed_attribute(L, tok, &packed);
+    if (!lua_isinteger(L, 2)) {
+        __ctype_tostring(L, cd->ct);
+        return luaL_error(L, "ctype '%s' cannot be indexed with %s", lua_tostring(L, -1), luaL_typename(L, 2));
+    }
 
-    if (cparse_check_tok(L, tok) == '{') {
-        struct crecord_field *fields[MAX_RECORD_FIELDS];
-        size_t offsets[MAX_RECORD_FIELDS];
-        ffi_type **elements;
-        size_t nfield = 0;
-        int i, j, nelement, next_tok;
+    idx = lua_tointeger(L, 2);
 
-        if (named) {
-            lua_rawgetp(L, LUA_REGISTRYINDEX, &crecord_registry);
-            lua_pushvalue(L, -2);
-            lua_gettable(L, -2);
+    if (to) {
+        return ccache_push_child(L, cd, ct, ptr + ctype_sizeof(ct) * idx);
+    } else {
+        return cdata_from_lua(L, ct, ptr + ctype_sizeof(ct) * idx, 3, false);
+    }
+}
 
-            if (!lua_isnil(L, -1))
-                return luaL_error(L, "%d:redefinition of symbol '%s'", yyget_lineno(), lua_tostring(L, -3));
-            lua_pop(L, 1);
-        }
+/* FNV-1a */
+static uint32_t cfield_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
 
-        nfield = cparse_record_field(L, fields);
-        next_tok = cparse_packed_attribute(L, yylex(), &packed);
+    for (i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
 
-        if (is_union) {
-            nelement = 2;
-        } else {
-            nelement = nfield + 1;
+    return h;
+}
 
-            for (i = 0; i < nfield; i++) {
-                if (ctype_is_zero_array(fields[i]->ct))
-                    nelement--;
-            }
-        }
+/*
+ * Finds a member by a name pushed by Lua. Names interned by Lua share the
+ * pointer of the index, others are compared by contents.
+ */
+static struct crecord_index *crecord_find(struct crecord *rc, const char *name, size_t len)
+{
+    uint32_t h;
+    size_t i;
 
-        ct->rc = calloc(1, sizeof(struct crecord)
-                        + sizeof(struct crecord_field *) * nfield
-                        + sizeof(ffi_type *) * nelement);
-        if (!ct->rc)
-            return luaL_error(L, "no mem");
+    if (!rc->index)
+        return NULL;
 
-        ct->rc->mt_ref = LUA_REFNIL;
+    h = cfield_hash(name, len);
 
-        memcpy(ct->rc->fields, fields, sizeof(struct crecord_field *) * nfield);
+    for (i = h & rc->index_mask; rc->index[i].name; i = (i + 1) & rc->index_mask) {
+        struct crecord_index *m = &rc->index[i];
 
-        if (named) {
-            lua_pushvalue(L, -2);
-            lua_pushlightuserdata(L, ct->rc);
-            lua_settable(L, -3);
-            lua_pop(L, 2);
-        } else {
-            ct->rc->anonymous = true;
-        }
+        if (m->name == name || (m->hash == h && !strcmp(m->name, name)))
+            return m;
+    }
 
-        ct->rc->is_union = is_union;
-        ct->rc->nfield = nfield;
-        ct->rc->packed = packed;
+    return NULL;
+}
 
-        elements = (ffi_type **)&ct->rc->fields[nfield];
+static int cdata_index_crecord(lua_State *L, struct cdata *cd, struct ctype *ct, bool to)
+{
+    void *ptr = cdata_type(cd) == CTYPE_PTR ? cdata_ptr_ptr(cd) : cdata_ptr(cd);
+    struct crecord *rc = ct->rc;
+    struct crecord_index *field;
+    const char *name;
+    size_t len;
 
-        if (is_union) {
-            for (i = 0; i < nfield; i++) {
-                if (!ctype_is_zero_array(fields[i]->ct)) {
-                    ffi_type *ft = ctype_ft(fields[i]->ct);
-                    if (i == 0 || ft->size > elements[0]->size)
-                        elements[0] = ft;
-                }
-            }
+    if (lua_type(L, 2) != LUA_TSTRING)
+        return luaL_error(L, "struct must be indexed with string");
 
-            if (!elements[0])
-                nelement--;
-        } else {
-            for (i = 0, j = 0; i < nfield; i++) {
-                if (ctype_is_zero_array(fields[i]->ct))
-                    continue;
-                elements[j++] = ctype_ft(fields[i]->ct);
-            }
-        }
+    name = lua_tolstring(L, 2, &len);
 
-        ct->rc->ft.type = FFI_TYPE_STRUCT;
-        ct->rc->ft.elements = elements;
+    field = crecord_find(rc, name, len);
+    if (!field) {
+        if (to) {
+            if (rc->mflags & METATYPE_FLAG_INDEX) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, rc->mt_ref);
+                lua_getfield(L, -1, "__index");
 
-        if (packed) {
-            cparse_record_packed_layout(ct->rc);
-        } else {
-            if (nelement > 1)
-                init_ft_struct(L, &ct->rc->ft, elements, offsets);
+                if (lua_isfunction(L, -1))
+                    return 1;
 
-            if (!is_union) {
-                for (i = 0, j = 0; i < nfield; i++) {
-                    if (ctype_is_zero_array(fields[i]->ct)) {
-                        if (i > 0)
-                            ct->rc->fields[i]->offset = fields[i - 1]->offset + ctype_sizeof(fields[i - 1]->ct);
-                    } else {
-                        ct->rc->fields[i]->offset = offsets[j++];
-                    }
+                if (lua_istable(L, -1)) {
+                    lua_getfield(L, -1, name);
+                    if (!lua_isnil(L, -1))
+                        return 1;
                 }
             }
         }
 
-        return next_tok;
+        __ctype_tostring(L, ct);
+        return luaL_error(L, "ctype '%s' has no member named '%s'", lua_tostring(L, -1), name);
+    }
+
+    if (to) {
+        return ccache_push_child(L, cd, field->ct, ptr + field->offset);
     } else {
-        if (!named)
-            return cparse_expected_error(L, tok, "identifier");
+        return cdata_from_lua(L, field->ct, ptr + field->offset, 3, false);
+    }
+}
 
-        lua_rawgetp(L, LUA_REGISTRYINDEX, &crecord_registry);
-        lua_pushvalue(L, -2);
-        lua_gettable(L, -2);
+static int cdata_index_common(lua_State *L, bool to)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct ctype *ct = cd->ct;
 
-        if (lua_isnil(L, -1))
-            return luaL_error(L, "%d:undeclared of symbol '%s", yyget_lineno(), lua_tostring(L, -3));
+    if (!to && ct->is_const)
+        return luaL_error(L, "assignment of read-only variable");
 
-        ct->rc = (struct crecord *)lua_topointer(L, -1);
-        lua_pop(L, 3);
+    switch (ct->type) {
+    case CTYPE_RECORD:
+        return cdata_index_crecord(L, cd, ct, to);
+    case CTYPE_PTR:
+        if (ctype_ptr_to(ct, CTYPE_RECORD) && lua_type(L, 2) == LUA_TSTRING)
+            return cdata_index_crecord(L, cd, ct->ptr, to);
+        return cdata_index_ptr(L, cd, ct->ptr, to);
+    case CTYPE_ARRAY:
+        return cdata_index_ptr(L, cd, ct->array->ct, to);
+    default:
+        __ctype_tostring(L, cd->ct);
+        return luaL_error(L, "ctype '%s' cannot be indexed", lua_tostring(L, -1));
     }
-
-    return tok;
 }
 
-static int cparse_squals(int type, int squals, struct ctype *ct, ffi_type *s, ffi_type *u)
+static int cdata_index(lua_State *L)
 {
-    ct->type = s ? ++type : type;
-    ct->ft = squals == TOK_SIGNED ? s : u;
-    return yylex();
+    return cdata_index_common(L, true);
 }
 
-static int cparse_basetype(lua_State *L, int tok, struct ctype *ct)
+static int cdata_newindex(lua_State *L)
 {
-    ct->is_const = false;
+    return cdata_index_common(L, false);
+}
 
-    if (cparse_check_tok(L, tok) == TOK_CONST) {
-        ct->is_const = true;
-        tok = yylex();
-    }
+static int cdata_eq(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    int type = cdata_type(cd);
+    struct cdata *a;
+    bool eq = false;
 
-    if (cparse_check_tok(L, tok) == TOK_SIGNED || cparse_check_tok(L, tok) == TOK_UNSIGNED) {
-        int squals = tok;
+    switch (type) {
+    case CTYPE_RECORD:
+    case CTYPE_ARRAY:
+    case CTYPE_FUNC:
+        break;
+    case CTYPE_PTR:
+        if (lua_isnil(L, 2)) {
+            eq = cdata_ptr_ptr(cd) == NULL;
+            break;
+        }
 
-        tok = yylex();
+        a = luaL_testudata(L, 2, CDATA_MT);
+        if (a && cdata_type(a) == CTYPE_PTR)
+            eq = cdata_ptr_ptr(cd) == cdata_ptr_ptr(a);
 
-        switch (tok) {
-        case TOK_CHAR:
-            tok = cparse_squals(CTYPE_CHAR, squals, ct, &ffi_type_schar, &ffi_type_uchar);
-            break;
-        case TOK_SHORT:
-            tok = cparse_squals(CTYPE_SHORT, squals, ct, &ffi_type_sshort, &ffi_type_ushort);
-            break;
-        case TOK_INT:
-            tok = cparse_squals(CTYPE_INT, squals, ct, &ffi_type_sint, &ffi_type_uint);
-            break;
-        case TOK_LONG:
-            tok = cparse_squals(CTYPE_LONG, squals, ct, &ffi_type_slong, &ffi_type_ulong);
+        break;
+    default:
+        a = luaL_testudata(L, 2, CDATA_MT);
+        if (a && ctype_is_int(cd->ct) && ctype_is_int(a->ct)) {
+            eq = cint_load(cd->ct, cdata_ptr(cd)) == cint_load(a->ct, cdata_ptr(a));
             break;
-        default:
-            ct->type = CTYPE_INT;
-            ct->ft = (squals == TOK_SIGNED) ? &ffi_type_sint : &ffi_type_uint;
+        }
+
+        cdata_to_lua(L, cd->ct, cdata_ptr(cd));
+        eq = lua_equal(L, 2, -1);
+        lua_pop(L, 1);
+    }
+
+    lua_pushboolean(L, eq);
+    return 1;
+}
+
+/*
+ * Arithmetic on scalar cdata. Integers are computed on 64 bits as C does,
+ * giving an uint64_t cdata if either operand is a 64-bit unsigned cdata,
+ * else an int64_t one. Floating point operands give Lua numbers.
+ */
+enum {
+    CARITH_ADD,
+    CARITH_SUB,
+    CARITH_MUL,
+    CARITH_DIV,
+    CARITH_IDIV,
+    CARITH_MOD,
+    CARITH_POW,
+    CARITH_UNM,
+    CARITH_BAND,
+    CARITH_BOR,
+    CARITH_BXOR,
+    CARITH_BNOT,
+    CARITH_SHL,
+    CARITH_SHR,
+    CARITH_SET
+};
+
+/* operand kinds */
+enum {
+    CARITH_ARG_INT,
+    CARITH_ARG_U64,     /* a 64-bit unsigned cdata */
+    CARITH_ARG_NUM      /* a floating point cdata or a non-integral number */
+};
+
+/* integral numbers beyond int64_t but in the range of uint64_t are unsigned */
+static int cint_from_number(lua_Number v, uint64_t *i)
+{
+    if (floor(v) != v)
+        return CARITH_ARG_NUM;
+
+    if (v >= -9223372036854775808.0 && v < 9223372036854775808.0) {
+        *i = (int64_t)v;
+        return CARITH_ARG_INT;
+    }
+
+    if (v >= 0 && v < 18446744073709551616.0) {
+        *i = (uint64_t)v;
+        return CARITH_ARG_U64;
+    }
+
+    return CARITH_ARG_NUM;
+}
+
+static int carith_arg(lua_State *L, int idx, const char *what, uint64_t *i, lua_Number *n)
+{
+    struct cdata *cd;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM > 502
+        if (lua_isinteger(L, idx)) {
+            *i = lua_tointeger(L, idx);
+            *n = (lua_Number)(int64_t)*i;
+            return CARITH_ARG_INT;
+        }
+#endif
+        *n = lua_tonumber(L, idx);
+        return cint_from_number(*n, i);
+    case LUA_TUSERDATA:
+        cd = luaL_testudata(L, idx, CDATA_MT);
+        if (!cd)
             break;
+
+        if (!ctype_is_num(cd->ct)) {
+            __ctype_tostring(L, cd->ct);
+            return luaL_error(L, "attempt to %s cdata<%s>", what, lua_tostring(L, -1));
         }
-    } else if (cparse_check_tok(L, tok) == TOK_STRUCT || cparse_check_tok(L, tok) == TOK_UNION) {
-        tok = cparse_record(L, ct, cparse_check_tok(L, tok) == TOK_UNION);
-    } else {
-#define INIT_TYPE(t1, t2) \
-            ct->type = t1; \
-            ct->ft = &t2; \
-            break
 
-#define INIT_TYPE_T(t1, t2, s) \
-            ct->type = t1; \
-            ct->ft = ffi_type_of(sizeof(t2), s); \
-            break
+        if (!ctype_is_int(cd->ct)) {
+            cdata_to_lua(L, cd->ct, cdata_ptr(cd));
+            *n = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+            return CARITH_ARG_NUM;
+        }
 
-        switch (tok) {
-        case TOK_VOID:
-            INIT_TYPE(CTYPE_VOID, ffi_type_void);
-        case TOK_BOOL:
-            INIT_TYPE(CTYPE_BOOL, ffi_type_sint8);
-        case TOK_CHAR:
-            INIT_TYPE(CTYPE_CHAR, ffi_type_schar);
-        case TOK_SHORT:
-            INIT_TYPE(CTYPE_SHORT, ffi_type_sshort);
-        case TOK_INT:
-            INIT_TYPE(CTYPE_INT, ffi_type_sint);
-        case TOK_LONG:
-            INIT_TYPE(CTYPE_LONG, ffi_type_slong);
-        case TOK_FLOAT:
-            INIT_TYPE(CTYPE_FLOAT, ffi_type_float);
-        case TOK_DOUBLE:
-            INIT_TYPE(CTYPE_DOUBLE, ffi_type_double);
-        case TOK_INT8_T:
-            INIT_TYPE_T(CTYPE_INT8_T, int8_t, true);
-        case TOK_INT16_T:
-            INIT_TYPE_T(CTYPE_INT16_T, int16_t, true);
-        case TOK_INT32_T:
-            INIT_TYPE_T(CTYPE_INT32_T, int32_t, true);
-        case TOK_INT64_T:
-            INIT_TYPE_T(CTYPE_INT64_T, int64_t, true);
-        case TOK_UINT8_T:
-            INIT_TYPE_T(CTYPE_UINT8_T, uint8_t, false);
-        case TOK_UINT16_T:
-            INIT_TYPE_T(CTYPE_UINT16_T, uint16_t, false);
-        case TOK_UINT32_T:
-            INIT_TYPE_T(CTYPE_UINT32_T, uint32_t, false);
-        case TOK_UINT64_T:
-            INIT_TYPE_T(CTYPE_UINT64_T, uint64_t, false);
-        case TOK_OFF_T:
-            INIT_TYPE_T(CTYPE_OFF_T, off_t, true);
-        case TOK_INO_T:
-            INIT_TYPE_T(CTYPE_INO_T, ino_t, false);
-        case TOK_DEV_T:
-            INIT_TYPE_T(CTYPE_DEV_T, dev_t, false);
-        case TOK_GID_T:
-            INIT_TYPE_T(CTYPE_GID_T, gid_t, false);
-        case TOK_MODE_T:
-            INIT_TYPE_T(CTYPE_MODE_T, mode_t, false);
-        case TOK_NLINK_T:
-            INIT_TYPE_T(CTYPE_NLINK_T, nlink_t, false);
-        case TOK_UID_T:
-            INIT_TYPE_T(CTYPE_UID_T, uid_t, false);
-        case TOK_PID_T:
-            INIT_TYPE_T(CTYPE_PID_T, pid_t, true);
-        case TOK_SIZE_T:
-            INIT_TYPE_T(CTYPE_SIZE_T, size_t, false);
-        case TOK_SSIZE_T:
-            INIT_TYPE_T(CTYPE_SSIZE_T, ssize_t, true);
-        case TOK_USECONDS_T:
-            INIT_TYPE_T(CTYPE_USECONDS_T, useconds_t, false);
-        case TOK_SUSECONDS_T:
-            INIT_TYPE_T(CTYPE_SUSECONDS_T, suseconds_t, true);
-        case TOK_BLKSIZE_T:
-            INIT_TYPE_T(CTYPE_BLKSIZE_T, blksize_t, true);
-        case TOK_BLKCNT_T:
-            INIT_TYPE_T(CTYPE_BLKCNT_T, blkcnt_t, true);
-        case TOK_TIME_T:
-            INIT_TYPE_T(CTYPE_TIME_T, time_t, true);
-        case TOK_NAME:
-            lua_rawgetp(L, LUA_REGISTRYINDEX, &ctdef_registry);
-            lua_getfield(L, -1, yyget_text());
-            if (!lua_isnil(L, -1)) {
-                *ct = *(struct ctype *)lua_touserdata(L, -1);
-                lua_pop(L, 2);
-                break;
-            }
-        default:
-            return luaL_error(L, "%d:unknown type name '%s'", yyget_lineno(), yyget_text());
+        *i = cint_load(cd->ct, cdata_ptr(cd));
+
+        if (cd->ct->ft->type == FFI_TYPE_UINT64) {
+            *n = (lua_Number)*i;
+            return CARITH_ARG_U64;
         }
-        tok = yylex();
-#undef INIT_TYPE
-#undef INIT_TYPE_T
+
+        *n = (lua_Number)(int64_t)*i;
+        return CARITH_ARG_INT;
     }
 
-    if (cparse_check_tok(L, tok) == TOK_INT) {
-        switch (ct->type) {
-        case CTYPE_LONG:
-        case CTYPE_ULONG:
-            tok = yylex();
-            break;
+    return luaL_error(L, "attempt to %s a %s value", what, luaL_typename(L, idx));
+}
+
+static uint64_t carith_int(lua_State *L, int op, uint64_t a, uint64_t b, bool u)
+{
+    uint64_t r;
+
+    /* integer divisions truncate, as in C */
+    if (op == CARITH_IDIV)
+        op = CARITH_DIV;
+
+    switch (op) {
+    case CARITH_ADD:
+        return a + b;
+    case CARITH_SUB:
+        return a - b;
+    case CARITH_MUL:
+        return a * b;
+    case CARITH_DIV:
+    case CARITH_MOD:
+        if (!b)
+            luaL_error(L, "division by zero");
+
+        if (u)
+            return op == CARITH_DIV ? a / b : a % b;
+
+        /* INT64_MIN / -1 overflows */
+        if ((int64_t)b == -1)
+            return op == CARITH_DIV ? 0 - a : 0;
+
+        if (op == CARITH_DIV)
+            return (int64_t)a / (int64_t)b;
+        return (int64_t)a % (int64_t)b;
+    case CARITH_POW:
+        if (!u && (int64_t)b < 0) {
+            if (a == 1)
+                return 1;
+            if ((int64_t)a == -1)
+                return b & 1 ? a : 1;
+            return 0;
         }
-    } else if (cparse_check_tok(L, tok) == TOK_LONG) {
-        switch (ct->type) {
-        case CTYPE_INT:
-            ct->type = CTYPE_LONG;
-            ct->ft = &ffi_type_slong;
-            tok = yylex();
-            break;
-        case CTYPE_UINT:
-            ct->type = CTYPE_ULONG;
-            ct->ft = &ffi_type_ulong;
-            tok = yylex();
-            break;
-        case CTYPE_LONG:
-            ct->type = CTYPE_LONGLONG;
-            ct->ft = &ffi_type_sint64;
-            tok = yylex();
-            break;
-        case CTYPE_ULONG:
-            ct->type = CTYPE_ULONGLONG;
-            ct->ft = &ffi_type_uint64;
-            tok = yylex();
-            break;
+
+        for (r = 1; b; b >>= 1, a *= a) {
+            if (b & 1)
+                r *= a;
         }
+        return r;
+    case CARITH_UNM:
+        return 0 - a;
+    case CARITH_BAND:
+        return a & b;
+    case CARITH_BOR:
+        return a | b;
+    case CARITH_BXOR:
+        return a ^ b;
+    case CARITH_BNOT:
+        return ~a;
+    case CARITH_SHL:
+        return b < 64 ? a << b : 0;
+    case CARITH_SHR:
+        if (u)
+            return b < 64 ? a >> b : 0;
+        return (int64_t)a >> (b < 64 ? b : 63);
+    default:
+        return b;
     }
+}
 
-    if (cparse_check_tok(L, tok) == TOK_CONST) {
-        ct->is_const = true;
-        tok = yylex();
+static lua_Number carith_num(lua_State *L, int op, lua_Number a, lua_Number b)
+{
+    switch (op) {
+    case CARITH_ADD:
+        return a + b;
+    case CARITH_SUB:
+        return a - b;
+    case CARITH_MUL:
+        return a * b;
+    case CARITH_DIV:
+        return a / b;
+    case CARITH_IDIV:
+        return floor(a / b);
+    case CARITH_MOD:
+        return a - floor(a / b) * b;
+    case CARITH_POW:
+        return pow(a, b);
+    case CARITH_UNM:
+        return -a;
+    default:
+        luaL_error(L, "number has no integer representation");
+        return 0;
     }
+}
 
-    return tok;
+/* the size pointer arithmetic scales by, void counts bytes as in GNU C */
+static size_t cptr_elem_size(lua_State *L, struct ctype *ct)
+{
+    size_t size;
+
+    if (ct->type == CTYPE_VOID)
+        return 1;
+
+    if (ct->type == CTYPE_FUNC)
+        luaL_error(L, "attempt to perform arithmetic on a function pointer");
+
+    size = ctype_sizeof(ct);
+    if (!size)
+        luaL_error(L, "attempt to perform arithmetic on a pointer to a zero-size type");
+
+    return size;
 }
 
-static void cparse_build_func_type(lua_State *L, struct ctype *rtype,
-        struct ctype *args, int narg, bool va, struct ctype *out)
+/*
+ * p + n, n + p and p - n give a pointer moved by n elements, p - q the
+ * number of elements between two pointers to the same type, as in C.
+ * Arrays are taken as pointers to their first element.
+ */
+static int cptr_arith(lua_State *L, int op)
 {
-    struct cfunc *func;
-    int i;
+    struct cdata *p = luaL_testudata(L, 1, CDATA_MT);
+    struct cdata *q = luaL_testudata(L, 2, CDATA_MT);
+    struct ctype match = { .type = CTYPE_PTR };
+    struct ctype *pt = NULL, *qt = NULL;
+    uint8_t *pa = NULL, *qa = NULL;
+    int nidx = 2;
+    uint64_t n;
+    lua_Number x;
 
-    func = calloc(1, sizeof(struct cfunc) + sizeof(struct ctype *) * narg);
-    if (!func)
-        luaL_error(L, "no mem");
+    if (p)
+        pt = cdata_elems(p, &pa);
 
-    func->narg = narg;
-    func->va = va;
+    if (q)
+        qt = cdata_elems(q, &qa);
 
-    for (i = 0; i < narg; i++)
-        func->args[i] = ctype_lookup(L, &args[i], false);
+    if (pt && qt) {
+        if (op != CARITH_SUB)
+            return luaL_error(L, "attempt to add two pointers");
 
-    func->rtype = ctype_lookup(L, rtype, false);
+        if (!ctype_same_value(pt, qt))
+            return luaL_error(L, "attempt to subtract pointers to different types");
 
-    out->type = CTYPE_FUNC;
-    out->is_const = false;
-    out->func = func;
+        lua_pushinteger(L, (pa - qa) / (ptrdiff_t)cptr_elem_size(L, pt));
+        return 1;
+    }
+
+    if (!pt) {
+        if (op == CARITH_SUB)
+            return luaL_error(L, "attempt to subtract a pointer from a number");
+
+        pt = qt;
+        pa = qa;
+        nidx = 1;
+    }
+
+    if (carith_arg(L, nidx, "perform arithmetic on", &n, &x) == CARITH_ARG_NUM)
+        return luaL_error(L, "number has no integer representation");
+
+    if (op == CARITH_SUB)
+        n = 0 - n;
+
+    match.ptr = pt;
+
+    cdata_ptr_set(cdata_new(L, ctype_lookup(L, &match, false), NULL),
+            (void *)((uintptr_t)pa + n * cptr_elem_size(L, pt)));
+    return 1;
 }
 
-static int cparse_function_args(lua_State *L, int tok, struct ctype *args,
-        int *narg, bool *va);
+static bool cdata_is_ptr(lua_State *L, int idx)
+{
+    struct cdata *cd = luaL_testudata(L, idx, CDATA_MT);
+
+    return cd && (cdata_type(cd) == CTYPE_PTR || cdata_type(cd) == CTYPE_ARRAY);
+}
 
-static int cparse_function_arg(lua_State *L, int tok, struct ctype *ct, char **name)
+static int cdata_arith(lua_State *L, int op)
 {
-    bool flexible = true;
-    int array_size;
+    int ka, kb;
+    uint64_t a, b;
+    lua_Number x, y;
 
-    if (name)
-        *name = NULL;
+    if ((op == CARITH_ADD || op == CARITH_SUB) && (cdata_is_ptr(L, 1) || cdata_is_ptr(L, 2)))
+        return cptr_arith(L, op);
 
-    if (cparse_check_tok(L, tok) == '(') {
-        struct ctype fargs[MAX_FUNC_ARGS] = {};
-        struct ctype fct;
-        int fnarg = 0;
-        int ptr_depth = 0;
-        bool ptr_const = false;
-        bool fva = false;
+    ka = carith_arg(L, 1, "perform arithmetic on", &a, &x);
+
+    if (op == CARITH_UNM || op == CARITH_BNOT) {
+        kb = ka;
+        b = a;
+        y = x;
+    } else {
+        kb = carith_arg(L, 2, "perform arithmetic on", &b, &y);
+    }
 
-        tok = yylex();
+    if (ka == CARITH_ARG_NUM || kb == CARITH_ARG_NUM) {
+        lua_pushnumber(L, carith_num(L, op, x, y));
+        return 1;
+    }
 
-        while (cparse_check_tok(L, tok) == '*') {
-            ptr_depth++;
-            tok = yylex();
-        }
+    cint_push(L, ka == CARITH_ARG_U64 || kb == CARITH_ARG_U64,
+            carith_int(L, op, a, b, ka == CARITH_ARG_U64 || kb == CARITH_ARG_U64));
+    return 1;
+}
 
-        if (ptr_depth == 0)
-            return cparse_expected_error(L, tok, "*");
+#define CDATA_ARITH(name, op) \
+    static int cdata_##name(lua_State *L) \
+    { \
+        return cdata_arith(L, op); \
+    }
 
-        if (cparse_check_tok(L, tok) == TOK_CONST) {
-            ptr_const = true;
-            tok = yylex();
+CDATA_ARITH(add, CARITH_ADD)
+CDATA_ARITH(sub, CARITH_SUB)
+CDATA_ARITH(mul, CARITH_MUL)
+CDATA_ARITH(div, CARITH_DIV)
+CDATA_ARITH(idiv, CARITH_IDIV)
+CDATA_ARITH(mod, CARITH_MOD)
+CDATA_ARITH(pow, CARITH_POW)
+CDATA_ARITH(unm, CARITH_UNM)
+CDATA_ARITH(band, CARITH_BAND)
+CDATA_ARITH(bor, CARITH_BOR)
+CDATA_ARITH(bxor, CARITH_BXOR)
+CDATA_ARITH(bnot, CARITH_BNOT)
+CDATA_ARITH(shl, CARITH_SHL)
+CDATA_ARITH(shr, CARITH_SHR)
+
+static int cdata_compare(lua_State *L, bool le)
+{
+    int ka, kb;
+    uint64_t a, b;
+    lua_Number x, y;
+    bool r;
+
+    /* pointers are ordered by address */
+    if (cdata_is_ptr(L, 1) && cdata_is_ptr(L, 2)) {
+        uint8_t *pa, *qa;
+
+        cdata_elems(lua_touserdata(L, 1), &pa);
+        cdata_elems(lua_touserdata(L, 2), &qa);
+
+        lua_pushboolean(L, le ? pa <= qa : pa < qa);
+        return 1;
+    }
+
+    ka = carith_arg(L, 1, "compare", &a, &x);
+    kb = carith_arg(L, 2, "compare", &b, &y);
+
+    if (ka == CARITH_ARG_NUM || kb == CARITH_ARG_NUM)
+        r = le ? x <= y : x < y;
+    else if (ka == CARITH_ARG_U64 || kb == CARITH_ARG_U64)
+        r = le ? a <= b : a < b;
+    else
+        r = le ? (int64_t)a <= (int64_t)b : (int64_t)a < (int64_t)b;
+
+    lua_pushboolean(L, r);
+    return 1;
+}
+
+static int cdata_lt(lua_State *L)
+{
+    return cdata_compare(L, false);
+}
+
+static int cdata_le(lua_State *L)
+{
+    return cdata_compare(L, true);
+}
+
+static ffi_type *lua_to_vararg(lua_State *L, int idx)
+{
+    struct cdata *cd;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+        return &ffi_type_sint; /* cannot be less than the size of int, due to limited in libffi */
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx))
+            return ffi_type_of(sizeof(lua_Integer), false);
+        return &ffi_type_double;
+    case LUA_TNIL:
+    case LUA_TSTRING:
+    case LUA_TLIGHTUSERDATA:
+        return &ffi_type_pointer;
+    case LUA_TUSERDATA:
+        cd = luaL_testudata(L, idx, CDATA_MT);
+        if (!cd || cdata_type(cd) == CTYPE_RECORD || cdata_type(cd) == CTYPE_ARRAY)
+            return &ffi_type_pointer;
+        return ctype_ft(cd->ct);
+    default:
+        return NULL;
+    }
+}
+
+/*
+ * Argument and return value converters, selected once per function type.
+ * Each one handles the usual Lua value for its C type directly and falls
+ * back to the generic conversion for everything else.
+ */
+static void cconv_from_generic(lua_State *L, struct ctype *ct, void *ptr, int idx)
+{
+    cdata_from_lua(L, ct, ptr, idx, false);
+}
+
+#define CCONV_FROM_INT(name, type) \
+    static void cconv_from_##name(lua_State *L, struct ctype *ct, void *ptr, int idx) \
+    { \
+        if (lua_type(L, idx) == LUA_TNUMBER && lua_isinteger(L, idx)) \
+            *(type *)ptr = lua_tointeger(L, idx); \
+        else \
+            cdata_from_lua(L, ct, ptr, idx, false); \
+    }
+
+#define CCONV_FROM_NUM(name, type) \
+    static void cconv_from_##name(lua_State *L, struct ctype *ct, void *ptr, int idx) \
+    { \
+        if (lua_type(L, idx) == LUA_TNUMBER) \
+            *(type *)ptr = lua_tonumber(L, idx); \
+        else \
+            cdata_from_lua(L, ct, ptr, idx, false); \
+    }
+
+CCONV_FROM_INT(sint8, int8_t)
+CCONV_FROM_INT(uint8, uint8_t)
+CCONV_FROM_INT(sint16, int16_t)
+CCONV_FROM_INT(uint16, uint16_t)
+CCONV_FROM_INT(sint32, int32_t)
+CCONV_FROM_INT(uint32, uint32_t)
+CCONV_FROM_INT(sint64, int64_t)
+CCONV_FROM_INT(uint64, uint64_t)
+CCONV_FROM_NUM(float, float)
+CCONV_FROM_NUM(double, double)
+
+static void cconv_from_ptr(lua_State *L, struct ctype *ct, void *ptr, int idx)
+{
+    struct cdata *cd;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        *(void **)ptr = NULL;
+        return;
+    case LUA_TLIGHTUSERDATA:
+        *(void **)ptr = lua_touserdata(L, idx);
+        return;
+    case LUA_TUSERDATA:
+        cd = luaL_testudata(L, idx, CDATA_MT);
+        if (cd && cd->ct == ct) {
+            *(void **)ptr = cdata_ptr_ptr(cd);
+            return;
+        }
+        break;
+    }
+
+    cdata_from_lua(L, ct, ptr, idx, false);
+}
+
+/* const char * and const void * */
+static void cconv_from_cstr(lua_State *L, struct ctype *ct, void *ptr, int idx)
+{
+    if (lua_type(L, idx) == LUA_TSTRING)
+        *(const char **)ptr = lua_tostring(L, idx);
+    else
+        cconv_from_ptr(L, ct, ptr, idx);
+}
+
+static cconv_from_t cconv_from_select(struct ctype *ct)
+{
+    switch (ct->type) {
+    case CTYPE_BOOL:
+        return cconv_from_generic;
+    case CTYPE_PTR:
+        if ((ctype_ptr_to(ct, CTYPE_CHAR) || ctype_ptr_to(ct, CTYPE_VOID)) && ct->ptr->is_const)
+            return cconv_from_cstr;
+        return cconv_from_ptr;
+    default:
+        break;
+    }
+
+    if (!ctype_is_num(ct))
+        return cconv_from_generic;
+
+    switch (ct->ft->type) {
+    case FFI_TYPE_SINT8:
+        return cconv_from_sint8;
+    case FFI_TYPE_UINT8:
+        return cconv_from_uint8;
+    case FFI_TYPE_SINT16:
+        return cconv_from_sint16;
+    case FFI_TYPE_UINT16:
+        return cconv_from_uint16;
+    case FFI_TYPE_SINT32:
+        return cconv_from_sint32;
+    case FFI_TYPE_UINT32:
+        return cconv_from_uint32;
+    case FFI_TYPE_SINT64:
+        return cconv_from_sint64;
+    case FFI_TYPE_UINT64:
+        return cconv_from_uint64;
+    case FFI_TYPE_FLOAT:
+        return cconv_from_float;
+    case FFI_TYPE_DOUBLE:
+        return cconv_from_double;
+    default:
+        return cconv_from_generic;
+    }
+}
+
+#define CCONV_TO_INT(name, type) \
+    static int cconv_to_##name(lua_State *L, struct ctype *ct, void *ptr) \
+    { \
+        lua_pushinteger(L, *(type *)ptr); \
+        return 1; \
+    }
+
+#define CCONV_TO_NUM(name, type) \
+    static int cconv_to_##name(lua_State *L, struct ctype *ct, void *ptr) \
+    { \
+        lua_pushnumber(L, *(type *)ptr); \
+        return 1; \
+    }
+
+CCONV_TO_INT(sint8, int8_t)
+CCONV_TO_INT(uint8, uint8_t)
+CCONV_TO_INT(sint16, int16_t)
+CCONV_TO_INT(uint16, uint16_t)
+CCONV_TO_INT(sint32, int32_t)
+CCONV_TO_INT(uint32, uint32_t)
+CCONV_TO_INT(sint64, int64_t)
+CCONV_TO_INT(uint64, uint64_t)
+CCONV_TO_NUM(float, float)
+CCONV_TO_NUM(double, double)
+
+static int cconv_to_void(lua_State *L, struct ctype *ct, void *ptr)
+{
+    return 0;
+}
+
+static int cconv_to_ptr(lua_State *L, struct ctype *ct, void *ptr)
+{
+    cdata_ptr_set(cdata_new(L, ct, NULL), *(void **)ptr);
+    return 1;
+}
+
+static int cconv_to_generic(lua_State *L, struct ctype *ct, void *ptr)
+{
+    return cdata_to_lua(L, ct, ptr);
+}
+
+/* 64-bit integers as cdata, which keep their precision on every Lua version */
+static int cconv_to_box(lua_State *L, struct ctype *ct, void *ptr)
+{
+    struct cdata *cd = cdata_new(L, ct, NULL);
+
+    memcpy(cdata_ptr(cd), ptr, sizeof(uint64_t));
+    return 1;
+}
+
+/* libffi expects integral return values of closures widened to ffi_arg */
+#define CCONV_RET_INT(name, type, wide) \
+    static bool cconv_ret_##name(lua_State *L, struct ctype *ct, void *ptr, int idx) \
+    { \
+        if (lua_type(L, idx) != LUA_TNUMBER) \
+            return cdata_from_lua_cb_ret(L, ct, ptr, idx); \
+        if (sizeof(type) < sizeof(ffi_arg)) \
+            *(wide *)ptr = (type)from_lua_num_int(L, idx); \
+        else \
+            *(type *)ptr = from_lua_num_int(L, idx); \
+        return true; \
+    }
+
+#define CCONV_RET_NUM(name, type) \
+    static bool cconv_ret_##name(lua_State *L, struct ctype *ct, void *ptr, int idx) \
+    { \
+        if (lua_type(L, idx) != LUA_TNUMBER) \
+            return cdata_from_lua_cb_ret(L, ct, ptr, idx); \
+        *(type *)ptr = lua_tonumber(L, idx); \
+        return true; \
+    }
+
+CCONV_RET_INT(sint8, int8_t, ffi_sarg)
+CCONV_RET_INT(uint8, uint8_t, ffi_arg)
+CCONV_RET_INT(sint16, int16_t, ffi_sarg)
+CCONV_RET_INT(uint16, uint16_t, ffi_arg)
+CCONV_RET_INT(sint32, int32_t, ffi_sarg)
+CCONV_RET_INT(uint32, uint32_t, ffi_arg)
+CCONV_RET_INT(sint64, int64_t, ffi_sarg)
+CCONV_RET_INT(uint64, uint64_t, ffi_arg)
+CCONV_RET_NUM(float, float)
+CCONV_RET_NUM(double, double)
+
+static bool cconv_ret_ptr(lua_State *L, struct ctype *ct, void *ptr, int idx)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        *(void **)ptr = NULL;
+        return true;
+    case LUA_TLIGHTUSERDATA:
+        *(void **)ptr = lua_touserdata(L, idx);
+        return true;
+    default:
+        return cdata_from_lua_cb_ret(L, ct, ptr, idx);
+    }
+}
+
+static cconv_ret_t cconv_ret_select(struct ctype *ct)
+{
+    if (ct->type == CTYPE_PTR)
+        return cconv_ret_ptr;
+
+    if (!ctype_is_num(ct) || ct->type == CTYPE_BOOL)
+        return cdata_from_lua_cb_ret;
+
+    switch (ct->ft->type) {
+    case FFI_TYPE_SINT8:
+        return cconv_ret_sint8;
+    case FFI_TYPE_UINT8:
+        return cconv_ret_uint8;
+    case FFI_TYPE_SINT16:
+        return cconv_ret_sint16;
+    case FFI_TYPE_UINT16:
+        return cconv_ret_uint16;
+    case FFI_TYPE_SINT32:
+        return cconv_ret_sint32;
+    case FFI_TYPE_UINT32:
+        return cconv_ret_uint32;
+    case FFI_TYPE_SINT64:
+        return cconv_ret_sint64;
+    case FFI_TYPE_UINT64:
+        return cconv_ret_uint64;
+    case FFI_TYPE_FLOAT:
+        return cconv_ret_float;
+    case FFI_TYPE_DOUBLE:
+        return cconv_ret_double;
+    default:
+        return cdata_from_lua_cb_ret;
+    }
+}
+
+static cconv_to_t cconv_to_select(struct ctype *ct)
+{
+    switch (ct->type) {
+    case CTYPE_VOID:
+        return cconv_to_void;
+    case CTYPE_PTR:
+        return cconv_to_ptr;
+    default:
+        break;
+    }
+
+    if (!ctype_is_num(ct))
+        return NULL;
+
+    switch (ct->ft->type) {
+    case FFI_TYPE_SINT8:
+        return cconv_to_sint8;
+    case FFI_TYPE_UINT8:
+        return cconv_to_uint8;
+    case FFI_TYPE_SINT16:
+        return cconv_to_sint16;
+    case FFI_TYPE_UINT16:
+        return cconv_to_uint16;
+    case FFI_TYPE_SINT32:
+        return cconv_to_sint32;
+    case FFI_TYPE_UINT32:
+        return cconv_to_uint32;
+    case FFI_TYPE_SINT64:
+        return cconv_to_sint64;
+    case FFI_TYPE_UINT64:
+        return cconv_to_uint64;
+    case FFI_TYPE_FLOAT:
+        return cconv_to_float;
+    case FFI_TYPE_DOUBLE:
+        return cconv_to_double;
+    default:
+        return NULL;
+    }
+}
+
+#ifdef CSTUB_MAX_ARGS
+#define CSTUB_PARAMS0 void
+#define CSTUB_PARAMS1 uint64_t
+#define CSTUB_PARAMS2 CSTUB_PARAMS1, uint64_t
+#define CSTUB_PARAMS3 CSTUB_PARAMS2, uint64_t
+#define CSTUB_PARAMS4 CSTUB_PARAMS3, uint64_t
+#define CSTUB_PARAMS5 CSTUB_PARAMS4, uint64_t
+#define CSTUB_PARAMS6 CSTUB_PARAMS5, uint64_t
+
+#define CSTUB_ARGS0
+#define CSTUB_ARGS1 a[0]
+#define CSTUB_ARGS2 CSTUB_ARGS1, a[1]
+#define CSTUB_ARGS3 CSTUB_ARGS2, a[2]
+#define CSTUB_ARGS4 CSTUB_ARGS3, a[3]
+#define CSTUB_ARGS5 CSTUB_ARGS4, a[4]
+#define CSTUB_ARGS6 CSTUB_ARGS5, a[5]
+
+#define CSTUB(n) \
+    static void cstub_int##n(void *fn, uint64_t *a, void *ret) \
+    { \
+        *(uint64_t *)ret = ((uint64_t (*)(CSTUB_PARAMS##n))fn)(CSTUB_ARGS##n); \
+    } \
+    static void cstub_double##n(void *fn, uint64_t *a, void *ret) \
+    { \
+        *(double *)ret = ((double (*)(CSTUB_PARAMS##n))fn)(CSTUB_ARGS##n); \
+    }
+
+CSTUB(0)
+CSTUB(1)
+CSTUB(2)
+CSTUB(3)
+CSTUB(4)
+CSTUB(5)
+CSTUB(6)
+
+/* indexed by return class (integer or double) and arity */
+static const cstub_t cstubs[2][CSTUB_MAX_ARGS + 1] = {
+    {
+        cstub_int0, cstub_int1, cstub_int2, cstub_int3,
+        cstub_int4, cstub_int5, cstub_int6
+    }, {
+        cstub_double0, cstub_double1, cstub_double2, cstub_double3,
+        cstub_double4, cstub_double5, cstub_double6
+    }
+};
+
+/* widen a converted argument to a full register */
+static uint64_t cstub_arg(ffi_type *ft, void *ptr)
+{
+    switch (ft->type) {
+    case FFI_TYPE_SINT8:
+        return *(int8_t *)ptr;
+    case FFI_TYPE_UINT8:
+        return *(uint8_t *)ptr;
+    case FFI_TYPE_SINT16:
+        return *(int16_t *)ptr;
+    case FFI_TYPE_UINT16:
+        return *(uint16_t *)ptr;
+    case FFI_TYPE_INT:
+    case FFI_TYPE_SINT32:
+        return *(int32_t *)ptr;
+    case FFI_TYPE_UINT32:
+    case FFI_TYPE_FLOAT:
+        return *(uint32_t *)ptr;
+    case FFI_TYPE_POINTER:
+        return (uintptr_t)*(void **)ptr;
+    default:
+        return *(uint64_t *)ptr;
+    }
+}
+#endif
+
+static cstub_t cfunc_stub(struct cfunc *func)
+{
+#ifdef CSTUB_MAX_ARGS
+    struct ctype *rtype = func->rtype;
+    int i;
+
+    if (func->va || func->narg > CSTUB_MAX_ARGS)
+        return NULL;
+
+    for (i = 0; i < func->narg; i++) {
+        struct ctype *ct = func->args[i];
+
+        if (ct->type != CTYPE_PTR && !ctype_is_int(ct))
+            return NULL;
+    }
+
+    if (rtype->type == CTYPE_VOID || rtype->type == CTYPE_PTR || ctype_is_int(rtype))
+        return cstubs[0][func->narg];
+
+    if (rtype->type == CTYPE_DOUBLE)
+        return cstubs[1][func->narg];
+#endif
+
+    return NULL;
+}
+
+#ifdef CJIT
+/*
+ * Call trampolines generated at runtime. A trampoline has the same
+ * signature as the static stubs, loads every argument slot straight into
+ * its ABI register or stack slot and calls the target.
+ */
+enum {
+    CJIT_VOID,
+    CJIT_INT,
+    CJIT_FP
+};
+
+struct cjit_chunk {
+    struct cjit_chunk *next;
+    uint8_t *base;
+    size_t size;
+};
+
+/* trampolines only depend on the classes, functions of one shape share it */
+struct cjit_tramp {
+    struct cjit_tramp *next;
+    void *code;
+    uint32_t hash;
+    int narg;
+    int rcls;
+    uint8_t cls[0];
+};
+
+struct cjit_arena {
+    struct cjit_chunk *chunks;
+    struct cjit_tramp *tramps[CJIT_BUCKETS];
+};
+
+static int cjit_class(struct ctype *ct)
+{
+    switch (ct->type) {
+    case CTYPE_VOID:
+        return CJIT_VOID;
+    case CTYPE_FLOAT:
+    case CTYPE_DOUBLE:
+        return CJIT_FP;
+    case CTYPE_PTR:
+        return CJIT_INT;
+    default:
+        return ctype_is_int(ct) ? CJIT_INT : -1;
+    }
+}
+
+#define CJIT_CODE_SIZE(narg) (64 + 16 * (narg))
+
+#define EMIT8(b) (*p++ = (b))
+#define EMIT32(v) do { uint32_t _v = (v); memcpy(p, &_v, 4); p += 4; } while (0)
+
+static size_t cjit_emit(const uint8_t *cls, int narg, int rcls, uint8_t *code)
+{
+    static const uint8_t gprs[] = {7, 6, 2, 1, 8, 9};    /* rdi rsi rdx rcx r8 r9 */
+    int ngpr = 0, nfpr = 0, nstack = 0;
+    uint8_t *p = code;
+    int i;
+
+    for (i = 0; i < narg; i++) {
+        if (cls[i] == CJIT_FP ? nfpr++ >= 8 : ngpr++ >= 6)
+            nstack++;
+    }
+
+    EMIT8(0x55);                                    /* push rbp */
+    EMIT8(0x48); EMIT8(0x89); EMIT8(0xe5);          /* mov rbp, rsp */
+    EMIT8(0x53);                                    /* push rbx */
+    EMIT8(0x41); EMIT8(0x54);                       /* push r12 */
+    EMIT8(0x49); EMIT8(0x89); EMIT8(0xfb);          /* mov r11, rdi */
+    EMIT8(0x48); EMIT8(0x89); EMIT8(0xf3);          /* mov rbx, rsi */
+    EMIT8(0x49); EMIT8(0x89); EMIT8(0xd4);          /* mov r12, rdx */
+
+    if (nstack) {
+        EMIT8(0x48); EMIT8(0x81); EMIT8(0xec);      /* sub rsp, imm32 */
+        EMIT32((nstack * 8 + 15) & ~15);
+    }
+
+    ngpr = nfpr = nstack = 0;
+
+    for (i = 0; i < narg; i++) {
+        if (cls[i] == CJIT_FP && nfpr < 8) {
+            EMIT8(0xf2); EMIT8(0x0f); EMIT8(0x10);  /* movsd xmmN, [rbx + disp32] */
+            EMIT8(0x83 | nfpr++ << 3);
+            EMIT32(i * 8);
+        } else if (cls[i] == CJIT_INT && ngpr < 6) {
+            uint8_t r = gprs[ngpr++];
+
+            EMIT8(r < 8 ? 0x48 : 0x4c);             /* mov reg, [rbx + disp32] */
+            EMIT8(0x8b);
+            EMIT8(0x83 | (r & 7) << 3);
+            EMIT32(i * 8);
+        } else {
+            EMIT8(0x48); EMIT8(0x8b); EMIT8(0x83);  /* mov rax, [rbx + disp32] */
+            EMIT32(i * 8);
+            EMIT8(0x48); EMIT8(0x89); EMIT8(0x84);  /* mov [rsp + disp32], rax */
+            EMIT8(0x24);
+            EMIT32(nstack++ * 8);
+        }
+    }
+
+    EMIT8(0x41); EMIT8(0xff); EMIT8(0xd3);          /* call r11 */
+
+    if (rcls == CJIT_INT) {
+        EMIT8(0x49); EMIT8(0x89); EMIT8(0x04);      /* mov [r12], rax */
+        EMIT8(0x24);
+    } else if (rcls == CJIT_FP) {
+        EMIT8(0xf2); EMIT8(0x41); EMIT8(0x0f);      /* movsd [r12], xmm0 */
+        EMIT8(0x11); EMIT8(0x04); EMIT8(0x24);
+    }
+
+    EMIT8(0x48); EMIT8(0x8d); EMIT8(0x65);          /* lea rsp, [rbp - 16] */
+    EMIT8(0xf0);
+    EMIT8(0x41); EMIT8(0x5c);                       /* pop r12 */
+    EMIT8(0x5b);                                    /* pop rbx */
+    EMIT8(0x5d);                                    /* pop rbp */
+    EMIT8(0xc3);                                    /* ret */
+
+    return p - code;
+}
+
+#undef EMIT8
+#undef EMIT32
+
+/* the class of every argument and of the result, false when unsupported */
+static bool cjit_shape(struct cfunc *func, uint8_t *cls, int *rcls)
+{
+    int i;
+
+    if (func->va || func->narg > CJIT_MAX_ARGS)
+        return false;
+
+    *rcls = cjit_class(func->rtype);
+    if (*rcls < 0)
+        return false;
+
+    for (i = 0; i < func->narg; i++) {
+        int c = cjit_class(func->args[i]);
+
+        if (c != CJIT_INT && c != CJIT_FP)
+            return false;
+
+        cls[i] = c;
+    }
+
+    return true;
+}
+
+static uint32_t cjit_hash(const uint8_t *cls, int narg, int rcls)
+{
+    uint32_t h = chash_mix(narg, rcls);
+    int i;
+
+    for (i = 0; i < narg; i++)
+        h = chash_mix(h, cls[i]);
+
+    return h;
+}
+
+static struct cjit_tramp *cjit_find(struct cjit_tramp *t, uint32_t hash,
+        const uint8_t *cls, int narg, int rcls)
+{
+    for (; t; t = t->next) {
+        if (t->hash == hash && t->narg == narg && t->rcls == rcls && !memcmp(t->cls, cls, narg))
+            return t;
+    }
+
+    return NULL;
+}
+
+/* adds the shape of func to the batch unless it has a trampoline, returns the room it needs */
+static size_t cjit_pending(struct cjit_arena *arena, struct cjit_tramp **batch, struct cfunc *func)
+{
+    struct cjit_tramp *t;
+    uint8_t *cls;
+    uint32_t hash;
+    int rcls;
+
+    if (func->jit || func->va || func->narg > CJIT_MAX_ARGS)
+        return 0;
+
+    cls = alloca(func->narg + 1);
+
+    if (!cjit_shape(func, cls, &rcls))
+        return 0;
+
+    hash = cjit_hash(cls, func->narg, rcls);
+
+    if (cjit_find(arena->tramps[hash % CJIT_BUCKETS], hash, cls, func->narg, rcls)
+            || cjit_find(*batch, hash, cls, func->narg, rcls))
+        return 0;
+
+    t = calloc(1, sizeof(struct cjit_tramp) + func->narg);
+    if (!t)
+        return 0;
+
+    memcpy(t->cls, cls, func->narg);
+    t->hash = hash;
+    t->narg = func->narg;
+    t->rcls = rcls;
+    t->next = *batch;
+    *batch = t;
+
+    return CJIT_CODE_SIZE(func->narg);
+}
+
+/*
+ * Code pages are never writable and executable at the same time. The
+ * trampoline of func is compiled along with those of every declared
+ * function whose shape has none yet, packed into pages which are sealed
+ * once and never written again.
+ */
+static void cjit_compile(lua_State *L, struct cjit_arena *arena, struct cfunc *func)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct cjit_tramp *batch = NULL;
+    struct cjit_chunk *c;
+    struct cjit_tramp *t;
+    size_t size, used = 0;
+    void *base;
+
+    size = cjit_pending(arena, &batch, func);
+    if (!size)
+        return;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &cfunc_registry);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        size += cjit_pending(arena, &batch, lua_touserdata(L, -1));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    size = (size + page - 1) & ~(page - 1);
+
+    c = calloc(1, sizeof(struct cjit_chunk));
+    if (!c)
+        goto err;
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        goto err;
+
+    for (t = batch; t; t = t->next) {
+        t->code = (uint8_t *)base + used;
+        used += (cjit_emit(t->cls, t->narg, t->rcls, t->code) + 15) & ~(size_t)15;
+    }
+
+    if (mprotect(base, size, PROT_READ | PROT_EXEC)) {
+        munmap(base, size);
+        goto err;
+    }
+
+    __builtin___clear_cache((char *)base, (char *)base + used);
+
+    c->base = base;
+    c->size = size;
+    c->next = arena->chunks;
+    arena->chunks = c;
+
+    while (batch) {
+        t = batch;
+        batch = t->next;
+        t->next = arena->tramps[t->hash % CJIT_BUCKETS];
+        arena->tramps[t->hash % CJIT_BUCKETS] = t;
+    }
+
+    return;
+
+err:
+    free(c);
+
+    while (batch) {
+        t = batch;
+        batch = t->next;
+        free(t);
+    }
+}
+
+static int cjit_gc(lua_State *L)
+{
+    struct cjit_arena *arena = lua_touserdata(L, 1);
+    struct cjit_chunk *c = arena->chunks;
+    int i;
+
+    while (c) {
+        struct cjit_chunk *next = c->next;
+
+        munmap(c->base, c->size);
+        free(c);
+        c = next;
+    }
+
+    arena->chunks = NULL;
+
+    for (i = 0; i < CJIT_BUCKETS; i++) {
+        while (arena->tramps[i]) {
+            struct cjit_tramp *t = arena->tramps[i];
+
+            arena->tramps[i] = t->next;
+            free(t);
+        }
+    }
+
+    return 0;
+}
+
+static void cjit_init(lua_State *L)
+{
+    struct cjit_arena *arena = lua_newuserdata(L, sizeof(struct cjit_arena));
+
+    memset(arena, 0, sizeof(struct cjit_arena));
+
+    lua_newtable(L);
+    lua_pushcfunction(L, cjit_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &cjit_registry);
+}
+
+static cstub_t cfunc_jit(lua_State *L, struct cfunc *func)
+{
+    struct cjit_arena *arena;
+    struct cjit_tramp *t;
+    uint32_t hash;
+    uint8_t *cls;
+    int rcls;
+
+    if (func->jit)
+        return func->jit;
+
+    if (func->va || func->narg > CJIT_MAX_ARGS)
+        return NULL;
+
+    cls = alloca(func->narg + 1);
+
+    if (!cjit_shape(func, cls, &rcls))
+        return NULL;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &cjit_registry);
+    arena = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    hash = cjit_hash(cls, func->narg, rcls);
+
+    t = cjit_find(arena->tramps[hash % CJIT_BUCKETS], hash, cls, func->narg, rcls);
+    if (!t) {
+        cjit_compile(L, arena, func);
+        t = cjit_find(arena->tramps[hash % CJIT_BUCKETS], hash, cls, func->narg, rcls);
+    }
+
+    if (t)
+        func->jit = (cstub_t)t->code;
+
+    return func->jit;
+}
+#else
+static cstub_t cfunc_jit(lua_State *L, struct cfunc *func)
+{
+    return NULL;
+}
+#endif
+
+static void cfunc_resolve(lua_State *L, struct cfunc *func)
+{
+    switch (func->backend) {
+    case CALL_BACKEND_AUTO:
+        func->stub = cfunc_stub(func);
+        if (!func->stub)
+            func->stub = cfunc_jit(L, func);
+        break;
+    case CALL_BACKEND_STUB:
+        func->stub = cfunc_stub(func);
+        break;
+    case CALL_BACKEND_JIT:
+        func->stub = cfunc_jit(L, func);
+        break;
+    default:
+        func->stub = NULL;
+        break;
+    }
+
+    func->resolved = true;
+}
+
+static ffi_cif *cfunc_cif(lua_State *L, struct cfunc *func)
+{
+    int status;
+
+    if (func->prepared)
+        return &func->cif;
+
+    status = ffi_prep_cif(&func->cif, FFI_DEFAULT_ABI, func->narg,
+            ctype_ft(func->rtype), func->fts);
+    if (status)
+        luaL_error(L, "ffi_prep_cif fail: %d", status);
+
+    func->prepared = true;
+
+    return &func->cif;
+}
+
+static ffi_cif *cfunc_va_cif(lua_State *L, struct cfunc *func, ffi_type **args, int narg)
+{
+    struct cfunc_va_cache *cache = func->va_cache;
+    struct cfunc_va_cif *e;
+    int i, slot = -1;
+    int status;
+
+    if (!cache) {
+        cache = calloc(1, sizeof(struct cfunc_va_cache));
+        if (!cache)
+            luaL_error(L, "no mem");
+        func->va_cache = cache;
+    }
+
+    for (i = 0; i < CFUNC_VA_CACHE_SIZE; i++) {
+        e = cache->entries[i];
+
+        if (!e) {
+            slot = i;
+            break;
+        }
+
+        if (e->narg == narg && !memcmp(e->args + func->narg, args + func->narg,
+                sizeof(ffi_type *) * (narg - func->narg))) {
+            e->stamp = ++cache->tick;
+            cache->hits++;
+            return &e->cif;
+        }
+
+        if (slot < 0 || e->stamp < cache->entries[slot]->stamp)
+            slot = i;
+    }
+
+    cache->misses++;
+
+    /* take a free slot or evict the least recently used entry */
+    e = realloc(cache->entries[slot], sizeof(struct cfunc_va_cif) + sizeof(ffi_type *) * narg);
+    if (!e)
+        luaL_error(L, "no mem");
+
+    cache->entries[slot] = e;
+
+    e->stamp = ++cache->tick;
+    e->narg = -1;
+    memcpy(e->args, args, sizeof(ffi_type *) * narg);
+
+    status = ffi_prep_cif_var(&e->cif, FFI_DEFAULT_ABI, func->narg, narg,
+            ctype_ft(func->rtype), e->args);
+    if (status)
+        luaL_error(L, "ffi_prep_cif fail: %d", status);
+
+    e->narg = narg;
+
+    return &e->cif;
+}
+
+/* pooled callbacks, trampolines and cached cifs are not on the Lua heap */
+static void cfunc_cleanup(struct cfunc *func)
+{
+    struct ccallback *cb;
+    int i;
+
+    while ((cb = func->cb_pool)) {
+        func->cb_pool = cb->next;
+        ccallback_free(cb);
+    }
+
+    func->cb_idle = 0;
+
+    while ((cb = func->tramps)) {
+        func->tramps = cb->next;
+        ccallback_free(cb);
+    }
+
+    if (func->va_cache) {
+        for (i = 0; i < CFUNC_VA_CACHE_SIZE; i++)
+            free(func->va_cache->entries[i]);
+
+        free(func->va_cache);
+        func->va_cache = NULL;
+    }
+}
+
+/* runs on close, after collected callbacks went back to their pools and the queue drained */
+static int cfunc_cleanup_gc(lua_State *L)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &ctype_registry);
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        struct ctype *ct = lua_touserdata(L, -1);
+
+        if (ct->type == CTYPE_FUNC)
+            cfunc_cleanup(ct->func);
+        lua_pop(L, 1);
+    }
+
+    lua_pop(L, 1);
+
+    cqueue_free(cqueue_get(L));
+
+    return 0;
+}
+
+/* finalizers run in reverse order of creation, this must precede cqueue_init */
+static void cfunc_cleanup_init(lua_State *L)
+{
+    lua_newuserdata(L, 1);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, cfunc_cleanup_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &cfunc_cleanup_registry);
+}
+
+static int cfunc_prepare(lua_State *L, struct cfunc *func)
+{
+    if (func->rtype->type != CTYPE_RECORD && !func->rconv)
+        return luaL_error(L, "unsupported return type '%s'", ctype_name(func->rtype));
+
+    if (!func->resolved) {
+        func->queue = cqueue_get(L);
+        cfunc_resolve(L, func);
+    }
+
+    return 0;
+}
+
+/*
+ * Calls a non-variadic function with converted arguments. For scalar returns
+ * rvalue must hold at least 8 bytes, the stubs store a full register.
+ */
+static void cfunc_invoke(lua_State *L, struct cfunc *func, void *sym, void **values, void *rvalue)
+{
+#ifdef CSTUB_MAX_ARGS
+    if (func->stub) {
+        uint64_t *slots = alloca(sizeof(uint64_t) * func->narg);
+        int i;
+
+        for (i = 0; i < func->narg; i++)
+            slots[i] = cstub_arg(func->fts[i], values[i]);
+
+        func->stub(sym, slots, rvalue);
+        return;
+    }
+#endif
+
+    ffi_call(cfunc_cif(L, func), FFI_FN(sym), rvalue, values);
+}
+
+static size_t cfunc_rsize(struct cfunc *func)
+{
+    size_t size = ctype_sizeof(func->rtype);
+
+    /* libffi widens small integral return values to ffi_arg */
+    return size > sizeof(uint64_t) ? size : sizeof(uint64_t);
+}
+
+/* pushes a value, non-scalars as a cdata holding a copy */
+static void cdata_push_copy(lua_State *L, struct ctype *ct, void *ptr)
+{
+    struct cdata *cd;
+
+    if (ctype_is_num(ct)) {
+        cdata_to_lua(L, ct, ptr);
+        return;
+    }
+
+    cd = cdata_new(L, ct, NULL);
+    memcpy(cdata_ptr(cd), ptr, ctype_sizeof(ct));
+}
+
+static int cfunc_push_outs(lua_State *L, struct cfunc *func, uint64_t *outs, bool box64)
+{
+    int i, n = 0;
+
+    luaL_checkstack(L, func->nout, "too many results");
+
+    for (i = 0; i < func->narg; i++) {
+        struct ctype *ct = func->args[i]->ptr;
+
+        if (!(func->flags[i] & CFUNC_ARG_OUT))
+            continue;
+
+        if (box64 && ctype_is_int64(ct))
+            cconv_to_box(L, ct, &outs[n++]);
+        else
+            cdata_push_copy(L, ct, &outs[n++]);
+    }
+
+    return n;
+}
+
+/*
+ * A table passed for a record pointer is either a single record or, when
+ * its first element is a table, a sequence of records.
+ */
+static bool ctable_single(lua_State *L, struct ctype *ct, int idx)
+{
+    bool single;
+
+    if (ct->type != CTYPE_RECORD)
+        return false;
+
+    lua_rawgeti(L, idx, 1);
+    single = !lua_istable(L, -1);
+    lua_pop(L, 1);
+
+    return single;
+}
+
+/* scratch bytes needed by a table passed for a pointer to ct */
+static size_t ctable_size(lua_State *L, struct ctype *ct, int idx)
+{
+    size_t n = ctable_single(L, ct, idx) ? 1 : lua_rawlen(L, idx);
+
+    if (n < 1)
+        n = 1;
+
+    return (n * ctype_sizeof(ct) + 15) & ~15;
+}
+
+static void ctable_to_c(lua_State *L, struct ctype *ct, uint8_t *ptr, int idx)
+{
+    size_t i, n, size = ctype_sizeof(ct);
+
+    if (ctable_single(L, ct, idx)) {
+        cdata_from_lua(L, ct, ptr, idx, false);
+        return;
+    }
+
+    n = lua_rawlen(L, idx);
+
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, idx, i + 1);
+        cdata_from_lua(L, ct, ptr + size * i, lua_gettop(L), false);
+        lua_pop(L, 1);
+    }
+}
+
+/* stores the fields of a record into the table at idx by name */
+static void crecord_to_table(lua_State *L, struct crecord *rc, uint8_t *ptr, int idx)
+{
+    int i;
+
+    for (i = 0; i < rc->nfield; i++) {
+        struct crecord_field *field = rc->fields[i];
+        struct ctype *ct = field->ct;
+
+        if (!field->name[0]) {
+            crecord_to_table(L, ct->rc, ptr + field->offset, idx);
+            continue;
+        }
+
+        if (ct->type == CTYPE_RECORD) {
+            lua_getfield(L, idx, field->name);
+            if (lua_istable(L, -1)) {
+                crecord_to_table(L, ct->rc, ptr + field->offset, lua_gettop(L));
+                lua_pop(L, 1);
+                continue;
+            }
+            lua_pop(L, 1);
+        }
+
+        cdata_push_copy(L, ct, ptr + field->offset);
+        lua_setfield(L, idx, field->name);
+    }
+}
+
+/* copies converted values back into the table they were converted from */
+static void ctable_from_c(lua_State *L, struct ctype *ct, uint8_t *ptr, int idx)
+{
+    size_t i, n, size = ctype_sizeof(ct);
+
+    if (ctable_single(L, ct, idx)) {
+        crecord_to_table(L, ct->rc, ptr, idx);
+        return;
+    }
+
+    n = lua_rawlen(L, idx);
+
+    for (i = 0; i < n; i++) {
+        if (ct->type == CTYPE_RECORD) {
+            lua_rawgeti(L, idx, i + 1);
+            crecord_to_table(L, ct->rc, ptr + size * i, lua_gettop(L));
+            lua_pop(L, 1);
+        } else {
+            cdata_push_copy(L, ct, ptr + size * i);
+            lua_rawseti(L, idx, i + 1);
+        }
+    }
+}
+
+static void cfunc_copy_back(lua_State *L, struct cfunc *func, void **values, int base)
+{
+    int i, n = 0;
+
+    for (i = 0; i < func->narg; i++) {
+        int idx = base + i - n;
+
+        if (func->flags[i] & CFUNC_ARG_OUT)
+            n++;
+        else if ((func->flags[i] & CFUNC_ARG_INOUT) && lua_istable(L, idx))
+            ctable_from_c(L, func->args[i]->ptr, *(void **)values[i], idx);
+    }
+}
+
+/*
+ * Record results are stored to rbuf when given, and not pushed. The values
+ * of __out parameters are pushed after the result. With box64, 64-bit
+ * integers are returned as cdata.
+ */
+static int cfunc_call(lua_State *L, struct cfunc *func, void *sym, int base, void *rbuf, bool box64)
+{
+    struct ctype *rtype = func->rtype;
+    int nlua = lua_gettop(L) - base + 1;
+    int narg = nlua + func->nout;
+    struct cdata *cd = NULL;
+    void *frame, *rvalue;
+    void **values;
+    ffi_type **args = NULL;
+    uint64_t *outs = NULL;
+    uint8_t *scratch = NULL;
+    ffi_cif *cif = NULL;
+    lua_State *caller;
+    size_t size = 0;
+    int slot = 0;
+    int i, n = 0;
+
+    if (func->va) {
+        if (narg < func->narg)
+            return luaL_error(L, "wrong number of arguments for function call");
+    } else if (narg != func->narg) {
+        return luaL_error(L, "wrong number of arguments for function call");
+    }
+
+    cfunc_prepare(L, func);
+
+    frame = alloca(func->frame_size);
+
+    if (func->ntable) {
+        for (i = 0; i < func->narg; i++) {
+            int idx = base + i - n;
+
+            if (func->flags[i] & CFUNC_ARG_OUT)
+                n++;
+            else if ((func->flags[i] & CFUNC_ARG_TABLE) && lua_istable(L, idx))
+                size += ctable_size(L, func->args[i]->ptr, idx);
+        }
+
+        n = 0;
+    }
+
+    /* a single area: __out values, argument pointers, vararg types and tables */
+    outs = CALL_SCRATCH(L, sizeof(uint64_t) * func->nout + sizeof(void *) * narg * 2 + size, &slot);
+    values = (void **)&outs[func->nout];
+
+    if (func->va)
+        args = (ffi_type **)&values[narg];
+
+    if (func->nout)
+        memset(outs, 0, sizeof(uint64_t) * func->nout);
+
+    if (size) {
+        scratch = (uint8_t *)&values[narg * 2];
+        memset(scratch, 0, size);
+    }
+
+    for (i = 0; i < func->narg; i++) {
+        int idx = base + i - n;
+
+        values[i] = frame + func->offsets[i];
+
+        if (func->flags[i]) {
+            if (func->flags[i] & CFUNC_ARG_OUT) {
+                *(void **)values[i] = &outs[n++];
+                continue;
+            }
+
+            if ((func->flags[i] & CFUNC_ARG_TABLE) && lua_istable(L, idx)) {
+                struct ctype *ct = func->args[i]->ptr;
+
+                *(void **)values[i] = scratch;
+                ctable_to_c(L, ct, scratch, idx);
+                scratch += ctable_size(L, ct, idx);
+                continue;
+            }
+        }
+
+        func->convs[i](L, func->args[i], values[i], idx);
+    }
+
+    if (func->va) {
+        memcpy(args, func->fts, sizeof(ffi_type *) * func->narg);
+
+        for (i = func->narg; i < narg; i++) {
+            args[i] = lua_to_vararg(L, base + i - n);
+            if (!args[i])
+                return luaL_error(L, "unsupported type '%s'", luaL_typename(L, base + i - n));
+            values[i] = alloca(args[i]->size);
+        }
+
+        for (i = func->narg; i < narg; i++) {
+            int idx = base + i - n;
+
+            switch (lua_type(L, idx)) {
+            case LUA_TBOOLEAN:
+            case LUA_TNUMBER:
+                ft_from_lua_num(L, args[i], values[i], idx);
+                break;
+            case LUA_TNIL:
+                *(void **)values[i] = NULL;
+                break;
+            case LUA_TSTRING:
+                *(void **)values[i] = (void *)luaL_checkstring(L, idx);
+                break;
+            case LUA_TLIGHTUSERDATA:
+                *(void **)values[i] = (void *)lua_topointer(L, idx);
+                break;
+            case LUA_TUSERDATA:
+                cd = luaL_testudata(L, idx, CDATA_MT);
+                if (!cd)
+                    *(void **)values[i] = lua_touserdata(L, idx);
+                else if (cdata_type(cd) == CTYPE_RECORD || cdata_type(cd) == CTYPE_ARRAY)
+                    *(void **)values[i] = cdata_ptr(cd);
+                else if (cdata_type(cd) == CTYPE_FUNC || cdata_type(cd) == CTYPE_PTR)
+                    *(void **)values[i] = cdata_ptr_ptr(cd);
+                else
+                    memcpy(values[i], cdata_ptr(cd), args[i]->size);
+                break;
+            }
+        }
+
+        cif = cfunc_va_cif(L, func, args, narg);
+    }
+
+    if (rtype->type == CTYPE_RECORD) {
+        if (rbuf) {
+            rvalue = rbuf;
+        } else {
+            cd = cdata_new(L, rtype, NULL);
+            rvalue = cdata_ptr(cd);
+        }
+    } else {
+        rvalue = alloca(cfunc_rsize(func));
+    }
+
+    caller = cqueue_enter(func->queue, L);
+
+    if (cif)
+        ffi_call(cif, FFI_FN(sym), rvalue, values);
+    else
+        cfunc_invoke(L, func, sym, values, rvalue);
+
+    func->queue->current = caller;
+
+    ccallback_raise_argument_errors(L, base, nlua);
+
+    if (func->ntable)
+        cfunc_copy_back(L, func, values, base);
+
+    if (rtype->type == CTYPE_RECORD)
+        n = rbuf ? 0 : 1;
+    else if (box64 && ctype_is_int64(rtype))
+        n = cconv_to_box(L, rtype, rvalue);
+    else
+        n = func->rconv(L, rtype, rvalue);
+
+    if (func->nout)
+        n += cfunc_push_outs(L, func, outs, box64);
+
+    /* the results are left right above the arguments */
+    if (slot)
+        lua_remove(L, slot);
+
+    return n;
+}
+
+static int cdata_call(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct cfunc *func = cdata_func(cd);
+    void *sym;
+
+    if (!func) {
+        __ctype_tostring(L, cd->ct);
+        return luaL_error(L, "'%s' is not callable", lua_tostring(L, -1));
+    }
+
+    sym = cdata_ptr_ptr(cd);
+    if (!sym)
+        return luaL_error(L, "attempt to call null function pointer");
+
+    return cfunc_call(L, func, sym, 2, NULL, false);
+}
+
+/* the function a bound closure calls, pointer fields may be reset after binding */
+static void *cdata_bound_sym(lua_State *L, struct cdata *cd)
+{
+    void *sym = cdata_ptr_ptr(cd);
+
+    if (!sym)
+        luaL_error(L, "attempt to call null function pointer");
+
+    return sym;
+}
+
+/* function cdata bound with ffi.bind as the first upvalue, its int64 option as the second */
+static int cdata_bound_call(lua_State *L)
+{
+    struct cdata *cd = lua_touserdata(L, lua_upvalueindex(1));
+    return cfunc_call(L, cdata_func(cd), cdata_bound_sym(L, cd), 1, NULL,
+            lua_toboolean(L, lua_upvalueindex(2)));
+}
+
+/*
+ * Pushes the fields of a record as separate values. Nested structs are
+ * flattened, other non-scalar fields are pushed as cdata copies.
+ */
+static int crecord_unpack(lua_State *L, struct crecord *rc, uint8_t *ptr)
+{
+    int i, n = 0;
+
+    for (i = 0; i < rc->nfield; i++) {
+        struct crecord_field *field = rc->fields[i];
+        struct ctype *ct = field->ct;
+
+        if (ct->type == CTYPE_RECORD && !ct->rc->is_union) {
+            n += crecord_unpack(L, ct->rc, ptr + field->offset);
+            continue;
+        }
+
+        luaL_checkstack(L, 1, "too many fields to unpack");
+        cdata_push_copy(L, ct, ptr + field->offset);
+        n++;
+    }
+
+    return n;
+}
+
+/* the record a call result is stored into, a struct cdata or a pointer to one */
+static void *lua_check_rbuf(lua_State *L, int idx, struct ctype *rtype)
+{
+    struct cdata *cd = luaL_checkudata(L, idx, CDATA_MT);
+    struct ctype *ct = cd->ct;
+    void *ptr = cdata_ptr(cd);
+
+    if (ct->type == CTYPE_PTR) {
+        ct = ct->ptr;
+        ptr = cdata_ptr_ptr(cd);
+    }
+
+    if (ct->is_const || !ctype_same_value(ct, rtype))
+        luaL_argerror(L, idx, "struct of the return type expected");
+
+    if (!ptr)
+        luaL_argerror(L, idx, "null pointer");
+
+    return ptr;
+}
+
+static int cfunc_call_unpack(lua_State *L, struct cfunc *func, void *sym, int base, bool box64)
+{
+    void *rbuf = alloca(ctype_sizeof(func->rtype));
+    int top = lua_gettop(L);
+    int i, n, nfield;
+
+    n = cfunc_call(L, func, sym, base, rbuf, box64);
+    nfield = crecord_unpack(L, func->rtype->rc, rbuf);
+
+    /* the fields come first, then the __out values */
+    luaL_checkstack(L, 1, "too many results");
+
+    for (i = 0; i < n; i++) {
+        lua_pushvalue(L, top + 1);
+        lua_remove(L, top + 1);
+    }
+
+    return nfield + n;
+}
+
+/* the destination record comes first, then the __out values */
+static int cfunc_call_into(lua_State *L, struct cfunc *func, void *sym, int dst, int base,
+        bool box64)
+{
+    int n = cfunc_call(L, func, sym, base, lua_check_rbuf(L, dst, func->rtype), box64);
+
+    lua_pushvalue(L, dst);
+    lua_insert(L, -(n + 1));
+
+    return n + 1;
+}
+
+static int cdata_bound_call_into(lua_State *L)
+{
+    struct cdata *cd = lua_touserdata(L, lua_upvalueindex(1));
+    return cfunc_call_into(L, cdata_func(cd), cdata_bound_sym(L, cd), 1, 2,
+            lua_toboolean(L, lua_upvalueindex(2)));
+}
+
+static int cdata_bound_call_unpack(lua_State *L)
+{
+    struct cdata *cd = lua_touserdata(L, lua_upvalueindex(1));
+    return cfunc_call_unpack(L, cdata_func(cd), cdata_bound_sym(L, cd), 1,
+            lua_toboolean(L, lua_upvalueindex(2)));
+}
+
+static int cdata_len(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+
+    if (cd->ct->type != CTYPE_ARRAY) {
+        __ctype_tostring(L, cd->ct);
+        return luaL_error(L, "attempt to get length of non-array cdata<%s>", lua_tostring(L, -1));
+    }
+
+    lua_pushinteger(L, cd->ct->array->size);
+
+    return 1;
+}
+
+static int cdata_gc(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    int gc_ref = cd->gc_ref;
+
+    if (gc_ref != LUA_REFNIL) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, gc_ref);
+        lua_pushvalue(L, 1);
+        if (lua_pcall(L, 1, 0, 0))
+            lua_pop(L, 1);
+        luaL_unref(L, LUA_REGISTRYINDEX, gc_ref);
+    }
+
+    if (cd->cb) {
+        ccallback_release(L, cd->cb);
+        cd->cb = NULL;
+    }
+
+    return 0;
+}
+
+static const luaL_Reg cdata_methods[] = {
+    {"__tostring", cdata_tostring},
+    {"__index", cdata_index},
+    {"__newindex", cdata_newindex},
+    {"__eq", cdata_eq},
+    {"__lt", cdata_lt},
+    {"__le", cdata_le},
+    {"__add", cdata_add},
+    {"__sub", cdata_sub},
+    {"__mul", cdata_mul},
+    {"__div", cdata_div},
+    {"__idiv", cdata_idiv},
+    {"__mod", cdata_mod},
+    {"__pow", cdata_pow},
+    {"__unm", cdata_unm},
+    {"__band", cdata_band},
+    {"__bor", cdata_bor},
+    {"__bxor", cdata_bxor},
+    {"__bnot", cdata_bnot},
+    {"__shl", cdata_shl},
+    {"__shr", cdata_shr},
+    {"__call", cdata_call},
+    {"__len", cdata_len},
+    {"__gc", cdata_gc},
+    {NULL, NULL}
+};
+
+static int lua_ctype_tostring(lua_State *L)
+{
+    struct ctype *ct = luaL_checkudata(L, 1, CTYPE_MT);
+
+    lua_pushliteral(L, "ctype<");
+    __ctype_tostring(L, ct);
+    lua_pushliteral(L, ">");
+    lua_concat(L, 3);
+
+    return 1;
+}
+
+static int ctype_gc(lua_State *L)
+{
+    struct ctype *ct = luaL_checkudata(L, 1, CTYPE_MT);
+    int type = ct->type;
+
+    if (type == CTYPE_RECORD && ct->rc->anonymous) {
+        int i;
+        for (i = 0; i < ct->rc->nfield; i++)
+            free(ct->rc->fields[i]);
+
+        if (ct->rc->mt_ref != LUA_REFNIL)
+            luaL_unref(L, LUA_REGISTRYINDEX, ct->rc->mt_ref);
+
+        free(ct->rc->index);
+        free(ct->rc);
+    }
+
+    return 0;
+}
+
+static const luaL_Reg ctype_methods[] = {
+    {"__tostring", lua_ctype_tostring},
+    {"__gc", ctype_gc},
+    {NULL, NULL}
+};
+
+static int clib_index(lua_State *L)
+{
+    struct clib *lib = luaL_checkudata(L, 1, CLIB_MT);
+    const char *name = luaL_checkstring(L, 2);
+    struct ctype match = { .type = CTYPE_FUNC };
+    struct ctype *ct;
+    void *sym;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, lib);
+    lua_getfield(L, -1, name);
+    if (!lua_isnil(L, -1))
+        goto done;
+    lua_pop(L, 1);
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &cfunc_registry);
+    lua_getfield(L, -1, name);
+
+    if (lua_isnil(L, -1))
+        return luaL_error(L, "missing declaration for function '%s", name);
+
+    match.func = (struct cfunc *)lua_topointer(L, -1);
+    lua_pop(L, 2);
+
+    ct = ctype_lookup(L, &match, false);
+
+    sym = dlsym(lib->h, name);
+    if (!sym)
+        return luaL_error(L, "undefined function '%s'", name);
+
+    cdata_ptr_set(cdata_new(L, ct, NULL), sym);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, name);
+
+done:
+    lua_remove(L, -2);
+    return 1;
+}
+
+static int clib_tostring(lua_State *L)
+{
+    struct clib *lib = luaL_checkudata(L, 1, CLIB_MT);
+    if (lib->h == RTLD_DEFAULT)
+        lua_pushliteral(L, "library: default");
+    else
+        lua_pushfstring(L, "library: %p", lib->h);
+    return 1;
+}
+
+static int clib_gc(lua_State *L)
+{
+    struct clib *lib = luaL_checkudata(L, 1, CLIB_MT);
+    void *h = lib->h;
+
+    if (h != RTLD_DEFAULT)
+        dlclose(h);
+
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lib);
+
+    return 0;
+}
+
+static const luaL_Reg clib_methods[] = {
+    {"__index", clib_index},
+    {"__tostring", clib_tostring},
+    {"__gc", clib_gc},
+    {NULL, NULL}
+};
+
+static int cparse_expected_error(lua_State *L, yyscan_t yy, int tok, const char *s)
+{
+    if (tok)
+        return luaL_error(L, "%d:'%s' expected before '%s'", yyget_lineno(yy), s, yyget_text(yy));
+    else
+        return luaL_error(L, "%d:identifier expected", yyget_lineno(yy));
+}
+
+static void ctype_to_ptr(lua_State *L, struct ctype *ct)
+{
+    struct ctype *ptr = ctype_lookup(L, ct, false);
+    ct->type = CTYPE_PTR;
+    ct->is_const = false;
+    ct->ptr = ptr;
+}
+
+/*
+ * Each parse has its own scanner, owned by a userdata on the Lua stack so
+ * that it is released by the GC when a parse error unwinds the stack.
+ */
+struct cscanner {
+    yyscan_t yy;
+};
+
+static int cscanner_gc(lua_State *L)
+{
+    struct cscanner *sc = luaL_checkudata(L, 1, CSCANNER_MT);
+
+    if (sc->yy) {
+        yylex_destroy(sc->yy);
+        sc->yy = NULL;
+    }
+
+    return 0;
+}
+
+static const luaL_Reg cscanner_methods[] = {
+    {"__gc", cscanner_gc},
+    {NULL, NULL}
+};
+
+/* pushes a scanner reading str, starting at line lineno */
+static yyscan_t cscanner_new(lua_State *L, const char *str, size_t len, int lineno)
+{
+    struct cscanner *sc = lua_newuserdata(L, sizeof(struct cscanner));
+
+    sc->yy = NULL;
+
+    luaL_getmetatable(L, CSCANNER_MT);
+    lua_setmetatable(L, -2);
+
+    if (yylex_init_extra(NULL, &sc->yy))
+        luaL_error(L, "no mem");
+
+    yy_scan_bytes(str, len, sc->yy);
+    yyset_lineno(lineno, sc->yy);
+
+    return sc->yy;
+}
+
+/* destroys the scanner at idx and removes it from the stack */
+static void cscanner_free(lua_State *L, int idx)
+{
+    struct cscanner *sc = lua_touserdata(L, idx);
+
+    yylex_destroy(sc->yy);
+    sc->yy = NULL;
+
+    lua_remove(L, idx);
+}
+
+static inline int cparse_check_tok(lua_State *L, yyscan_t yy, int tok)
+{
+    if (!tok && yyget_extra(yy))
+        return luaL_error(L, "%d:%s", yyget_lineno(yy), yyget_extra(yy));
+    return tok;
+}
+
+static int cparse_pointer(lua_State *L, yyscan_t yy, int tok, struct ctype *ct)
+{
+    while (cparse_check_tok(L, yy, tok) == '*') {
+        ctype_to_ptr(L, ct);
+        tok = yylex(yy);
+    }
+
+    if (cparse_check_tok(L, yy, tok) == TOK_CONST) {
+        ct->is_const = true;
+        tok = yylex(yy);
+    }
+
+    return tok;
+}
+
+static int cparse_array(lua_State *L, yyscan_t yy, int tok, bool *flexible, int *size)
+{
+    *size = -1;
+
+    if (cparse_check_tok(L, yy, tok) != '[') {
+        *flexible = false;
+        return tok;
+    }
+
+    tok = yylex(yy);
+
+    if (!*flexible && cparse_check_tok(L, yy, tok) != TOK_INTEGER)
+        return luaL_error(L, "%d:flexible array not supported at here", yyget_lineno(yy));
+
+    *flexible = false;
+
+    if (cparse_check_tok(L, yy, tok) == TOK_INTEGER || cparse_check_tok(L, yy, tok) == '?') {
+        if (cparse_check_tok(L, yy, tok) == TOK_INTEGER) {
+            *size = atoi(yyget_text(yy));
+            if (*size < 0)
+                return luaL_error(L, "%d:size of array is negative", yyget_lineno(yy));
+        } else {
+            *flexible = true;
+        }
+        tok = yylex(yy);
+    } else {
+        *flexible = true;
+    }
+
+    if (cparse_check_tok(L, yy, tok) != ']')
+        return cparse_expected_error(L, yy, tok, "]");
+
+    return yylex(yy);
+}
+
+static int cparse_packed_attribute(lua_State *L, yyscan_t yy, int tok, bool *is_packed)
+{
+    while (cparse_check_tok(L, yy, tok) == TOK_NAME && !strcmp(yyget_text(yy), "__attribute__")) {
+        int depth = 2;
+
+        tok = yylex(yy);
+        if (cparse_check_tok(L, yy, tok) != '(')
+            return cparse_expected_error(L, yy, tok, "(");
+
+        tok = yylex(yy);
+        if (cparse_check_tok(L, yy, tok) != '(')
+            return cparse_expected_error(L, yy, tok, "(");
+
+        tok = yylex(yy);
+
+        while (depth > 0) {
+            if (!cparse_check_tok(L, yy, tok))
+                return luaL_error(L, "%d:unterminated __attribute__", yyget_lineno(yy));
+
+            if (tok == TOK_NAME && depth == 2
+                    && (!strcmp(yyget_text(yy), "packed") || !strcmp(yyget_text(yy), "__packed__"))) {
+                *is_packed = true;
+            }
+
+            if (tok == '(')
+                depth++;
+            else if (tok == ')')
+                depth--;
+
+            tok = yylex(yy);
+        }
+    }
+
+    return tok;
+}
+
+static int cparse_basetype(lua_State *L, yyscan_t yy, int tok, struct ctype *ct);
+
+static void init_ft_struct(lua_State *L, ffi_type *ft, ffi_type **elements, size_t *offsets)
+{
+    int status;
+
+    ft->type = FFI_TYPE_STRUCT;
+    ft->elements = elements;
+
+    status = ffi_get_struct_offsets(FFI_DEFAULT_ABI, ft, offsets);
+    if (status)
+        luaL_error(L, "ffi_get_struct_offsets fail: %d", status);
+}
+
+static void cparse_new_array(lua_State *L, size_t array_size, struct ctype *ct)
+{
+    struct carray *a = carray_lookup(L, array_size, ct);
+
+    ct->type = CTYPE_ARRAY;
+    ct->is_const = false;
+    ct->array = a;
+}
+
+static void check_void_forbidden(lua_State *L, yyscan_t yy, struct ctype *ct, int tok)
+{
+    if (ct->type != CTYPE_VOID)
+        return;
+
+    if (tok)
+        luaL_error(L, "%d:void type in forbidden context near '%s'",
+                yyget_lineno(yy), yyget_text(yy));
+    else
+        luaL_error(L, "%d:void type in forbidden context", yyget_lineno(yy));
+}
+
+static int cparse_record(lua_State *L, yyscan_t yy, struct ctype *ct, bool is_union);
+
+/*
+ * Fields of a record being parsed, owned by a userdata on the Lua stack so
+ * that they are freed by the GC when a parse error unwinds the stack.
+ */
+struct cfields {
+    struct crecord_field **list;
+    int n;
+    int size;
+};
+
+static int cfields_gc(lua_State *L)
+{
+    struct cfields *fl = luaL_checkudata(L, 1, CFIELDS_MT);
+    int i;
+
+    for (i = 0; i < fl->n; i++)
+        free(fl->list[i]);
+
+    free(fl->list);
+    fl->list = NULL;
+    fl->n = 0;
+
+    return 0;
+}
+
+static const luaL_Reg cfields_methods[] = {
+    {"__gc", cfields_gc},
+    {NULL, NULL}
+};
+
+static struct cfields *cfields_new(lua_State *L)
+{
+    struct cfields *fl = lua_newuserdata(L, sizeof(struct cfields));
+
+    memset(fl, 0, sizeof(struct cfields));
+
+    luaL_getmetatable(L, CFIELDS_MT);
+    lua_setmetatable(L, -2);
+
+    return fl;
+}
+
+/* a zeroed field with room for a name of len bytes, owned by fl */
+static struct crecord_field *cfields_add(lua_State *L, struct cfields *fl, size_t len)
+{
+    struct crecord_field *field;
+
+    if (fl->n == fl->size) {
+        int size = fl->size ? fl->size * 2 : CPARSE_LIST_INLINE;
+        struct crecord_field **list = realloc(fl->list, sizeof(struct crecord_field *) * size);
+
+        if (!list)
+            luaL_error(L, "no mem");
+
+        fl->list = list;
+        fl->size = size;
+    }
+
+    field = calloc(1, sizeof(struct crecord_field) + len + 1);
+    if (!field)
+        luaL_error(L, "no mem");
+
+    fl->list[fl->n++] = field;
+
+    return field;
+}
+
+/* the fields now belong to their record, frees the list at idx and removes it from the stack */
+static void cfields_free(lua_State *L, int idx)
+{
+    struct cfields *fl = lua_touserdata(L, idx);
+
+    free(fl->list);
+    fl->list = NULL;
+    fl->n = 0;
+
+    lua_remove(L, idx);
+}
+
+static int cparse_record_field(lua_State *L, yyscan_t yy, struct cfields *fl)
+{
+    int tok, i;
+
+    while (true) {
+        struct crecord_field *field;
+        struct ctype bt = {}, ct;
+        bool flexible = false;
+        int array_size;
+        char *name;
+
+        tok = yylex(yy);
+
+        if (cparse_check_tok(L, yy, tok) == '}')
+            return fl->n;
+
+        if (cparse_check_tok(L, yy, tok) == TOK_STRUCT || cparse_check_tok(L, yy, tok) == TOK_UNION) {
+            tok = cparse_record(L, yy, &bt, cparse_check_tok(L, yy, tok) == TOK_UNION);
+            if (tok == ';') {
+                field = cfields_add(L, fl, 0);
+                ct = bt;
+                goto add;
+            }
+        } else {
+            tok = cparse_basetype(L, yy, tok, &bt);
+        }
+
+again:
+        ct = bt;
+
+        tok = cparse_pointer(L, yy, tok, &ct);
+
+        check_void_forbidden(L, yy, &ct, tok);
+
+        if (cparse_check_tok(L, yy, tok) != TOK_NAME)
+            return cparse_expected_error(L, yy, tok, "identifier");
+
+        name = yyget_text(yy);
+
+        for (i = 0; i < fl->n; i++)
+            if (!strcmp(fl->list[i]->name, name))
+                return luaL_error(L, "%d:duplicate member'%s'", yyget_lineno(yy), name);
+
+        field = cfields_add(L, fl, yyget_leng(yy));
+
+        memcpy(field->name, name, yyget_leng(yy));
+
+        tok = cparse_array(L, yy, yylex(yy), &flexible, &array_size);
+
+        if (array_size >= 0)
+            cparse_new_array(L, array_size, &ct);
+
+add:
+        field->ct = ctype_lookup(L, &ct, false);
+
+        if (cparse_check_tok(L, yy, tok) == ',') {
+            tok = yylex(yy);
+            goto again;
+        }
+
+        if (cparse_check_tok(L, yy, tok) != ';')
+            return cparse_expected_error(L, yy, tok, ";");
+    }
+}
+
+static inline bool ctype_is_zero_array(struct ctype *ct)
+{
+    return ct->type == CTYPE_ARRAY && ct->array->size == 0;
+}
+
+static void cparse_record_packed_layout(struct crecord *rc)
+{
+    size_t size = 0;
+    int i;
+
+    rc->ft.type = FFI_TYPE_STRUCT;
+    rc->ft.alignment = 1;
+
+    if (rc->is_union) {
+        for (i = 0; i < rc->nfield; i++) {
+            size_t field_size = ctype_sizeof(rc->fields[i]->ct);
+
+            rc->fields[i]->offset = 0;
+
+            if (field_size > size)
+                size = field_size;
+        }
+
+        rc->ft.size = size;
+        return;
+    }
+
+    for (i = 0; i < rc->nfield; i++) {
+        rc->fields[i]->offset = size;
+
+        if (!ctype_is_zero_array(rc->fields[i]->ct))
+            size += ctype_sizeof(rc->fields[i]->ct);
+    }
+
+    rc->ft.size = size;
+}
+
+/* the anchored copy of a field name, shared with equal strings Lua interns */
+static const char *cfield_name(lua_State *L, const char *name)
+{
+    const char *s;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &cfield_registry);
+    lua_pushstring(L, name);
+    lua_rawget(L, -2);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_pushstring(L, name);
+        lua_pushvalue(L, -1);
+        lua_pushvalue(L, -1);
+        lua_rawset(L, -4);
+    }
+
+    s = lua_tostring(L, -1);
+    lua_pop(L, 2);
+
+    return s;
+}
+
+static void crecord_index_add(struct crecord *rc, const char *name, uint32_t h,
+        struct ctype *ct, size_t offset)
+{
+    size_t i;
+
+    for (i = h & rc->index_mask; rc->index[i].name; i = (i + 1) & rc->index_mask) {
+        if (rc->index[i].name == name)
+            return;
+    }
+
+    rc->index[i].name = name;
+    rc->index[i].hash = h;
+    rc->index[i].ct = ct;
+    rc->index[i].offset = offset;
+    rc->nindex++;
+}
+
+/* indexes the members by name, those of anonymous records are flattened in */
+static void crecord_build_index(lua_State *L, struct crecord *rc)
+{
+    size_t count = 0, size = 4;
+    int i;
+
+    for (i = 0; i < rc->nfield; i++) {
+        struct crecord_field *field = rc->fields[i];
+        count += field->name[0] ? 1 : field->ct->rc->nindex;
+    }
+
+    if (!count)
+        return;
+
+    while (size < count * 2)
+        size *= 2;
+
+    rc->index = calloc(size, sizeof(struct crecord_index));
+    if (!rc->index)
+        luaL_error(L, "no mem");
+
+    rc->index_mask = size - 1;
+
+    for (i = 0; i < rc->nfield; i++) {
+        struct crecord_field *field = rc->fields[i];
+        struct crecord *sub;
+        size_t j;
+
+        if (field->name[0]) {
+            crecord_index_add(rc, cfield_name(L, field->name),
+                    cfield_hash(field->name, strlen(field->name)), field->ct, field->offset);
+            continue;
+        }
+
+        sub = field->ct->rc;
+
+        for (j = 0; sub->index && j <= sub->index_mask; j++) {
+            struct crecord_index *m = &sub->index[j];
+
+            if (m->name)
+                crecord_index_add(rc, m->name, m->hash, m->ct, field->offset + m->offset);
+        }
+    }
+}
+
+static int cparse_record(lua_State *L, yyscan_t yy, struct ctype *ct, bool is_union)
+{
+    bool named = false;
+    bool packed = false;
+    int tok = yylex(yy);
+
+    ct->type = CTYPE_RECORD;
+
+    tok = cparse_packed_attribute(L, yy, tok, &packed);
+
+    if (cparse_check_tok(L, yy, tok) == TOK_NAME) {
+        named = true;
+        lua_pushstring(L, yyget_text(yy));
+        tok = yylex(yy);
+    }
+
+    tok = cparse_packed_attribute(L, yy, tok, &packed);
+
+    if (cparse_check_tok(L, yy, tok) == '{') {
+        struct crecord_field **fields;
+        struct cfields *fl;
+        size_t *offsets;
+        ffi_type **elements;
+        size_t nfield = 0;
+        int i, j, nelement, next_tok;
+        int slot;
+
+        if (named) {
+            lua_rawgetp(L, LUA_REGISTRYINDEX, &crecord_registry);
+            lua_pushvalue(L, -2);
+            lua_gettable(L, -2);
+
+            if (!lua_isnil(L, -1))
+                return luaL_error(L, "%d:redefinition of symbol '%s'", yyget_lineno(yy), lua_tostring(L, -3));
+            lua_pop(L, 1);
+        }
+
+        fl = cfields_new(L);
+        slot = lua_gettop(L);
+
+        nfield = cparse_record_field(L, yy, fl);
+        fields = fl->list;
+        next_tok = cparse_packed_attribute(L, yy, yylex(yy), &packed);
+
+        if (is_union) {
+            nelement = 2;
+        } else {
+            nelement = nfield + 1;
+
+            for (i = 0; i < nfield; i++) {
+                if (ctype_is_zero_array(fields[i]->ct))
+                    nelement--;
+            }
+        }
+
+        ct->rc = calloc(1, sizeof(struct crecord)
+                        + sizeof(struct crecord_field *) * nfield
+                        + sizeof(ffi_type *) * nelement);
+        if (!ct->rc)
+            return luaL_error(L, "no mem");
+
+        ct->rc->mt_ref = LUA_REFNIL;
+
+        memcpy(ct->rc->fields, fields, sizeof(struct crecord_field *) * nfield);
+        fields = ct->rc->fields;
+        cfields_free(L, slot);
+
+        if (named) {
+            lua_pushvalue(L, -2);
+            lua_pushlightuserdata(L, ct->rc);
+            lua_settable(L, -3);
+            lua_pushvalue(L, -2);
+            lua_rawsetp(L, -2, ct->rc);
+            lua_pop(L, 2);
+        } else {
+            ct->rc->anonymous = true;
+        }
+
+        ct->rc->is_union = is_union;
+        ct->rc->nfield = nfield;
+        ct->rc->packed = packed;
+
+        elements = (ffi_type **)&ct->rc->fields[nfield];
+
+        if (is_union) {
+            for (i = 0; i < nfield; i++) {
+                if (!ctype_is_zero_array(fields[i]->ct)) {
+                    ffi_type *ft = ctype_ft(fields[i]->ct);
+                    if (i == 0 || ft->size > elements[0]->size)
+                        elements[0] = ft;
+                }
+            }
+
+            if (!elements[0])
+                nelement--;
+        } else {
+            for (i = 0, j = 0; i < nfield; i++) {
+                if (ctype_is_zero_array(fields[i]->ct))
+                    continue;
+                elements[j++] = ctype_ft(fields[i]->ct);
+            }
+        }
+
+        ct->rc->ft.type = FFI_TYPE_STRUCT;
+        ct->rc->ft.elements = elements;
+
+        if (packed) {
+            cparse_record_packed_layout(ct->rc);
+        } else {
+            if (nelement > CPARSE_LIST_INLINE)
+                offsets = lua_newuserdata(L, sizeof(size_t) * nelement);
+            else
+                offsets = alloca(sizeof(size_t) * nelement);
+
+            if (nelement > 1)
+                init_ft_struct(L, &ct->rc->ft, elements, offsets);
+
+            if (!is_union) {
+                for (i = 0, j = 0; i < nfield; i++) {
+                    if (ctype_is_zero_array(fields[i]->ct)) {
+                        if (i > 0)
+                            ct->rc->fields[i]->offset = fields[i - 1]->offset + ctype_sizeof(fields[i - 1]->ct);
+                    } else {
+                        ct->rc->fields[i]->offset = offsets[j++];
+                    }
+                }
+            }
+
+            if (nelement > CPARSE_LIST_INLINE)
+                lua_pop(L, 1);
+        }
+
+        crecord_build_index(L, ct->rc);
+
+        return next_tok;
+    } else {
+        if (!named)
+            return cparse_expected_error(L, yy, tok, "identifier");
+
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &crecord_registry);
+        lua_pushvalue(L, -2);
+        lua_gettable(L, -2);
+
+        if (lua_isnil(L, -1))
+            return luaL_error(L, "%d:undeclared of symbol '%s", yyget_lineno(yy), lua_tostring(L, -3));
+
+        ct->rc = (struct crecord *)lua_topointer(L, -1);
+        lua_pop(L, 3);
+    }
+
+    return tok;
+}
+
+static int cparse_squals(yyscan_t yy, int type, int squals, struct ctype *ct, ffi_type *s, ffi_type *u)
+{
+    ct->type = s ? ++type : type;
+    ct->ft = squals == TOK_SIGNED ? s : u;
+    return yylex(yy);
+}
+
+static int cparse_basetype(lua_State *L, yyscan_t yy, int tok, struct ctype *ct)
+{
+    ct->is_const = false;
+
+    if (cparse_check_tok(L, yy, tok) == TOK_CONST) {
+        ct->is_const = true;
+        tok = yylex(yy);
+    }
+
+    if (cparse_check_tok(L, yy, tok) == TOK_SIGNED || cparse_check_tok(L, yy, tok) == TOK_UNSIGNED) {
+        int squals = tok;
+
+        tok = yylex(yy);
+
+        switch (tok) {
+        case TOK_CHAR:
+            tok = cparse_squals(yy, CTYPE_CHAR, squals, ct, &ffi_type_schar, &ffi_type_uchar);
+            break;
+        case TOK_SHORT:
+            tok = cparse_squals(yy, CTYPE_SHORT, squals, ct, &ffi_type_sshort, &ffi_type_ushort);
+            break;
+        case TOK_INT:
+            tok = cparse_squals(yy, CTYPE_INT, squals, ct, &ffi_type_sint, &ffi_type_uint);
+            break;
+        case TOK_LONG:
+            tok = cparse_squals(yy, CTYPE_LONG, squals, ct, &ffi_type_slong, &ffi_type_ulong);
+            break;
+        default:
+            ct->type = CTYPE_INT;
+            ct->ft = (squals == TOK_SIGNED) ? &ffi_type_sint : &ffi_type_uint;
+            break;
+        }
+    } else if (cparse_check_tok(L, yy, tok) == TOK_STRUCT || cparse_check_tok(L, yy, tok) == TOK_UNION) {
+        tok = cparse_record(L, yy, ct, cparse_check_tok(L, yy, tok) == TOK_UNION);
+    } else {
+#define INIT_TYPE(t1, t2) \
+            ct->type = t1; \
+            ct->ft = &t2; \
+            break
+
+#define INIT_TYPE_T(t1, t2, s) \
+            ct->type = t1; \
+            ct->ft = ffi_type_of(sizeof(t2), s); \
+            break
+
+        switch (tok) {
+        case TOK_VOID:
+            INIT_TYPE(CTYPE_VOID, ffi_type_void);
+        case TOK_BOOL:
+            INIT_TYPE(CTYPE_BOOL, ffi_type_sint8);
+        case TOK_CHAR:
+            INIT_TYPE(CTYPE_CHAR, ffi_type_schar);
+        case TOK_SHORT:
+            INIT_TYPE(CTYPE_SHORT, ffi_type_sshort);
+        case TOK_INT:
+            INIT_TYPE(CTYPE_INT, ffi_type_sint);
+        case TOK_LONG:
+            INIT_TYPE(CTYPE_LONG, ffi_type_slong);
+        case TOK_FLOAT:
+            INIT_TYPE(CTYPE_FLOAT, ffi_type_float);
+        case TOK_DOUBLE:
+            INIT_TYPE(CTYPE_DOUBLE, ffi_type_double);
+        case TOK_INT8_T:
+            INIT_TYPE_T(CTYPE_INT8_T, int8_t, true);
+        case TOK_INT16_T:
+            INIT_TYPE_T(CTYPE_INT16_T, int16_t, true);
+        case TOK_INT32_T:
+            INIT_TYPE_T(CTYPE_INT32_T, int32_t, true);
+        case TOK_INT64_T:
+            INIT_TYPE_T(CTYPE_INT64_T, int64_t, true);
+        case TOK_UINT8_T:
+            INIT_TYPE_T(CTYPE_UINT8_T, uint8_t, false);
+        case TOK_UINT16_T:
+            INIT_TYPE_T(CTYPE_UINT16_T, uint16_t, false);
+        case TOK_UINT32_T:
+            INIT_TYPE_T(CTYPE_UINT32_T, uint32_t, false);
+        case TOK_UINT64_T:
+            INIT_TYPE_T(CTYPE_UINT64_T, uint64_t, false);
+        case TOK_OFF_T:
+            INIT_TYPE_T(CTYPE_OFF_T, off_t, true);
+        case TOK_INO_T:
+            INIT_TYPE_T(CTYPE_INO_T, ino_t, false);
+        case TOK_DEV_T:
+            INIT_TYPE_T(CTYPE_DEV_T, dev_t, false);
+        case TOK_GID_T:
+            INIT_TYPE_T(CTYPE_GID_T, gid_t, false);
+        case TOK_MODE_T:
+            INIT_TYPE_T(CTYPE_MODE_T, mode_t, false);
+        case TOK_NLINK_T:
+            INIT_TYPE_T(CTYPE_NLINK_T, nlink_t, false);
+        case TOK_UID_T:
+            INIT_TYPE_T(CTYPE_UID_T, uid_t, false);
+        case TOK_PID_T:
+            INIT_TYPE_T(CTYPE_PID_T, pid_t, true);
+        case TOK_SIZE_T:
+            INIT_TYPE_T(CTYPE_SIZE_T, size_t, false);
+        case TOK_SSIZE_T:
+            INIT_TYPE_T(CTYPE_SSIZE_T, ssize_t, true);
+        case TOK_USECONDS_T:
+            INIT_TYPE_T(CTYPE_USECONDS_T, useconds_t, false);
+        case TOK_SUSECONDS_T:
+            INIT_TYPE_T(CTYPE_SUSECONDS_T, suseconds_t, true);
+        case TOK_BLKSIZE_T:
+            INIT_TYPE_T(CTYPE_BLKSIZE_T, blksize_t, true);
+        case TOK_BLKCNT_T:
+            INIT_TYPE_T(CTYPE_BLKCNT_T, blkcnt_t, true);
+        case TOK_TIME_T:
+            INIT_TYPE_T(CTYPE_TIME_T, time_t, true);
+        case TOK_NAME:
+            lua_rawgetp(L, LUA_REGISTRYINDEX, &ctdef_registry);
+            lua_getfield(L, -1, yyget_text(yy));
+            if (!lua_isnil(L, -1)) {
+                *ct = *(struct ctype *)lua_touserdata(L, -1);
+                lua_pop(L, 2);
+                break;
+            }
+        default:
+            return luaL_error(L, "%d:unknown type name '%s'", yyget_lineno(yy), yyget_text(yy));
+        }
+        tok = yylex(yy);
+#undef INIT_TYPE
+#undef INIT_TYPE_T
+    }
+
+    if (cparse_check_tok(L, yy, tok) == TOK_INT) {
+        switch (ct->type) {
+        case CTYPE_LONG:
+        case CTYPE_ULONG:
+            tok = yylex(yy);
+            break;
+        }
+    } else if (cparse_check_tok(L, yy, tok) == TOK_LONG) {
+        switch (ct->type) {
+        case CTYPE_INT:
+            ct->type = CTYPE_LONG;
+            ct->ft = &ffi_type_slong;
+            tok = yylex(yy);
+            break;
+        case CTYPE_UINT:
+            ct->type = CTYPE_ULONG;
+            ct->ft = &ffi_type_ulong;
+            tok = yylex(yy);
+            break;
+        case CTYPE_LONG:
+            ct->type = CTYPE_LONGLONG;
+            ct->ft = &ffi_type_sint64;
+            tok = yylex(yy);
+            break;
+        case CTYPE_ULONG:
+            ct->type = CTYPE_ULONGLONG;
+            ct->ft = &ffi_type_uint64;
+            tok = yylex(yy);
+            break;
+        }
+    }
+
+    if (cparse_check_tok(L, yy, tok) == TOK_CONST) {
+        ct->is_const = true;
+        tok = yylex(yy);
+    }
+
+    return tok;
+}
+
+/* parameters of a declaration, on the C stack until they outgrow it */
+struct cparse_args {
+    struct ctype *args;
+    uint8_t *flags;
+    int narg;
+    int size;
+    int slot;       /* anchors the grown lists on the Lua stack */
+    bool va;
+    struct ctype inline_args[CPARSE_LIST_INLINE];
+    uint8_t inline_flags[CPARSE_LIST_INLINE];
+};
+
+/* pushes the anchor slot, removed by the caller once the function type is built */
+static void cparse_args_init(lua_State *L, struct cparse_args *a)
+{
+    a->args = a->inline_args;
+    a->flags = a->inline_flags;
+    a->narg = 0;
+    a->size = CPARSE_LIST_INLINE;
+    a->va = false;
+
+    lua_pushnil(L);
+    a->slot = lua_gettop(L);
+}
+
+/* the next parameter, zeroed */
+static struct ctype *cparse_args_next(lua_State *L, struct cparse_args *a)
+{
+    if (a->narg == a->size) {
+        struct ctype *args = lua_newuserdata(L, (sizeof(struct ctype) + sizeof(uint8_t)) * a->size * 2);
+        uint8_t *flags = (uint8_t *)&args[a->size * 2];
+
+        memcpy(args, a->args, sizeof(struct ctype) * a->narg);
+        memcpy(flags, a->flags, a->narg);
+        lua_replace(L, a->slot);
+
+        a->args = args;
+        a->flags = flags;
+        a->size *= 2;
+    }
+
+    memset(&a->args[a->narg], 0, sizeof(struct ctype));
+    a->flags[a->narg] = 0;
+
+    return &a->args[a->narg];
+}
+
+static void cparse_build_func_type(lua_State *L, struct ctype *rtype,
+        const struct cparse_args *a, struct ctype *out)
+{
+    const uint8_t *flags = a->flags;
+    struct ctype *args = a->args;
+    int narg = a->narg;
+    struct cfunc *func;
+    int i;
+
+    func = calloc(1, sizeof(struct cfunc) + (sizeof(struct ctype *) + sizeof(ffi_type *)
+                    + sizeof(size_t) + sizeof(cconv_from_t) + sizeof(cconv_to_t)
+                    + sizeof(uint8_t)) * narg);
+    if (!func)
+        luaL_error(L, "no mem");
+
+    func->narg = narg;
+    func->va = a->va;
+    func->fts = (ffi_type **)&func->args[narg];
+    func->offsets = (size_t *)&func->fts[narg];
+    func->convs = (cconv_from_t *)&func->offsets[narg];
+    func->cb_convs = (cconv_to_t *)&func->convs[narg];
+    func->flags = (uint8_t *)&func->cb_convs[narg];
+
+    for (i = 0; i < narg; i++) {
+        func->flags[i] = flags[i];
+        if (flags[i] & CFUNC_ARG_OUT)
+            func->nout++;
+    }
+
+    for (i = 0; i < narg; i++) {
+        ffi_type *ft;
+        size_t align;
+
+        func->args[i] = ctype_lookup(L, &args[i], false);
+
+        if (ctype_ptr_table(func->args[i])) {
+            func->flags[i] |= CFUNC_ARG_TABLE;
+            func->ntable++;
+        }
+
+        ft = ctype_ft(func->args[i]);
+        align = ft->alignment ? ft->alignment : 1;
+
+        func->fts[i] = ft;
+        func->offsets[i] = (func->frame_size + align - 1) & ~(align - 1);
+        func->frame_size = func->offsets[i] + ft->size;
+        func->convs[i] = cconv_from_select(func->args[i]);
+        func->cb_convs[i] = cconv_to_select(func->args[i]);
+        if (!func->cb_convs[i])
+            func->cb_convs[i] = cconv_to_generic;
+    }
+
+    func->rtype = ctype_lookup(L, rtype, false);
+    func->rconv = cconv_to_select(func->rtype);
+    func->cb_rconv = cconv_ret_select(func->rtype);
+
+    out->type = CTYPE_FUNC;
+    out->is_const = false;
+    out->func = func;
+}
+
+static int cparse_function_args(lua_State *L, yyscan_t yy, int tok, struct cparse_args *a);
+
+static int cparse_function_arg(lua_State *L, yyscan_t yy, int tok, struct ctype *ct, char **name)
+{
+    bool flexible = true;
+    int array_size;
+
+    if (name)
+        *name = NULL;
+
+    if (cparse_check_tok(L, yy, tok) == '(') {
+        struct cparse_args fargs;
+        struct ctype fct;
+        int ptr_depth = 0;
+        bool ptr_const = false;
+
+        tok = yylex(yy);
+
+        while (cparse_check_tok(L, yy, tok) == '*') {
+            ptr_depth++;
+            tok = yylex(yy);
+        }
+
+        if (ptr_depth == 0)
+            return cparse_expected_error(L, yy, tok, "*");
+
+        if (cparse_check_tok(L, yy, tok) == TOK_CONST) {
+            ptr_const = true;
+            tok = yylex(yy);
+        }
+
+        if (cparse_check_tok(L, yy, tok) == TOK_NAME) {
+            if (name) {
+                *name = strdup(yyget_text(yy));
+                if (!*name)
+                    luaL_error(L, "no mem");
+            }
+            tok = yylex(yy);
+        }
+
+        if (cparse_check_tok(L, yy, tok) != ')')
+            return cparse_expected_error(L, yy, tok, ")");
+
+        tok = yylex(yy);
+        if (cparse_check_tok(L, yy, tok) != '(')
+            return cparse_expected_error(L, yy, tok, "(");
+
+        cparse_args_init(L, &fargs);
+        tok = cparse_function_args(L, yy, tok, &fargs);
+
+        cparse_build_func_type(L, ct, &fargs, &fct);
+        lua_remove(L, fargs.slot);
+        *ct = fct;
+
+        while (ptr_depth-- > 0)
+            ctype_to_ptr(L, ct);
+
+        if (ptr_const && ct->type == CTYPE_PTR)
+            ct->is_const = true;
+
+        tok = yylex(yy);
+
+        return tok;
+    }
+
+    tok = cparse_pointer(L, yy, tok, ct);
+
+    if (cparse_check_tok(L, yy, tok) == TOK_NAME) {
+        if (name) {
+            *name = strdup(yyget_text(yy));
+            if (!*name)
+                luaL_error(L, "no mem");
+        }
+        tok = yylex(yy);
+    }
+
+    tok = cparse_array(L, yy, tok, &flexible, &array_size);
+
+    if (flexible || array_size >= 0)
+        ctype_to_ptr(L, ct);
+
+    return tok;
+}
+
+static int cparse_arg_annotation(lua_State *L, yyscan_t yy, int tok, uint8_t *flags)
+{
+    *flags = 0;
+
+    if (cparse_check_tok(L, yy, tok) != TOK_NAME)
+        return tok;
+
+    if (!strcmp(yyget_text(yy), "__out"))
+        *flags = CFUNC_ARG_OUT;
+    else if (!strcmp(yyget_text(yy), "__inout"))
+        *flags = CFUNC_ARG_INOUT;
+    else
+        return tok;
+
+    return yylex(yy);
+}
+
+static void cparse_check_annotation(lua_State *L, yyscan_t yy, struct ctype *ct, uint8_t flags)
+{
+    if (flags & CFUNC_ARG_OUT) {
+        if (ct->type != CTYPE_PTR || ct->ptr->is_const
+            || !(ctype_is_num(ct->ptr) || ct->ptr->type == CTYPE_PTR))
+            luaL_error(L, "%d:__out requires a pointer to a non-const scalar", yyget_lineno(yy));
+    }
+
+    if (flags & CFUNC_ARG_INOUT) {
+        if (!ctype_ptr_table(ct) || ct->ptr->is_const)
+            luaL_error(L, "%d:__inout requires a pointer to non-const data", yyget_lineno(yy));
+    }
+}
+
+static int cparse_function_args(lua_State *L, yyscan_t yy, int tok, struct cparse_args *a)
+{
+    while (true) {
+        struct ctype *arg;
+        uint8_t *flags;
+
+        tok = yylex(yy);
+        if (cparse_check_tok(L, yy, tok) == ')')
+            break;
+
+        arg = cparse_args_next(L, a);
+        flags = &a->flags[a->narg];
+
+        tok = cparse_arg_annotation(L, yy, tok, flags);
+
+        if (cparse_check_tok(L, yy, tok) == TOK_STRUCT || cparse_check_tok(L, yy, tok) == TOK_UNION) {
+            tok = cparse_record(L, yy, arg, cparse_check_tok(L, yy, tok) == TOK_UNION);
+        } else if (cparse_check_tok(L, yy, tok) == TOK_VAL) {
+            tok = yylex(yy);
+            if (cparse_check_tok(L, yy, tok) != ')')
+                return cparse_expected_error(L, yy, tok, ")");
+            a->va = true;
+            break;
+        } else {
+            tok = cparse_basetype(L, yy, tok, arg);
+        }
+
+        tok = cparse_function_arg(L, yy, tok, arg, NULL);
+
+        cparse_check_annotation(L, yy, arg, *flags);
+
+        if (cparse_check_tok(L, yy, tok) == ')') {
+            if (arg->type == CTYPE_VOID && a->narg == 0)
+                break;
+
+            check_void_forbidden(L, yy, arg, tok);
+            a->narg++;
+            break;
+        }
+
+        check_void_forbidden(L, yy, arg, tok);
+        a->narg++;
+
+        if (cparse_check_tok(L, yy, tok) != ',')
+            return cparse_expected_error(L, yy, tok, ",");
+    }
+
+    return tok;
+}
+
+static int cparse_function(lua_State *L, yyscan_t yy, int tok, struct ctype *rtype)
+{
+    struct cparse_args args;
+    struct ctype fct;
+
+    tok = cparse_pointer(L, yy, tok, rtype);
+
+    if (cparse_check_tok(L, yy, tok) != TOK_NAME)
+        return cparse_expected_error(L, yy, tok, "identifier");
+
+    lua_pushstring(L, yyget_text(yy));
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &cfunc_registry);
+    lua_pushvalue(L, -2);
+    lua_gettable(L, -2);
+
+    if (!lua_isnil(L, -1))
+        return luaL_error(L, "%d:redefinition of function '%s'", yyget_lineno(yy), lua_tostring(L, -3));
+
+    lua_pop(L, 1);
+
+    tok = yylex(yy);
+
+    if (cparse_check_tok(L, yy, tok) != '(')
+        return cparse_expected_error(L, yy, tok, "(");
+
+    cparse_args_init(L, &args);
+    tok = cparse_function_args(L, yy, tok, &args);
+
+    tok = yylex(yy);
+    if (cparse_check_tok(L, yy, tok) != ';')
+        return cparse_expected_error(L, yy, tok, ";");
+
+    cparse_build_func_type(L, rtype, &args, &fct);
+    lua_remove(L, args.slot);
+
+    lua_pushvalue(L, -2);
+    lua_pushlightuserdata(L, fct.func);
+    lua_settable(L, -3);
+    lua_pop(L, 2);
+
+    return 0;
+}
+
+static int lua_ffi_cdef(lua_State *L)
+{
+    size_t len;
+    const char *str = luaL_checklstring(L, 1, &len);
+    int sc = lua_gettop(L) + 1;
+    lua_Debug ar;
+    yyscan_t yy;
+    int tok;
+
+    lua_getstack(L, 1, &ar);
+    lua_getinfo(L, "nSl", &ar);
+
+    yy = cscanner_new(L, str, len, ar.currentline);
+
+    while ((tok = yylex(yy))) {
+        bool tdef = false;
+        struct ctype ct;
+
+        if (cparse_check_tok(L, yy, tok) == ';')
+            continue;
+
+        if (cparse_check_tok(L, yy, tok) == TOK_TYPEDEF) {
+            tdef = true;
+            tok = yylex(yy);
+        }
+
+        tok = cparse_basetype(L, yy, tok, &ct);
+
+        if (tdef) {
+            char *name = NULL;
+
+            if (cparse_check_tok(L, yy, tok) == '(') {
+                tok = cparse_function_arg(L, yy, tok, &ct, &name);
+            } else {
+                tok = cparse_pointer(L, yy, tok, &ct);
+
+                if (cparse_check_tok(L, yy, tok) != TOK_NAME)
+                    return cparse_expected_error(L, yy, tok, "identifier");
+
+                name = strdup(yyget_text(yy));
+                if (!name)
+                    return luaL_error(L, "no mem");
+                tok = yylex(yy);
+            }
+
+            if (!name)
+                return cparse_expected_error(L, yy, tok, "identifier");
+
+            lua_rawgetp(L, LUA_REGISTRYINDEX, &ctdef_registry);
+            lua_getfield(L, -1, name);
+
+            if (!lua_isnil(L, -1)) {
+                return luaL_error(L, "%d:redefinition of symbol '%s'", yyget_lineno(yy), name);
+            }
+
+            lua_pop(L, 1);
+            ctype_lookup(L, &ct, true);
+            lua_setfield(L, -2, name);
+            lua_pop(L, 1);
+
+            free(name);
+
+            if (cparse_check_tok(L, yy, tok) != ';')
+                return cparse_expected_error(L, yy, tok, ";");
+
+            continue;
+        }
+
+        if (cparse_check_tok(L, yy, tok) == ';')
+            continue;
+
+        cparse_function(L, yy, tok, &ct);
+    }
+
+    cscanner_free(L, sc);
+
+    return 0;
+}
+
+static int load_lib(lua_State *L, const char *path, bool global)
+{
+    struct clib *lib;
+    void *h;
+
+    if (path) {
+        h = dlopen(path, RTLD_LAZY | (global ? RTLD_GLOBAL : RTLD_LOCAL));
+        if (!h) {
+            const char *err = dlerror();
+            return luaL_error(L, err ? err : "dlopen() failed");
+        }
+    } else {
+        h = RTLD_DEFAULT;
+    }
+
+    lib = lua_newuserdata(L, sizeof(struct clib));
+    lib->h = h;
+
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, lib);
+
+    luaL_getmetatable(L, CLIB_MT);
+    lua_setmetatable(L, -2);
+
+    if (global) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &clib_registry);
+        lua_pushvalue(L, -2);
+        lua_rawsetp(L, -2, lib);
+        lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+static int lua_ffi_load(lua_State *L)
+{
+    const char *path = luaL_checkstring(L, 1);
+    bool global = lua_toboolean(L, 2);
+    return load_lib(L, path, global);
+}
+
+/*
+ * Type strings resolved by lua_check_ct. Declarations are only ever added,
+ * and redefinitions are rejected, so a string which parsed once keeps its
+ * meaning: the cache is only reset when it grows too large.
+ */
+struct ctcache {
+    size_t hits;
+    size_t misses;
+    size_t count;
+    int types_ref;      /* string -> interned ctype */
+    int vla_ref;        /* string -> element ctype of "T [?]" */
+};
+
+static void ctcache_reset(lua_State *L, struct ctcache *c)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, c->types_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, c->vla_ref);
+
+    lua_newtable(L);
+    c->types_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_newtable(L);
+    c->vla_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    c->count = 0;
+}
+
+static void ctcache_init(lua_State *L)
+{
+    struct ctcache *c = lua_newuserdata(L, sizeof(struct ctcache));
+
+    memset(c, 0, sizeof(struct ctcache));
+    c->types_ref = LUA_NOREF;
+    c->vla_ref = LUA_NOREF;
+
+    ctcache_reset(L, c);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &ctcache_registry);
+}
+
+static struct ctcache *ctcache_get(lua_State *L)
+{
+    struct ctcache *c;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &ctcache_registry);
+    c = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    return c;
+}
+
+/* the ctype cached under the string at idx */
+static struct ctype *ctcache_find(lua_State *L, int ref, int idx)
+{
+    struct ctype *ct;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    ct = lua_touserdata(L, -1);
+    lua_pop(L, 2);
+
+    return ct;
+}
+
+static void ctcache_add(lua_State *L, struct ctcache *c, bool vla, int idx, struct ctype *ct)
+{
+    if (c->count >= CTCACHE_SIZE)
+        ctcache_reset(L, c);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, vla ? c->vla_ref : c->types_ref);
+    lua_pushvalue(L, idx);
+    lua_pushlightuserdata(L, ct);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    c->count++;
+}
+
+/* pushes the ctype object of an interned type */
+static void ctype_push(lua_State *L, struct ctype *ct)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &ctype_registry);
+    lua_rawgetp(L, -1, ct);
+    lua_remove(L, -2);
+}
+
+/* turns ct into an array of it, sized by the second argument */
+static void ctype_to_vla(lua_State *L, struct ctype *ct)
+{
+    int array_size = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, 2, array_size > 0, "array size must great than 0");
+
+    cparse_new_array(L, array_size, ct);
+}
+
+static struct ctype *lua_check_ct(lua_State *L, bool *va, bool keep)
+{
+    struct cdata *cd;
+    struct ctype *ct;
+
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        struct ctcache *cache = ctcache_get(L);
+        size_t len;
+        const char *str = luaL_checklstring(L, 1, &len);
+        bool flexible = false;
+        struct ctype match;
+        int array_size;
+        lua_Debug ar;
+        yyscan_t yy;
+        int tok, sc;
+
+        ct = ctcache_find(L, cache->types_ref, 1);
+        if (ct) {
+            cache->hits++;
+
+            if (va)
+                *va = false;
+
+            if (keep)
+                ctype_push(L, ct);
+
+            return ct;
+        }
+
+        if (va && *va) {
+            ct = ctcache_find(L, cache->vla_ref, 1);
+            if (ct) {
+                cache->hits++;
+
+                match = *ct;
+                ctype_to_vla(L, &match);
+
+                return ctype_lookup(L, &match, keep);
+            }
+        }
+
+        cache->misses++;
+
+        lua_getstack(L, 1, &ar);
+        lua_getinfo(L, "nSl", &ar);
+
+        sc = lua_gettop(L) + 1;
+        yy = cscanner_new(L, str, len, ar.currentline - 1);
+
+        if (va)
+            flexible = *va;
+
+        tok = cparse_basetype(L, yy, yylex(yy), &match);
+
+        if (cparse_check_tok(L, yy, tok) == '(') {
+            tok = cparse_function_arg(L, yy, tok, &match, NULL);
+        } else {
+            tok = cparse_pointer(L, yy, tok, &match);
+            tok = cparse_array(L, yy, tok, &flexible, &array_size);
+
+            if (flexible || array_size >= 0) {
+                if (flexible)
+                    ctype_to_vla(L, &match);
+                else
+                    cparse_new_array(L, array_size, &match);
+            }
+        }
+
+        if (tok)
+            luaL_error(L, "%d:unexpected '%s'", yyget_lineno(yy), yyget_text(yy));
+
+        if (va)
+            *va = flexible;
+
+        cscanner_free(L, sc);
+
+        ct = ctype_lookup(L, &match, keep);
+
+        ctcache_add(L, cache, flexible, 1, flexible ? ct->array->ct : ct);
+
+        return ct;
+    }
+
+    if (va)
+        *va = false;
+
+    ct = luaL_testudata(L, 1, CTYPE_MT);
+    if (ct)
+        return ct;
+
+    cd = luaL_testudata(L, 1, CDATA_MT);
+    if (cd) {
+        if (keep)
+            ctype_push(L, cd->ct);
+        return cd->ct;
+    }
+
+    lua_type_error(L, 1, "C type");
+
+    return NULL;
+}
+
+static int lua_ffi_new(lua_State *L)
+{
+    bool va = true;
+    struct ctype *ct = lua_check_ct(L, &va, false);
+
+    if (ct->type == CTYPE_FUNC || ct->type == CTYPE_VOID)
+        return luaL_error(L, "invalid C type");
+
+    struct cdata *cd = cdata_new(L, ct, NULL);
+    int idx = va ? 3 : 2;
+    int ninit;
+
+    ninit = lua_gettop(L) - idx;
+
+    if (ninit == 1) {
+        cdata_from_lua(L, cd->ct, cdata_ptr(cd), idx, false);
+    } else if (ninit != 0) {
+        __ctype_tostring(L, ct);
+        return luaL_error(L, "too many initializers for '%s'", lua_tostring(L, -1));
+    }
+
+    return 1;
+}
+
+static const char *const cb_ptr_modes[] = {"cdata", "raw", "cursor", NULL};
+
+/* reads a string option from the options table at idx */
+static int lua_check_table_option(lua_State *L, int idx, const char *name,
+        const char *const opts[], int def)
+{
+    const char *value;
+    int i;
+
+    lua_getfield(L, idx, name);
+    value = lua_tostring(L, -1);
+
+    if (!value) {
+        if (!lua_isnil(L, -1))
+            luaL_error(L, "invalid %s option", name);
+        lua_pop(L, 1);
+        return def;
+    }
+
+    for (i = 0; opts[i]; i++) {
+        if (!strcmp(opts[i], value)) {
+            lua_pop(L, 1);
+            return i;
+        }
+    }
+
+    return luaL_error(L, "invalid %s option '%s'", name, value);
+}
+
+static const char *const cb_thread_modes[] = {"none", "async", "sync", NULL};
+
+/* reads the callback options table at idx, if any */
+static void lua_check_cb_options(lua_State *L, int idx, int *ptr_mode, int *thread)
+{
+    *ptr_mode = CB_PTR_CDATA;
+    *thread = CB_THREAD_NONE;
+
+    if (lua_isnoneornil(L, idx))
+        return;
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    *ptr_mode = lua_check_table_option(L, idx, "ptr", cb_ptr_modes, CB_PTR_CDATA);
+    *thread = lua_check_table_option(L, idx, "thread", cb_thread_modes, CB_THREAD_NONE);
+}
+
+static int lua_ffi_cast(lua_State *L)
+{
+    struct ctype *ct = lua_check_ct(L, NULL, false);
+    struct cdata *cd;
+
+    if (ct->type == CTYPE_PTR && ct->ptr->type == CTYPE_FUNC) {
+        int ptr_mode, thread;
+
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+        lua_check_cb_options(L, 3, &ptr_mode, &thread);
+
+        cd = cdata_new(L, ct, NULL);
+        cd->cb = ccallback_new(L, ct->ptr->func, 2, ptr_mode, thread);
+        cdata_ptr_set(cd, cd->cb->code);
+    } else {
+        cd = cdata_new(L, ct, NULL);
+        cdata_from_lua(L, ct, cdata_ptr(cd), 2, true);
+    }
+
+    return 1;
+}
+
+/* the shared callback of func which reads its handle from parameter ctx */
+static struct ccallback *ccallback_trampoline(lua_State *L, struct cfunc *func,
+        int ctx, int ptr_mode, int thread)
+{
+    struct ccallback *cb;
+
+    for (cb = func->tramps; cb; cb = cb->next) {
+        if (cb->ctx == ctx && cb->ptr_mode == ptr_mode && cb->thread == thread)
+            return cb;
+    }
+
+    cb = ccallback_new(L, func, 0, ptr_mode, thread);
+    cb->ctx = ctx;
+    cb->next = func->tramps;
+    func->tramps = cb;
+
+    return cb;
+}
+
+static int lua_ffi_trampoline(lua_State *L)
+{
+    struct ctype *ct = lua_check_ct(L, NULL, false);
+    int ptr_mode, thread;
+    struct ccallback *cb;
+    struct cfunc *func;
+    struct cdata *cd;
+    int ctx;
+
+    if (ct->type == CTYPE_FUNC) {
+        struct ctype match = *ct;
+
+        ctype_to_ptr(L, &match);
+        ct = ctype_lookup(L, &match, false);
+    }
+
+    luaL_argcheck(L, ct->type == CTYPE_PTR && ct->ptr->type == CTYPE_FUNC, 1,
+                  "function pointer type expected");
+
+    func = ct->ptr->func;
+    ctx = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, ctx > 0 && ctx <= func->narg, 2, "parameter index out of range");
+    luaL_argcheck(L, func->args[ctx - 1]->type == CTYPE_PTR, 2, "pointer parameter expected");
+
+    lua_check_cb_options(L, 3, &ptr_mode, &thread);
+
+    cb = ccallback_trampoline(L, func, ctx, ptr_mode, thread);
+
+    cd = cdata_new(L, ct, NULL);
+    cd->cb = cb;
+    cdata_ptr_set(cd, cb->code);
+
+    return 1;
+}
+
+static int lua_ffi_handle(lua_State *L)
+{
+    struct ctype match = {
+        .type = CTYPE_VOID,
+        .ft = &ffi_type_void
+    };
+    struct ctype *ct;
+    int h;
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &chandle_registry);
+    lua_pushvalue(L, 1);
+    h = luaL_ref(L, -2);
+
+    ctype_to_ptr(L, &match);
+    ct = ctype_lookup(L, &match, false);
+
+    cdata_ptr_set(cdata_new(L, ct, NULL), (void *)(intptr_t)h);
+
+    return 1;
+}
+
+static int lua_ffi_unhandle(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    uintptr_t h;
+
+    luaL_argcheck(L, cdata_type(cd) == CTYPE_PTR, 1, "handle expected");
+
+    h = (uintptr_t)cdata_ptr_ptr(cd);
+
+    if (!ccallback_push_handle(L, (void *)h))
+        return luaL_argerror(L, 1, "invalid callback handle");
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &chandle_registry);
+    luaL_unref(L, -1, h);
+
+    return 0;
+}
+
+static int lua_ffi_poll(lua_State *L)
+{
+    lua_Integer max = luaL_optinteger(L, 1, 0);
+    struct cqueue *q = cqueue_get(L);
+    struct cqueue_node *node;
+    lua_State *caller;
+    lua_Integer n = 0;
+
+    caller = cqueue_enter(q, L);
+
+#ifdef __linux__
+    /* reset before draining, so that later pushes signal again */
+    if (q->fd >= 0) {
+        uint64_t count;
+        ssize_t ret = read(q->fd, &count, sizeof(count));
+
+        (void)ret;
+    }
+#endif
+
+    while ((max < 1 || n < max) && (node = cqueue_pop(q))) {
+        struct cqueue_msg *msg = (struct cqueue_msg *)node;
+        struct ccallback *cb = msg->cb;
+
+        bool err;
+
+        ccallback_call(cb, L, msg->sync ? msg->ret : NULL, msg->args, !msg->sync);
+        cqueue_msg_done(msg);
+        n++;
+
+        err = cb->err_ref != LUA_REFNIL;
+        if (err) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, cb->err_ref);
+            luaL_unref(L, LUA_REGISTRYINDEX, cb->err_ref);
+            cb->err_ref = LUA_REFNIL;
+        }
+
+        /* collected while its calls were queued */
+        if (cb->orphan && !__atomic_load_n(&cb->pending, __ATOMIC_ACQUIRE))
+            ccallback_release(L, cb);
+
+        if (err) {
+            q->current = caller;
+            cqueue_notify(q);
+            return lua_error(L);
+        }
+    }
+
+    q->current = caller;
+
+    /* wake the event loop again for the calls left over */
+    if (max > 0 && n == max)
+        cqueue_notify(q);
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+static int lua_ffi_pollfd(lua_State *L)
+{
+    struct cqueue *q = cqueue_get(L);
+
+    if (q->fd < 0)
+        return 0;
+
+    lua_pushinteger(L, q->fd);
+    return 1;
+}
+
+static const char *const bind_rets[] = {"value", "into", "unpack", NULL};
+static const char *const bind_int64s[] = {"number", "cdata", NULL};
+
+static const lua_CFunction bind_calls[] = {
+    cdata_bound_call,
+    cdata_bound_call_into,
+    cdata_bound_call_unpack
+};
+
+static int lua_ffi_bind(lua_State *L)
+{
+    struct cdata *cd;
+    int box64 = 0;
+    int opt = 2;
+    int ret = 0;
+
+    if (luaL_testudata(L, 1, CLIB_MT)) {
+        luaL_checkstring(L, 2);
+        lua_pushvalue(L, 2);
+        lua_gettable(L, 1);
+        lua_replace(L, 1);
+        opt = 3;
+    }
+
+    cd = luaL_checkudata(L, 1, CDATA_MT);
+    luaL_argcheck(L, cdata_func(cd), 1, "function cdata expected");
+
+    if (!cdata_ptr_ptr(cd))
+        return luaL_error(L, "attempt to bind null function pointer");
+
+    if (!lua_isnoneornil(L, opt)) {
+        luaL_checktype(L, opt, LUA_TTABLE);
+
+        ret = lua_check_table_option(L, opt, "ret", bind_rets, 0);
+
+        if (ret && cdata_func(cd)->rtype->type != CTYPE_RECORD)
+            return luaL_argerror(L, 1, "function returning a struct expected");
+
+        box64 = lua_check_table_option(L, opt, "int64", bind_int64s, 0);
+    }
+
+    lua_settop(L, 1);
+    lua_pushboolean(L, box64);
+    lua_pushcclosure(L, bind_calls[ret], 2);
+
+    return 1;
+}
+
+/* a function cdata returning a record */
+static struct cfunc *lua_check_record_func(lua_State *L, int idx, void **sym)
+{
+    struct cdata *cd = luaL_checkudata(L, idx, CDATA_MT);
+    struct cfunc *func = cdata_func(cd);
+
+    luaL_argcheck(L, func, idx, "function cdata expected");
+    luaL_argcheck(L, func->rtype->type == CTYPE_RECORD, idx,
+                  "function returning a struct expected");
+
+    *sym = cdata_ptr_ptr(cd);
+    if (!*sym)
+        luaL_error(L, "attempt to call null function pointer");
+
+    return func;
+}
+
+static int lua_ffi_into(lua_State *L)
+{
+    void *sym;
+    struct cfunc *func = lua_check_record_func(L, 2, &sym);
+
+    return cfunc_call_into(L, func, sym, 1, 3, false);
+}
+
+static int lua_ffi_unpack(lua_State *L)
+{
+    void *sym;
+    struct cfunc *func = lua_check_record_func(L, 1, &sym);
+
+    return cfunc_call_unpack(L, func, sym, 2, false);
+}
+
+static int lua_ffi_metatype(lua_State *L)
+{
+    struct ctype *ct = luaL_checkudata(L, 1, CTYPE_MT);
+    struct crecord *rc = ct->rc;
+    uint8_t mflags = 0;
+
+    luaL_argcheck(L, ct->type == CTYPE_RECORD, 1, "invalid C type");
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+#define FIELD_CHECK(name, flag) { \
+            lua_getfield(L, 2, "__" name); \
+            if (!lua_isnil(L, -1)) { \
+                mflags |= METATYPE_FLAG_##flag; \
+            } \
+            lua_pop(L, 1); \
+        }
+
+    FIELD_CHECK("index", INDEX);
+    FIELD_CHECK("tostring", TOSTRING);
+
+#undef FIELD_CHECK
+
+    rc->mflags = mflags;
+
+    if (rc->mt_ref != LUA_REFNIL)
+        luaL_unref(L, LUA_REGISTRYINDEX, rc->mt_ref);
+
+    lua_pushvalue(L, 2);
+    rc->mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int lua_ffi_typeof(lua_State *L)
+{
+    lua_check_ct(L, NULL, true);
+    return 1;
+}
+
+static int lua_ffi_addressof(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct ctype match = {
+        .type = CTYPE_PTR,
+        .ptr = cd->ct
+    };
+    struct ctype *ct = ctype_lookup(L, &match, false);
+    cdata_ptr_set(cdata_new(L, ct, NULL), cdata_ptr(cd));
+    return 1;
+}
+
+/* moves a pointer cdata by n elements in place, as p = p + n would */
+static int lua_ffi_advance(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    uint64_t n = 1;
+    uint8_t *addr;
+    lua_Number x;
+
+    luaL_argcheck(L, cdata_type(cd) == CTYPE_PTR, 1, "pointer cdata expected");
+
+    if (cd->ct->is_const)
+        return luaL_error(L, "assignment of read-only variable");
+
+    if (!lua_isnoneornil(L, 2) && carith_arg(L, 2, "advance by", &n, &x) == CARITH_ARG_NUM)
+        return luaL_argerror(L, 2, "number has no integer representation");
+
+    cdata_elems(cd, &addr);
+    cdata_ptr_set(cd, (void *)((uintptr_t)addr + n * cptr_elem_size(L, cd->ct->ptr)));
+
+    /* cached children refer to the old elements */
+    cdata_clear_children(L, cd, 1);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lua_ffi_gc(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+
+    if (lua_isnil(L, 2)) {
+        if (cd->gc_ref != LUA_REFNIL) {
+            luaL_unref(L, LUA_REGISTRYINDEX, cd->gc_ref);
+            cd->gc_ref = LUA_REFNIL;
+        }
+    } else {
+        lua_pushvalue(L, 2);
+        cd->gc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static const char *const ccache_policies[] = {
+    "default", "strong", "weak", "lru", "off", "cursor", NULL
+};
+
+/*
+ * Sets how the child cdata of a cdata are cached, or those of the arrays
+ * and pointers of a record type.
+ */
+static int lua_ffi_cachepolicy(lua_State *L)
+{
+    struct cdata *cd = luaL_testudata(L, 1, CDATA_MT);
+    int policy = luaL_checkoption(L, 2, NULL, ccache_policies);
+    lua_Integer size = luaL_optinteger(L, 3, CCACHE_LRU_SIZE);
+    struct ctype *ct;
+
+    luaL_argcheck(L, size > 0 && size <= INT_MAX, 3, "cache size out of range");
+
+    if (cd) {
+        cd->cache = policy;
+        cd->children = 0;
+
+#if LUA_VERSION_NUM > 501
+        lua_pushnil(L);
+        lua_setuservalue(L, 1);
+#endif
+
+        if (policy == CCACHE_LRU) {
+            ccache_push(L, cd, 1, policy, size);
+            lua_pop(L, 1);
+        }
+    } else {
+        ct = lua_check_ct(L, NULL, false);
+
+        if (ct->type == CTYPE_ARRAY)
+            ct = ct->array->ct;
+        else if (ct->type == CTYPE_PTR)
+            ct = ct->ptr;
+
+        luaL_argcheck(L, ct->type == CTYPE_RECORD, 1, "struct or union type expected");
+
+        ct->rc->cache = policy;
+        ct->rc->cache_size = size;
+    }
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lua_ffi_sizeof(lua_State *L)
+{
+    struct ctype *ct = lua_check_ct(L, NULL, false);
+    lua_pushinteger(L, ctype_sizeof(ct));
+    return 1;
+}
+
+static int lua_ffi_offsetof(lua_State *L)
+{
+    struct ctype *ct = lua_check_ct(L, NULL, false);
+    struct crecord_index *field;
+    const char *name;
+    size_t len;
+
+    name = luaL_checklstring(L, 2, &len);
+
+    if (ct->type != CTYPE_RECORD)
+        return 0;
+
+    field = crecord_find(ct->rc, name, len);
+    if (!field)
+        return 0;
+
+    lua_pushinteger(L, field->offset);
+    return 1;
+}
+
+static int lua_ffi_istype(lua_State *L)
+{
+    struct ctype *ct = lua_check_ct(L, NULL, false);
+    struct cdata *cd = luaL_checkudata(L, 2, CDATA_MT);
+    lua_pushboolean(L, ct == cd->ct);
+    return 1;
+}
+
+static int lua_ffi_tonumber(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct ctype *ct = cd->ct;
+
+    if (ct->type < CTYPE_VOID)
+        return cdata_to_lua(L, ct, cdata_ptr(cd));
+    lua_pushnil(L);
+    return 1;
+}
+
+static const char *const cinplace_ops[] = {
+    "=", "+", "-", "*", "/", "%", "&", "|", "~", "<<", ">>", NULL
+};
+
+static const uint8_t cinplace_arith[] = {
+    CARITH_SET, CARITH_ADD, CARITH_SUB, CARITH_MUL, CARITH_DIV, CARITH_MOD,
+    CARITH_BAND, CARITH_BOR, CARITH_BXOR, CARITH_SHL, CARITH_SHR
+};
+
+/*
+ * Applies "op, value" pairs to an integer cdata in place, as the compound
+ * assignments of C would, without creating any cdata.
+ */
+static int lua_ffi_inplace(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct ctype *ct = cd->ct;
+    void *ptr = cdata_ptr(cd);
+    int top = lua_gettop(L);
+    uint64_t v, b;
+    lua_Number n;
+    bool u;
+    int i;
+
+    luaL_argcheck(L, ctype_is_int(ct), 1, "integer cdata expected");
+
+    if (ct->is_const)
+        return luaL_error(L, "assignment of read-only variable");
+
+    u = ct->ft->type == FFI_TYPE_UINT64;
+    v = cint_load(ct, ptr);
+
+    for (i = 2; i <= top; i += 2) {
+        int op = cinplace_arith[luaL_checkoption(L, i, NULL, cinplace_ops)];
+        int kind;
+
+        luaL_checkany(L, i + 1);
+
+        kind = carith_arg(L, i + 1, "perform arithmetic on", &b, &n);
+        if (kind == CARITH_ARG_NUM)
+            return luaL_argerror(L, i + 1, "number has no integer representation");
+
+        /* truncated to the type after each step */
+        cint_store(ct, ptr, carith_int(L, op, v, b, u || kind == CARITH_ARG_U64));
+        v = cint_load(ct, ptr);
+    }
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int lua_ffi_string(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct carray *array = NULL;
+    struct ctype *ct = cd->ct;
+    const char *ptr = ct->type == CTYPE_PTR ? cdata_ptr_ptr(cd) : cdata_ptr(cd);
+    size_t len;
+
+    if (lua_gettop(L) > 1) {
+        len = luaL_checkinteger(L, 2);
+
+        switch (ct->type) {
+        case CTYPE_PTR:
+        case CTYPE_ARRAY:
+        case CTYPE_RECORD:
+            lua_pushlstring(L, ptr, len);
+            return 1;
+        default:
+            goto converr;
         }
+    }
 
-        if (cparse_check_tok(L, tok) == TOK_NAME) {
-            if (name) {
-                *name = strdup(yyget_text());
-                if (!*name)
-                    luaL_error(L, "no mem");
-            }
-            tok = yylex();
-        }
+    switch (ct->type) {
+    case CTYPE_PTR:
+        ct = ct->ptr;
+        break;
+    case CTYPE_ARRAY:
+        array = ct->array;
+        ct = array->ct;
+        break;
+    default:
+        goto converr;
+    }
 
-        if (cparse_check_tok(L, tok) != ')')
-            return cparse_expected_error(L, tok, ")");
+    if (ct->type != CTYPE_CHAR)
+        goto converr;
 
-        tok = yylex();
-        if (cparse_check_tok(L, tok) != '(')
-            return cparse_expected_error(L, tok, "(");
+    if (array && array->size) {
+        char *p = memchr(ptr, '\0', array->ft.size);
+        len = p ? p - ptr : array->ft.size;
+        lua_pushlstring(L, ptr, len);
+    } else {
+        lua_pushstring(L, ptr);
+    }
 
-        tok = cparse_function_args(L, tok, fargs, &fnarg, &fva);
+    return 1;
 
-        cparse_build_func_type(L, ct, fargs, fnarg, fva, &fct);
-        *ct = fct;
+converr:
+    __cdata_tostring(L, cd);
+    lua_pushfstring(L, "cannot convert '%s' to 'string'", lua_tostring(L, -1));
+    luaL_argcheck(L, false, 1, lua_tostring(L, -1));
+    return 0;
+}
 
-        while (ptr_depth-- > 0)
-            ctype_to_ptr(L, ct);
+static int lua_ffi_copy(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    void *dst = cdata_ptr(cd);
+    const void *src;
+    size_t len;
 
-        if (ptr_const && ct->type == CTYPE_PTR)
-            ct->is_const = true;
+    if (lua_gettop(L) < 3) {
+        src = luaL_checklstring(L, 2, &len);
+        memcpy(dst, src, len);
+        ((char *)dst)[len++] = '\0';
+    } else {
+        len = luaL_checkinteger(L, 3);
 
-        tok = yylex();
+        if (lua_type(L, 2) == LUA_TSTRING)
+            src = lua_tostring(L, 2);
+        else
+            src = cdata_ptr(luaL_checkudata(L, 2, CDATA_MT));
 
-        return tok;
+        memcpy(dst, src, len);
     }
 
-    tok = cparse_pointer(L, tok, ct);
+    lua_pushinteger(L, len);
 
-    if (cparse_check_tok(L, tok) == TOK_NAME) {
-        if (name) {
-            *name = strdup(yyget_text());
-            if (!*name)
-                luaL_error(L, "no mem");
-        }
-        tok = yylex();
-    }
+    return 1;
+}
 
-    tok = cparse_array(L, tok, &flexible, &array_size);
+static int lua_ffi_fill(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    int len = luaL_checkinteger(L, 2);
+    int c = luaL_optinteger(L, 3, 0);
 
-    if (flexible || array_size >= 0)
-        ctype_to_ptr(L, ct);
+    memset(cdata_ptr(cd), c, len);
 
-    return tok;
+    return 0;
 }
 
-static int cparse_function_args(lua_State *L, int tok, struct ctype *args,
-        int *narg, bool *va)
+static int lua_ffi_errno(lua_State *L)
 {
-    *narg = 0;
-    *va = false;
+    int cur = errno;
 
-    while (true) {
-        tok = yylex();
-        if (cparse_check_tok(L, tok) == ')')
-            break;
+    if (lua_gettop(L) > 0)
+        errno = luaL_checkinteger(L, 1);
 
-        if (*narg >= MAX_FUNC_ARGS)
-            return luaL_error(L, "%d:too many arguments", yyget_lineno());
+    lua_pushinteger(L, cur);
+    return 1;
+}
 
-        if (cparse_check_tok(L, tok) == TOK_STRUCT || cparse_check_tok(L, tok) == TOK_UNION) {
-            tok = cparse_record(L, &args[*narg], cparse_check_tok(L, tok) == TOK_UNION);
-        } else if (cparse_check_tok(L, tok) == TOK_VAL) {
-            tok = yylex();
-            if (cparse_check_tok(L, tok) != ')')
-                return cparse_expected_error(L, tok, ")");
-            *va = true;
-            break;
-        } else {
-            tok = cparse_basetype(L, tok, &args[*narg]);
-        }
+/*
+ * Resolves a dotted field path such as "ops.fn" starting at a struct or
+ * struct pointer cdata. Pointers to structs along the path are followed.
+ */
+static void *cdata_field_path(lua_State *L, struct cdata *cd, const char *path,
+        struct ctype **ctp)
+{
+    struct ctype *ct = cd->ct;
+    uint8_t *ptr = cdata_ptr(cd);
 
-        tok = cparse_function_arg(L, tok, &args[*narg], NULL);
+    while (true) {
+        struct crecord_index *field;
+        const char *dot = strchr(path, '.');
+        size_t len = dot ? dot - path : strlen(path);
+        const char *name;
 
-        if (cparse_check_tok(L, tok) == ')') {
-            if (args[*narg].type == CTYPE_VOID && *narg == 0)
-                break;
+        if (ct->type == CTYPE_PTR && ct->ptr->type == CTYPE_RECORD) {
+            ptr = *(void **)ptr;
+            ct = ct->ptr;
 
-            check_void_forbidden(L, &args[*narg], tok);
-            (*narg)++;
-            break;
+            if (!ptr)
+                luaL_error(L, "attempt to index null pointer");
         }
 
-        check_void_forbidden(L, &args[*narg], tok);
-        (*narg)++;
+        if (ct->type != CTYPE_RECORD) {
+            __ctype_tostring(L, ct);
+            luaL_error(L, "ctype '%s' cannot be indexed", lua_tostring(L, -1));
+        }
 
-        if (cparse_check_tok(L, tok) != ',')
-            return cparse_expected_error(L, tok, ",");
-    }
+        if (len == 0)
+            luaL_error(L, "invalid field path");
 
-    return tok;
-}
+        lua_pushlstring(L, path, len);
+        name = lua_tostring(L, -1);
 
-static int cparse_function(lua_State *L, int tok, struct ctype *rtype)
-{
-    struct ctype args[MAX_FUNC_ARGS] = {};
-    struct ctype fct;
-    int narg = 0;
-    bool va = false;
+        field = crecord_find(ct->rc, name, len);
+        if (!field) {
+            __ctype_tostring(L, ct);
+            luaL_error(L, "ctype '%s' has no member named '%s'", lua_tostring(L, -1), name);
+        }
 
-    tok = cparse_pointer(L, tok, rtype);
+        lua_pop(L, 1);
 
-    if (cparse_check_tok(L, tok) != TOK_NAME)
-        return cparse_expected_error(L, tok, "identifier");
+        ptr += field->offset;
+        ct = field->ct;
 
-    lua_pushstring(L, yyget_text());
+        if (!dot)
+            break;
 
-    lua_rawgetp(L, LUA_REGISTRYINDEX, &cfunc_registry);
-    lua_pushvalue(L, -2);
-    lua_gettable(L, -2);
+        path = dot + 1;
+    }
 
-    if (!lua_isnil(L, -1))
-        return luaL_error(L, "%d:redefinition of function '%s'", yyget_lineno(), lua_tostring(L, -3));
+    *ctp = ct;
 
-    lua_pop(L, 1);
+    return ptr;
+}
 
-    tok = yylex();
+static int lua_ffi_vcall(lua_State *L)
+{
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    const char *path = luaL_checkstring(L, 2);
+    struct ctype *ct;
+    void *ptr, *sym;
 
-    if (cparse_check_tok(L, tok) != '(')
-        return cparse_expected_error(L, tok, "(");
+    ptr = cdata_field_path(L, cd, path, &ct);
 
-    tok = cparse_function_args(L, tok, args, &narg, &va);
+    if (!ctype_ptr_to(ct, CTYPE_FUNC)) {
+        __ctype_tostring(L, ct);
+        return luaL_error(L, "'%s' is not callable", lua_tostring(L, -1));
+    }
 
-    tok = yylex();
-    if (cparse_check_tok(L, tok) != ';')
-        return cparse_expected_error(L, tok, ";");
+    sym = *(void **)ptr;
+    if (!sym)
+        return luaL_error(L, "attempt to call null function pointer");
 
-    cparse_build_func_type(L, rtype, args, narg, va, &fct);
+    return cfunc_call(L, ct->ptr->func, sym, 3, NULL, false);
+}
 
-    lua_pushvalue(L, -2);
-    lua_pushlightuserdata(L, fct.func);
-    lua_settable(L, -3);
-    lua_pop(L, 2);
+/* a field path compiled to offsets, a pointer is loaded after each but the last */
+struct caccessor {
+    struct crecord *rc;     /* record the path starts at */
+    struct ctype *leaf;
+    cconv_to_t get;
+    cconv_from_t set;
+    bool readonly;
+    int nhop;
+    size_t offsets[0];
+};
 
-    return 0;
+static bool caccessor_can_load(struct ctype *ct)
+{
+    return ct->type == CTYPE_PTR && ct->ptr->type != CTYPE_VOID && ct->ptr->type != CTYPE_FUNC;
 }
 
-static int lua_ffi_cdef(lua_State *L)
+/* indexing through a pointer loads it first */
+static struct ctype *caccessor_load(struct caccessor *acc, struct ctype *ct, size_t *offset)
 {
-    size_t len;
-    const char *str = luaL_checklstring(L, 1, &len);
-    lua_Debug ar;
-    int tok;
-
-    lua_getstack(L, 1, &ar);
-    lua_getinfo(L, "nSl", &ar);
-
-    yy_scan_bytes(str, len);
-    yyset_lineno(ar.currentline);
-
-    while ((tok = yylex())) {
-        bool tdef = false;
-        struct ctype ct;
-
-        if (cparse_check_tok(L, tok) == ';')
-            continue;
+    acc->offsets[acc->nhop++] = *offset;
+    *offset = 0;
 
-        if (cparse_check_tok(L, tok) == TOK_TYPEDEF) {
-            tdef = true;
-            tok = yylex();
-        }
+    if (ct->ptr->is_const)
+        acc->readonly = true;
 
-        tok = cparse_basetype(L, tok, &ct);
+    return ct->ptr;
+}
 
-        if (tdef) {
-            char *name = NULL;
+/* compiles one '[n]' or 'name' of path, returns the type it leads to */
+static struct ctype *caccessor_step(lua_State *L, struct caccessor *acc, struct ctype *ct,
+        size_t *offset, const char **path)
+{
+    const char *p = *path;
 
-            if (cparse_check_tok(L, tok) == '(') {
-                tok = cparse_function_arg(L, tok, &ct, &name);
-            } else {
-                tok = cparse_pointer(L, tok, &ct);
+    if (*p == '[') {
+        char *end;
+        unsigned long idx = strtoul(p + 1, &end, 10);
 
-                if (cparse_check_tok(L, tok) != TOK_NAME)
-                    return cparse_expected_error(L, tok, "identifier");
+        if (end == p + 1 || *end != ']')
+            luaL_error(L, "invalid accessor path");
 
-                name = strdup(yyget_text());
-                if (!name)
-                    return luaL_error(L, "no mem");
-                tok = yylex();
-            }
+        if (caccessor_can_load(ct)) {
+            ct = caccessor_load(acc, ct, offset);
+        } else if (ct->type == CTYPE_ARRAY) {
+            if (ct->array->size > 0 && idx >= ct->array->size)
+                luaL_error(L, "index %d out of range", (int)idx);
+            ct = ct->array->ct;
+        } else {
+            goto not_indexable;
+        }
 
-            if (!name)
-                return cparse_expected_error(L, tok, "identifier");
+        *offset += ctype_sizeof(ct) * idx;
+        *path = end + 1;
+    } else {
+        struct crecord_index *field;
+        const char *name;
+        size_t len = 0;
 
-            lua_rawgetp(L, LUA_REGISTRYINDEX, &ctdef_registry);
-            lua_getfield(L, -1, name);
+        while (isalnum((unsigned char)p[len]) || p[len] == '_')
+            len++;
 
-            if (!lua_isnil(L, -1)) {
-                return luaL_error(L, "%d:redefinition of symbol '%s'", yyget_lineno(), name);
-            }
+        if (len == 0)
+            luaL_error(L, "invalid accessor path");
 
-            lua_pop(L, 1);
-            ctype_lookup(L, &ct, true);
-            lua_setfield(L, -2, name);
-            lua_pop(L, 1);
+        if (ctype_ptr_to(ct, CTYPE_RECORD))
+            ct = caccessor_load(acc, ct, offset);
 
-            free(name);
+        if (ct->type != CTYPE_RECORD)
+            goto not_indexable;
 
-            if (cparse_check_tok(L, tok) != ';')
-                return cparse_expected_error(L, tok, ";");
+        lua_pushlstring(L, p, len);
+        name = lua_tostring(L, -1);
 
-            continue;
+        field = crecord_find(ct->rc, name, len);
+        if (!field) {
+            __ctype_tostring(L, ct);
+            luaL_error(L, "ctype '%s' has no member named '%s'", lua_tostring(L, -1), name);
         }
 
-        if (cparse_check_tok(L, tok) == ';')
-            continue;
+        lua_pop(L, 1);
 
-        cparse_function(L, tok, &ct);
+        ct = field->ct;
+        *offset += field->offset;
+        *path = p + len;
     }
 
-    yylex_destroy();
+    return ct;
 
-    return 0;
+not_indexable:
+    __ctype_tostring(L, ct);
+    luaL_error(L, "ctype '%s' cannot be indexed", lua_tostring(L, -1));
+    return NULL;
 }
 
-static int load_lib(lua_State *L, const char *path, bool global)
+/* the address of the leaf in the record or record pointer at index 1 */
+static void *caccessor_ptr(lua_State *L, struct caccessor *acc, bool set)
 {
-    struct clib *lib;
-    void *h;
+    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    struct ctype *ct = cd->ct;
+    uint8_t *ptr;
+    int i;
 
-    if (path) {
-        h = dlopen(path, RTLD_LAZY | (global ? RTLD_GLOBAL : RTLD_LOCAL));
-        if (!h) {
-            const char *err = dlerror();
-            return luaL_error(L, err ? err : "dlopen() failed");
-        }
+    if (ct->type == CTYPE_RECORD && ct->rc == acc->rc) {
+        ptr = cdata_ptr(cd);
+    } else if (ctype_ptr_to(ct, CTYPE_RECORD) && ct->ptr->rc == acc->rc) {
+        ptr = cdata_ptr_ptr(cd);
+        ct = ct->ptr;
     } else {
-        h = RTLD_DEFAULT;
+        __ctype_tostring(L, ct);
+        luaL_argerror(L, 1, lua_pushfstring(L, "unexpected ctype '%s'", lua_tostring(L, -1)));
+        return NULL;
     }
 
-    lib = lua_newuserdata(L, sizeof(struct clib));
-    lib->h = h;
-
-    lua_newtable(L);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, lib);
-
-    luaL_getmetatable(L, CLIB_MT);
-    lua_setmetatable(L, -2);
+    if (set && (ct->is_const || acc->readonly))
+        luaL_error(L, "assignment of read-only variable");
 
-    if (global) {
-        lua_rawgetp(L, LUA_REGISTRYINDEX, &clib_registry);
-        lua_pushvalue(L, -2);
-        lua_rawsetp(L, -2, lib);
-        lua_pop(L, 1);
+    for (i = 0; i < acc->nhop; i++) {
+        if (!ptr)
+            luaL_error(L, "attempt to index null pointer");
+        ptr = *(uint8_t **)(ptr + acc->offsets[i]);
     }
 
-    return 1;
+    if (!ptr)
+        luaL_error(L, "attempt to index null pointer");
+
+    return ptr + acc->offsets[acc->nhop];
 }
 
-static int lua_ffi_load(lua_State *L)
+static int caccessor_get(lua_State *L)
 {
-    const char *path = luaL_checkstring(L, 1);
-    bool global = lua_toboolean(L, 2);
-    return load_lib(L, path, global);
+    struct caccessor *acc = lua_touserdata(L, lua_upvalueindex(1));
+
+    return acc->get(L, acc->leaf, caccessor_ptr(L, acc, false));
 }
 
-static struct ctype *lua_check_ct(lua_State *L, bool *va, bool keep)
+static int caccessor_set(lua_State *L)
 {
-    struct cdata *cd;
-    struct ctype *ct;
-
-    if (lua_type(L, 1) == LUA_TSTRING) {
-        size_t len;
-        const char *str = luaL_checklstring(L, 1, &len);
-        bool flexible = false;
-        struct ctype match;
-        int array_size;
-        lua_Debug ar;
-        int tok;
+    struct caccessor *acc = lua_touserdata(L, lua_upvalueindex(1));
 
-        lua_getstack(L, 1, &ar);
-        lua_getinfo(L, "nSl", &ar);
+    luaL_checkany(L, 2);
+    acc->set(L, acc->leaf, caccessor_ptr(L, acc, true), 2);
 
-        yy_scan_bytes(str, len);
+    return 0;
+}
 
-        yyset_lineno(ar.currentline - 1);
+static int lua_ffi_accessor(lua_State *L)
+{
+    struct ctype *ct = lua_check_ct(L, NULL, false);
+    const char *path = luaL_checkstring(L, 2);
+    struct caccessor *acc;
+    size_t offset = 0;
+    const char *p;
+    int nstep = 1;
 
-        if (va)
-            flexible = *va;
+    if (ctype_ptr_to(ct, CTYPE_RECORD))
+        ct = ct->ptr;
 
-        tok = cparse_basetype(L, yylex(), &match);
+    luaL_argcheck(L, ct->type == CTYPE_RECORD, 1, "struct or union type expected");
 
-        if (cparse_check_tok(L, tok) == '(') {
-            tok = cparse_function_arg(L, tok, &match, NULL);
-        } else {
-            tok = cparse_pointer(L, tok, &match);
-            tok = cparse_array(L, tok, &flexible, &array_size);
+    /* a hop per step at most */
+    for (p = path; *p; p++) {
+        if (*p == '.' || *p == '[')
+            nstep++;
+    }
 
-            if (flexible || array_size >= 0) {
-                if (flexible) {
-                    array_size = luaL_checkinteger(L, 2);
-                    luaL_argcheck(L, 2, array_size > 0, "array size must great than 0");
-                }
+    acc = lua_newuserdata(L, sizeof(struct caccessor) + sizeof(size_t) * (nstep + 1));
+    memset(acc, 0, sizeof(struct caccessor));
+    acc->rc = ct->rc;
 
-                cparse_new_array(L, array_size, &match);
-            }
-        }
+    p = path;
 
-        if (tok)
-            luaL_error(L, "%d:unexpected '%s'", yyget_lineno(), yyget_text());
+    while (true) {
+        ct = caccessor_step(L, acc, ct, &offset, &p);
 
-        if (va)
-            *va = flexible;
+        if (ct->is_const)
+            acc->readonly = true;
 
-        yylex_destroy();
+        if (*p == '\0')
+            break;
 
-        return ctype_lookup(L, &match, keep);
+        if (*p == '.')
+            p++;
+        else if (*p != '[')
+            return luaL_error(L, "invalid accessor path");
     }
-
-    if (va)
-        *va = false;
-
-    ct = luaL_testudata(L, 1, CTYPE_MT);
-    if (ct)
-        return ct;
-
-    cd = luaL_testudata(L, 1, CDATA_MT);
-    if (cd) {
-        if (keep) {
-            lua_rawgetp(L, LUA_REGISTRYINDEX, &ctype_registry);
-            lua_pushlightuserdata(L, cd->ct);
-            lua_gettable(L, -2);
-            lua_remove(L, -2);
-        }
-        return cd->ct;
+
+    acc->offsets[acc->nhop] = offset;
+    acc->leaf = ct;
+    acc->get = ct->type == CTYPE_BOOL ? cconv_to_generic : cconv_to_select(ct);
+    acc->set = cconv_from_select(ct);
+
+    if (ct->type == CTYPE_VOID || !acc->get) {
+        __ctype_tostring(L, ct);
+        return luaL_error(L, "accessor path ends at non-scalar ctype '%s'", lua_tostring(L, -1));
     }
 
-    lua_type_error(L, 1, "C type");
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, caccessor_set, 1);
+    lua_insert(L, -2);
+    lua_pushcclosure(L, caccessor_get, 1);
+    lua_insert(L, -2);
 
-    return NULL;
+    return 2;
 }
 
-static int lua_ffi_new(lua_State *L)
+enum {
+    CALLMANY_CONST,
+    CALLMANY_TABLE,
+    CALLMANY_CDATA
+};
+
+struct callmany {
+    struct cfunc *func;
+    void *sym;
+    lua_Integer n;
+    lua_Integer row;
+    uint8_t *out;
+    uint8_t *kinds;
+    uint8_t **cols;
+};
+
+/* runs protected, the output is at stack index 2 and the columns start at 3 */
+static int callmany_rows(lua_State *L)
 {
-    bool va = true;
-    struct ctype *ct = lua_check_ct(L, &va, false);
+    struct callmany *cm = lua_touserdata(L, 1);
+    struct cfunc *func = cm->func;
+    size_t rsize = ctype_sizeof(func->rtype);
+    void **values, *frame, *rvalue;
+    int slot = 0;
+    int top, i;
+
+    /* a userdata is kept below top until all rows are done */
+    values = CALL_SCRATCH(L, sizeof(void *) * func->narg, &slot);
+    frame = alloca(func->frame_size);
+    rvalue = alloca(cfunc_rsize(func));
+    top = lua_gettop(L);
 
-    if (ct->type == CTYPE_FUNC || ct->type == CTYPE_VOID)
-        return luaL_error(L, "invalid C type");
+    for (i = 0; i < func->narg; i++) {
+        values[i] = frame + func->offsets[i];
+        if (cm->kinds[i] == CALLMANY_CONST)
+            func->convs[i](L, func->args[i], values[i], 3 + i);
+    }
 
-    struct cdata *cd = cdata_new(L, ct, NULL);
-    int idx = va ? 3 : 2;
-    int ninit;
+    for (cm->row = 1; cm->row <= cm->n; cm->row++) {
+        lua_Integer r = cm->row - 1;
 
-    ninit = lua_gettop(L) - idx;
+        for (i = 0; i < func->narg; i++) {
+            size_t size = ctype_sizeof(func->args[i]);
 
-    if (ninit == 1) {
-        cdata_from_lua(L, cd->ct, cdata_ptr(cd), idx, false);
-    } else if (ninit != 0) {
-        __ctype_tostring(L, ct);
-        return luaL_error(L, "too many initializers for '%s'", lua_tostring(L, -1));
-    }
+            switch (cm->kinds[i]) {
+            case CALLMANY_TABLE:
+                lua_rawgeti(L, 3 + i, cm->row);
+                func->convs[i](L, func->args[i], values[i], lua_gettop(L));
+                break;
+            case CALLMANY_CDATA:
+                values[i] = cm->cols[i] + r * size;
+                break;
+            }
+        }
 
-    return 1;
-}
+        if (func->rtype->type == CTYPE_RECORD && cm->out)
+            cfunc_invoke(L, func, cm->sym, values, cm->out + r * rsize);
+        else
+            cfunc_invoke(L, func, cm->sym, values, rvalue);
 
-static int lua_ffi_cast(lua_State *L)
-{
-    struct ctype *ct = lua_check_ct(L, NULL, false);
-    struct cdata *cd = cdata_new(L, ct, NULL);
+        ccallback_raise_argument_errors(L, 3, func->narg);
 
-    if (ct->type == CTYPE_PTR && ct->ptr->type == CTYPE_FUNC) {
-        luaL_checktype(L, 2, LUA_TFUNCTION);
-        cd->cb = ccallback_new(L, ct->ptr->func, 2);
-        cdata_ptr_set(cd, cd->cb->code);
-    } else {
-        cdata_from_lua(L, ct, cdata_ptr(cd), 2, true);
+        if (lua_gettop(L) > top) {
+            ccallback_raise_argument_errors(L, top + 1, lua_gettop(L) - top);
+            lua_settop(L, top);
+        }
+
+        if (cm->out && func->rtype->type != CTYPE_RECORD)
+            memcpy(cm->out + r * rsize, rvalue, rsize);
     }
 
-    return 1;
+    return 0;
 }
 
-static int lua_ffi_metatype(lua_State *L)
+static int lua_ffi_callmany(lua_State *L)
 {
-    struct ctype *ct = luaL_checkudata(L, 1, CTYPE_MT);
-    struct crecord *rc = ct->rc;
-    uint8_t mflags = 0;
+    struct callmany cm = {};
+    struct cfunc *func;
+    struct cdata *cd;
+    lua_State *caller;
+    int slot = 0;
+    int status, i;
 
-    luaL_argcheck(L, ct->type == CTYPE_RECORD, 1, "invalid C type");
+    cd = luaL_checkudata(L, 1, CDATA_MT);
+    func = cdata_func(cd);
+    luaL_argcheck(L, func, 1, "function cdata expected");
 
-    luaL_checktype(L, 2, LUA_TTABLE);
+    cm.func = func;
+    cm.sym = cdata_ptr_ptr(cd);
+    cm.n = luaL_checkinteger(L, 2);
 
-#define FIELD_CHECK(name, flag) { \
-            lua_getfield(L, 2, "__" name); \
-            if (!lua_isnil(L, -1)) { \
-                mflags |= METATYPE_FLAG_##flag; \
-            } \
-            lua_pop(L, 1); \
-        }
+    if (!cm.sym)
+        return luaL_error(L, "attempt to call null function pointer");
 
-    FIELD_CHECK("index", INDEX);
-    FIELD_CHECK("tostring", TOSTRING);
+    if (func->va)
+        return luaL_error(L, "variadic function not supported");
 
-#undef FIELD_CHECK
+    if (func->nout)
+        return luaL_error(L, "__out parameters not supported");
 
-    rc->mflags = mflags;
+    luaL_argcheck(L, cm.n >= 0, 2, "row count must be non-negative");
 
-    if (rc->mt_ref != LUA_REFNIL)
-        luaL_unref(L, LUA_REGISTRYINDEX, rc->mt_ref);
+    if (lua_gettop(L) - 3 != func->narg)
+        return luaL_error(L, "wrong number of arguments for function call");
 
-    lua_pushvalue(L, 2);
-    rc->mt_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    cfunc_prepare(L, func);
 
-    lua_settop(L, 1);
+    cm.cols = CALL_SCRATCH(L, (sizeof(uint8_t *) + sizeof(uint8_t)) * func->narg, &slot);
+    cm.kinds = (uint8_t *)&cm.cols[func->narg];
+    memset(cm.kinds, CALLMANY_CONST, func->narg);
 
-    return 1;
-}
+    if (!lua_isnil(L, 3)) {
+        struct cdata *out = luaL_checkudata(L, 3, CDATA_MT);
+        struct ctype *ct = cdata_elems(out, &cm.out);
 
-static int lua_ffi_typeof(lua_State *L)
-{
-    lua_check_ct(L, NULL, true);
-    return 1;
-}
+        if (!ct || func->rtype->type == CTYPE_VOID || ct->is_const
+            || !ctype_same_value(ct, func->rtype))
+            return luaL_argerror(L, 3, "array of the return type expected");
 
-static int lua_ffi_addressof(lua_State *L)
-{
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    struct ctype match = {
-        .type = CTYPE_PTR,
-        .ptr = cd->ct
-    };
-    struct ctype *ct = ctype_lookup(L, &match, false);
-    cdata_ptr_set(cdata_new(L, ct, NULL), cdata_ptr(cd));
-    return 1;
-}
+        if (cdata_type(out) == CTYPE_ARRAY && out->ct->array->size > 0
+            && (size_t)cm.n > out->ct->array->size)
+            return luaL_argerror(L, 3, "array too short");
+    }
 
-static int lua_ffi_gc(lua_State *L)
-{
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
+    for (i = 0; i < func->narg; i++) {
+        struct ctype *ct;
 
-    if (lua_isnil(L, 2)) {
-        if (cd->gc_ref != LUA_REFNIL) {
-            luaL_unref(L, LUA_REGISTRYINDEX, cd->gc_ref);
-            cd->gc_ref = LUA_REFNIL;
+        if (lua_istable(L, 4 + i)) {
+            cm.kinds[i] = CALLMANY_TABLE;
+            continue;
         }
-    } else {
-        lua_pushvalue(L, 2);
-        cd->gc_ref = luaL_ref(L, LUA_REGISTRYINDEX);
-    }
 
-    lua_settop(L, 1);
-    return 1;
-}
+        cd = luaL_testudata(L, 4 + i, CDATA_MT);
+        if (!cd)
+            continue;
 
-static int lua_ffi_sizeof(lua_State *L)
-{
-    struct ctype *ct = lua_check_ct(L, NULL, false);
-    lua_pushinteger(L, ctype_sizeof(ct));
-    return 1;
-}
+        ct = cdata_elems(cd, &cm.cols[i]);
+        if (!ct || !ctype_same_value(ct, func->args[i]))
+            continue;
 
-static int lua_ffi_offsetof(lua_State *L)
-{
-    struct ctype *ct = lua_check_ct(L, NULL, false);
-    char const *name = luaL_checkstring(L, 2);
-    struct crecord_field **fields;
-    int i;
+        if (cdata_type(cd) == CTYPE_ARRAY && cd->ct->array->size > 0
+            && (size_t)cm.n > cd->ct->array->size)
+            return luaL_argerror(L, 4 + i, "array too short");
 
-    if (ct->type != CTYPE_RECORD)
-        return 0;
+        cm.kinds[i] = CALLMANY_CDATA;
+    }
 
-    fields = ct->rc->fields;
+    /* the row count is no longer needed, its slot anchors the scratch */
+    if (slot)
+        lua_replace(L, 2);
 
-    for (i = 0; i < ct->rc->nfield; i++) {
-        if (!strcmp(fields[i]->name, name)) {
-            lua_pushinteger(L, fields[i]->offset);
-            return 1;
-        }
+    lua_pushcfunction(L, callmany_rows);
+    lua_insert(L, 3);
+    lua_pushlightuserdata(L, &cm);
+    lua_insert(L, 4);
+
+    caller = cqueue_enter(func->queue, L);
+    status = lua_pcall(L, lua_gettop(L) - 3, 0, 0);
+    func->queue->current = caller;
+
+    if (status) {
+        if (cm.row > 0 && lua_type(L, -1) == LUA_TSTRING)
+            lua_pushfstring(L, "row %d: %s", (int)cm.row, lua_tostring(L, -1));
+        return lua_error(L);
     }
 
     return 0;
 }
 
-static int lua_ffi_istype(lua_State *L)
+static const char *const call_backends[] = {"auto", "libffi", "stub", "jit", NULL};
+
+static int lua_ffi_callopt(lua_State *L)
 {
+    static const char *const opts[] = {"backend", NULL};
     struct ctype *ct = lua_check_ct(L, NULL, false);
-    struct cdata *cd = luaL_checkudata(L, 2, CDATA_MT);
-    lua_pushboolean(L, ct == cd->ct);
-    return 1;
-}
+    struct cfunc *func;
+    int backend;
 
-static int lua_ffi_tonumber(lua_State *L)
-{
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    struct ctype *ct = cd->ct;
+    if (ctype_ptr_to(ct, CTYPE_FUNC))
+        ct = ct->ptr;
 
-    if (ct->type < CTYPE_VOID)
-        return cdata_to_lua(L, ct, cdata_ptr(cd));
-    lua_pushnil(L);
-    return 1;
-}
+    luaL_argcheck(L, ct->type == CTYPE_FUNC, 1, "function type expected");
 
-static int lua_ffi_string(lua_State *L)
-{
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    struct carray *array = NULL;
-    struct ctype *ct = cd->ct;
-    const char *ptr = ct->type == CTYPE_PTR ? cdata_ptr_ptr(cd) : cdata_ptr(cd);
-    size_t len;
+    func = ct->func;
 
-    if (lua_gettop(L) > 1) {
-        len = luaL_checkinteger(L, 2);
+    luaL_checkoption(L, 2, NULL, opts);
 
-        switch (ct->type) {
-        case CTYPE_PTR:
-        case CTYPE_ARRAY:
-        case CTYPE_RECORD:
-            lua_pushlstring(L, ptr, len);
-            return 1;
-        default:
-            goto converr;
-        }
+    if (lua_isnoneornil(L, 3)) {
+        lua_pushstring(L, call_backends[func->backend]);
+        return 1;
     }
 
-    switch (ct->type) {
-    case CTYPE_PTR:
-        ct = ct->ptr;
+    backend = luaL_checkoption(L, 3, NULL, call_backends);
+
+    switch (backend) {
+    case CALL_BACKEND_STUB:
+        if (!cfunc_stub(func))
+            return luaL_error(L, "no call stub for this function type");
         break;
-    case CTYPE_ARRAY:
-        array = ct->array;
-        ct = array->ct;
+    case CALL_BACKEND_JIT:
+        if (!cfunc_jit(L, func))
+            return luaL_error(L, "no call trampoline for this function type");
         break;
     default:
-        goto converr;
+        break;
     }
 
-    if (ct->type != CTYPE_CHAR)
-        goto converr;
-
-    if (array && array->size) {
-        char *p = memchr(ptr, '\0', array->ft.size);
-        len = p ? p - ptr : array->ft.size;
-        lua_pushlstring(L, ptr, len);
-    } else {
-        lua_pushstring(L, ptr);
-    }
+    func->backend = backend;
+    cfunc_resolve(L, func);
 
+    lua_pushstring(L, call_backends[backend]);
     return 1;
+}
 
-converr:
-    __cdata_tostring(L, cd);
-    lua_pushfstring(L, "cannot convert '%s' to 'string'", lua_tostring(L, -1));
-    luaL_argcheck(L, false, 1, lua_tostring(L, -1));
-    return 0;
+struct cstats {
+    size_t va_cache_hits;
+    size_t va_cache_misses;
+    size_t cb_created;
+    size_t cb_reused;
+    size_t cb_idle;
+    size_t ct_cache_hits;
+    size_t ct_cache_misses;
+};
+
+static void cfunc_stats(struct cfunc *func, struct cstats *st)
+{
+    if (func->va_cache) {
+        st->va_cache_hits += func->va_cache->hits;
+        st->va_cache_misses += func->va_cache->misses;
+    }
+
+    st->cb_created += func->cb_created;
+    st->cb_reused += func->cb_reused;
+    st->cb_idle += func->cb_idle;
 }
 
-static int lua_ffi_copy(lua_State *L)
+static int lua_ffi_stats(lua_State *L)
 {
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    void *dst = cdata_ptr(cd);
-    const void *src;
-    size_t len;
+    struct cstats st = {};
+    struct ctype *ct;
 
-    if (lua_gettop(L) < 3) {
-        src = luaL_checklstring(L, 2, &len);
-        memcpy(dst, src, len);
-        ((char *)dst)[len++] = '\0';
-    } else {
-        len = luaL_checkinteger(L, 3);
+    if (lua_isnoneornil(L, 1)) {
+        struct ctcache *cache = ctcache_get(L);
 
-        if (lua_type(L, 2) == LUA_TSTRING)
-            src = lua_tostring(L, 2);
-        else
-            src = cdata_ptr(luaL_checkudata(L, 2, CDATA_MT));
+        st.ct_cache_hits = cache->hits;
+        st.ct_cache_misses = cache->misses;
 
-        memcpy(dst, src, len);
-    }
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &ctype_registry);
 
-    lua_pushinteger(L, len);
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            ct = lua_touserdata(L, -1);
+            if (ct->type == CTYPE_FUNC)
+                cfunc_stats(ct->func, &st);
+            lua_pop(L, 1);
+        }
 
-    return 1;
-}
+        lua_pop(L, 1);
+    } else {
+        ct = lua_check_ct(L, NULL, false);
+        if (ctype_ptr_to(ct, CTYPE_FUNC))
+            ct = ct->ptr;
 
-static int lua_ffi_fill(lua_State *L)
-{
-    struct cdata *cd = luaL_checkudata(L, 1, CDATA_MT);
-    int len = luaL_checkinteger(L, 2);
-    int c = luaL_optinteger(L, 3, 0);
+        luaL_argcheck(L, ct->type == CTYPE_FUNC, 1, "function type expected");
 
-    memset(cdata_ptr(cd), c, len);
+        cfunc_stats(ct->func, &st);
+    }
 
-    return 0;
-}
+    lua_newtable(L);
 
-static int lua_ffi_errno(lua_State *L)
-{
-    int cur = errno;
+#define STATS_FIELD(name) \
+    lua_pushinteger(L, st.name); \
+    lua_setfield(L, -2, #name)
 
-    if (lua_gettop(L) > 0)
-        errno = luaL_checkinteger(L, 1);
+    STATS_FIELD(va_cache_hits);
+    STATS_FIELD(va_cache_misses);
+    STATS_FIELD(cb_created);
+    STATS_FIELD(cb_reused);
+    STATS_FIELD(cb_idle);
+    STATS_FIELD(ct_cache_hits);
+    STATS_FIELD(ct_cache_misses);
+
+#undef STATS_FIELD
 
-    lua_pushinteger(L, cur);
     return 1;
 }
 
@@ -2939,20 +7237,36 @@ static const luaL_Reg methods[] = {
 
     {"new", lua_ffi_new},
     {"cast", lua_ffi_cast},
+    {"bind", lua_ffi_bind},
+    {"callmany", lua_ffi_callmany},
+    {"into", lua_ffi_into},
+    {"unpack", lua_ffi_unpack},
+    {"vcall", lua_ffi_vcall},
+    {"accessor", lua_ffi_accessor},
+    {"trampoline", lua_ffi_trampoline},
+    {"handle", lua_ffi_handle},
+    {"unhandle", lua_ffi_unhandle},
+    {"poll", lua_ffi_poll},
+    {"pollfd", lua_ffi_pollfd},
     {"metatype", lua_ffi_metatype},
     {"typeof", lua_ffi_typeof},
     {"addressof", lua_ffi_addressof},
+    {"advance", lua_ffi_advance},
     {"gc", lua_ffi_gc},
+    {"cachepolicy", lua_ffi_cachepolicy},
 
     {"sizeof", lua_ffi_sizeof},
     {"offsetof", lua_ffi_offsetof},
     {"istype", lua_ffi_istype},
 
     {"tonumber", lua_ffi_tonumber},
+    {"inplace", lua_ffi_inplace},
     {"string", lua_ffi_string},
     {"copy", lua_ffi_copy},
     {"fill", lua_ffi_fill},
     {"errno", lua_ffi_errno},
+    {"stats", lua_ffi_stats},
+    {"callopt", lua_ffi_callopt},
 
     {NULL, NULL}
 };
@@ -2984,6 +7298,9 @@ int luaopen_ffi(lua_State *L)
     lua_newtable(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, &crecord_registry);
 
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &cfield_registry);
+
     lua_newtable(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, &carray_registry);
 
@@ -2993,15 +7310,42 @@ int luaopen_ffi(lua_State *L)
     lua_newtable(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, &ctype_registry);
 
+    cintern_init(L, &ctype_hash_registry);
+    cintern_init(L, &carray_hash_registry);
+
+    ctcache_init(L);
+
     lua_newtable(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, &ctdef_registry);
 
     lua_newtable(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, &clib_registry);
 
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &chandle_registry);
+
+    cfunc_cleanup_init(L);
+
+    cqueue_init(L);
+
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &ccoro_registry);
+
+    /* metatable of weak child caches */
+    lua_newtable(L);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &ccache_registry);
+
+#ifdef CJIT
+    cjit_init(L);
+#endif
+
     createmetatable(L, CDATA_MT, cdata_methods);
     createmetatable(L, CTYPE_MT, ctype_methods);
     createmetatable(L, CLIB_MT, clib_methods);
+    createmetatable(L, CSCANNER_MT, cscanner_methods);
+    createmetatable(L, CFIELDS_MT, cfields_methods);
 
     luaL_newlib(L, methods);
 
@@ -0,0 +1,574 @@
+#!/usr/bin/env lua
+
+-- Micro benchmarks for the call path.
+--
+-- Usage: lua tests/bench.lua [case ...]
+--
+-- Run it against two builds of the module to compare them.
+
+local ffi = require 'ffi'
+
+ffi.cdef([[
+    int abs(int j);
+    int toupper(int c);
+    size_t strlen(const char *s);
+    double ldexp(double x, int exp);
+
+    long add0(void);
+    long add1(long a);
+    long add2(long a, long b);
+    long add3(long a, long b, long c);
+    long add4(long a, long b, long c, long d);
+    long add5(long a, long b, long c, long d, long e);
+    long add6(long a, long b, long c, long d, long e, long f);
+    long add10(long a, long b, long c, long d, long e, long f, long g, long h, long i, long j);
+    struct point {
+        int x;
+        int y;
+    };
+    struct point point_new(int x, int y);
+
+    struct ops {
+        int (*add)(int a, int b);
+        int (*neg)(int a);
+    };
+    struct plugin {
+        const char *name;
+        struct ops *ops;
+        struct ops inline_ops;
+    };
+    struct plugin *plugin_get(void);
+
+    double mix_fp(int a, double b, long c, float d, short e, double f, long g, int h, long i, double j);
+
+    void qsort(void *base, size_t nmemb, size_t size, int (*compar)(const int *, const int *));
+
+    void *worker_start(void (*notify)(int i), int (*query)(int i), int n);
+    bool worker_done(void *w);
+    int worker_join(void *w);
+]])
+
+local function script_dir()
+    local src = debug.getinfo(1, 'S').source
+    if src:sub(1, 1) == '@' then
+        src = src:sub(2)
+    end
+    return src:match('(.*/)') or './'
+end
+
+-- built from tests/test.c
+local LIB_PATH = script_dir() .. 'libtest.so'
+
+local function bench(name, n, fn)
+    collectgarbage('collect')
+
+    local start = os.clock()
+    fn(n)
+    local elapsed = os.clock() - start
+
+    print(string.format('%-28s %10.1f ns/op', name, elapsed * 1e9 / n))
+end
+
+local cases = {}
+local order = {}
+
+local function case(name, fn)
+    cases[name] = fn
+    order[#order + 1] = name
+end
+
+case('call', function()
+    local C = ffi.C
+    local abs, strlen, ldexp = C.abs, C.strlen, C.ldexp
+
+    bench('abs(int)', 2000000, function(n)
+        for i = 1, n do
+            abs(-i)
+        end
+    end)
+
+    bench('strlen(const char *)', 2000000, function(n)
+        for _ = 1, n do
+            strlen('hello')
+        end
+    end)
+
+    bench('ldexp(double, int)', 2000000, function(n)
+        for i = 1, n do
+            ldexp(1.5, i % 8)
+        end
+    end)
+end)
+
+case('bind', function()
+    local abs = ffi.C.abs
+    local babs = ffi.bind(abs)
+
+    bench('abs(int) cdata', 2000000, function(n)
+        for i = 1, n do
+            abs(-i)
+        end
+    end)
+
+    bench('abs(int) bound', 2000000, function(n)
+        for i = 1, n do
+            babs(-i)
+        end
+    end)
+end)
+
+case('stub', function()
+    local lib = ffi.load(LIB_PATH)
+    local fns = {
+        [0] = lib.add0, lib.add1, lib.add2, lib.add3, lib.add4, lib.add5, lib.add6
+    }
+    local loops = {
+        [0] = function(f, n) for _ = 1, n do f() end end,
+        function(f, n) for i = 1, n do f(i) end end,
+        function(f, n) for i = 1, n do f(i, 2) end end,
+        function(f, n) for i = 1, n do f(i, 2, 3) end end,
+        function(f, n) for i = 1, n do f(i, 2, 3, 4) end end,
+        function(f, n) for i = 1, n do f(i, 2, 3, 4, 5) end end,
+        function(f, n) for i = 1, n do f(i, 2, 3, 4, 5, 6) end end,
+    }
+
+    for arity = 0, 6 do
+        local fn = fns[arity]
+        local f = ffi.bind(fn)
+
+        for _, backend in ipairs({'auto', 'libffi'}) do
+            ffi.callopt(fn, 'backend', backend)
+
+            bench(string.format('add%d %s', arity, backend), 2000000, function(n)
+                loops[arity](f, n)
+            end)
+        end
+
+        ffi.callopt(fn, 'backend', 'auto')
+    end
+end)
+
+case('jit', function()
+    local lib = ffi.load(LIB_PATH)
+    local add10, mix_fp = ffi.bind(lib.add10), ffi.bind(lib.mix_fp)
+
+    for _, backend in ipairs({'jit', 'libffi'}) do
+        if pcall(ffi.callopt, lib.add10, 'backend', backend) then
+            ffi.callopt(lib.mix_fp, 'backend', backend)
+
+            bench('add10 ' .. backend, 2000000, function(n)
+                for i = 1, n do
+                    add10(i, 2, 3, 4, 5, 6, 7, 8, 9, 10)
+                end
+            end)
+
+            bench('mix_fp ' .. backend, 2000000, function(n)
+                for i = 1, n do
+                    mix_fp(i, 0.5, 2, 0.25, 3, 1.5, 4, 5, 6, 0.5)
+                end
+            end)
+        end
+    end
+
+    ffi.callopt(lib.add10, 'backend', 'auto')
+    ffi.callopt(lib.mix_fp, 'backend', 'auto')
+end)
+
+case('callmany', function()
+    local lib = ffi.load(LIB_PATH)
+    local add2 = ffi.bind(lib.add2)
+    local n = 1000
+    local a = ffi.new('long [?]', n)
+    local out = ffi.new('long [?]', n)
+    local t = {}
+
+    for i = 1, n do
+        a[i - 1] = i
+        t[i] = i
+    end
+
+    bench('add2 loop (per batch)', 2000, function(m)
+        for _ = 1, m do
+            for i = 0, n - 1 do
+                out[i] = add2(a[i], 1)
+            end
+        end
+    end)
+
+    bench('add2 callmany cdata (per batch)', 2000, function(m)
+        for _ = 1, m do
+            ffi.callmany(lib.add2, n, out, a, 1)
+        end
+    end)
+
+    bench('add2 callmany table (per batch)', 2000, function(m)
+        for _ = 1, m do
+            ffi.callmany(lib.add2, n, out, t, 1)
+        end
+    end)
+end)
+
+case('record', function()
+    local lib = ffi.load(LIB_PATH)
+    local point_new = lib.point_new
+    local p = ffi.new('struct point')
+
+    bench('point_new cdata', 1000000, function(n)
+        for i = 1, n do
+            point_new(i, 2)
+        end
+    end)
+
+    bench('point_new into', 1000000, function(n)
+        for i = 1, n do
+            ffi.into(p, point_new, i, 2)
+        end
+    end)
+
+    bench('point_new unpack', 1000000, function(n)
+        for i = 1, n do
+            ffi.unpack(point_new, i, 2)
+        end
+    end)
+end)
+
+case('vtable', function()
+    local lib = ffi.load(LIB_PATH)
+    local pl = lib.plugin_get()
+    local add = ffi.bind(pl.ops.add)
+
+    bench('pl.ops.add(i, 1)', 1000000, function(n)
+        for i = 1, n do
+            pl.ops.add(i, 1)
+        end
+    end)
+
+    bench('ffi.vcall(pl, "ops.add")', 1000000, function(n)
+        for i = 1, n do
+            ffi.vcall(pl, 'ops.add', i, 1)
+        end
+    end)
+
+    bench('bound ops.add', 1000000, function(n)
+        for i = 1, n do
+            add(i, 1)
+        end
+    end)
+end)
+
+case('callback', function()
+    local ct = ffi.typeof('int (*)(int)')
+    local fn = function(x) return x end
+
+    bench('ffi.cast callback + gc', 100000, function(n)
+        for i = 1, n do
+            ffi.cast(ct, fn)
+            if i % 100 == 0 then
+                collectgarbage('collect')
+            end
+        end
+    end)
+
+    local st = ffi.stats(ct)
+    print(string.format('  created %d, reused %d', st.cb_created, st.cb_reused))
+end)
+
+case('qsort', function()
+    local n = 1000
+    local v = ffi.new('int [?]', n)
+    local ct = ffi.typeof('int (*)(const int *, const int *)')
+    local cmp = {
+        cdata = ffi.cast(ct, function(a, b) return a[0] - b[0] end),
+        cursor = ffi.cast(ct, function(a, b) return a[0] - b[0] end, {ptr = 'cursor'}),
+    }
+
+    for _, mode in ipairs({'cdata', 'cursor'}) do
+        bench('qsort 1000 ints ' .. mode .. ' (per sort)', 200, function(m)
+            for _ = 1, m do
+                for i = 0, n - 1 do
+                    v[i] = (i * 7919) % n
+                end
+                ffi.C.qsort(v, n, 4, cmp[mode])
+            end
+        end)
+    end
+end)
+
+case('trampoline', function()
+    local ct = ffi.typeof('int (*)(int x, void *ctx)')
+    local fn = function(x) return x end
+    local cbs = {}
+
+    bench('ffi.cast x1000 (per batch)', 100, function(n)
+        for _ = 1, n do
+            for i = 1, 1000 do
+                cbs[i] = ffi.cast(ct, fn)
+            end
+            for i = 1, 1000 do
+                cbs[i] = nil
+            end
+            collectgarbage('collect')
+        end
+    end)
+
+    bench('ffi.handle x1000 (per batch)', 100, function(n)
+        for _ = 1, n do
+            for i = 1, 1000 do
+                cbs[i] = ffi.handle(fn)
+            end
+            for i = 1, 1000 do
+                ffi.unhandle(cbs[i])
+                cbs[i] = nil
+            end
+        end
+    end)
+end)
+
+case('thread', function()
+    local lib = ffi.load(LIB_PATH)
+    local count = 0
+    local notify = ffi.cast('void (*)(int i)', function() count = count + 1 end, {thread = 'async'})
+    local query = ffi.cast('int (*)(int i)', function(i) return i end, {thread = 'sync'})
+
+    bench('async notify + poll', 200000, function(n)
+        local w = lib.worker_start(notify, nil, n)
+        while count < n do
+            ffi.poll()
+        end
+        lib.worker_join(w)
+    end)
+
+    bench('sync query + poll', 50000, function(n)
+        local w = lib.worker_start(nil, query, n)
+        while not lib.worker_done(w) do
+            ffi.poll()
+        end
+        lib.worker_join(w)
+    end)
+end)
+
+case('typeof', function()
+    local decls = {}
+    local n = 2000
+
+    for i = 1, n do
+        decls[#decls + 1] = string.format('struct bench_t%d { int a; long b; };', i)
+    end
+
+    local start = os.clock()
+    ffi.cdef(table.concat(decls, '\n'))
+    print(string.format('%-28s %10.1f ms', 'cdef 2000 structs', (os.clock() - start) * 1e3))
+
+    bench('typeof struct pointer', 200000, function(m)
+        for i = 1, m do
+            ffi.typeof('struct bench_t' .. (i % n + 1) .. ' *')
+        end
+    end)
+end)
+
+case('typestr', function()
+    local p = ffi.new('uint8_t [16]')
+
+    bench('ffi.new("int")', 1000000, function(n)
+        for i = 1, n do
+            ffi.new('int', i)
+        end
+    end)
+
+    bench('ffi.cast("uint8_t *", p)', 1000000, function(n)
+        for _ = 1, n do
+            ffi.cast('uint8_t *', p)
+        end
+    end)
+
+    bench('ffi.sizeof("struct point")', 1000000, function(n)
+        for _ = 1, n do
+            ffi.sizeof('struct point')
+        end
+    end)
+
+    local st = ffi.stats()
+    print(string.format('  hits %d, misses %d', st.ct_cache_hits, st.ct_cache_misses))
+end)
+
+case('field', function()
+    local decl = {}
+
+    for i = 1, 64 do
+        decl[i] = string.format('int f%d;', i)
+    end
+
+    ffi.cdef('struct bench_wide { ' .. table.concat(decl, ' ') .. ' struct { int inner; }; };')
+
+    local w = ffi.new('struct bench_wide')
+
+    bench('wide.f1 read', 2000000, function(n)
+        for _ = 1, n do
+            local _ = w.f1
+        end
+    end)
+
+    bench('wide.f64 read', 2000000, function(n)
+        for _ = 1, n do
+            local _ = w.f64
+        end
+    end)
+
+    bench('wide.inner write', 2000000, function(n)
+        for i = 1, n do
+            w.inner = i
+        end
+    end)
+end)
+
+case('accessor', function()
+    ffi.cdef('struct bench_nest { int id; struct { struct point pts[4]; } inner; };')
+
+    local nest = ffi.new('struct bench_nest')
+    local get, set = ffi.accessor('struct bench_nest', 'inner.pts[3].y')
+
+    bench('nest.inner.pts[3].y read', 1000000, function(n)
+        for _ = 1, n do
+            local _ = nest.inner.pts[3].y
+        end
+    end)
+
+    bench('accessor read', 1000000, function(n)
+        for _ = 1, n do
+            get(nest)
+        end
+    end)
+
+    bench('nest.inner.pts[3].y write', 1000000, function(n)
+        for i = 1, n do
+            nest.inner.pts[3].y = i
+        end
+    end)
+
+    bench('accessor write', 1000000, function(n)
+        for i = 1, n do
+            set(nest, i)
+        end
+    end)
+end)
+
+case('alloc', function()
+    local n = 1000000
+    local keep = {}
+
+    -- grow the table first, so only the cdata are counted
+    for i = 1, n do
+        keep[i] = false
+    end
+
+    collectgarbage('collect')
+    collectgarbage('stop')
+
+    local kb = collectgarbage('count')
+    local start = os.clock()
+
+    for i = 1, n do
+        keep[i] = ffi.new('int', i)
+    end
+
+    local elapsed = os.clock() - start
+    local bytes = (collectgarbage('count') - kb) * 1024
+
+    print(string.format('%-28s %10.1f ns/op', 'ffi.new("int")', elapsed * 1e9 / n))
+    print(string.format('%-28s %10.1f bytes', 'ffi.new("int") live', bytes / n))
+
+    keep = nil
+    collectgarbage('restart')
+
+    start = os.clock()
+    collectgarbage('collect')
+    print(string.format('%-28s %10.1f ms', 'gc of 1M ffi.new("int")', (os.clock() - start) * 1e3))
+end)
+
+case('iterate', function()
+    local n = 1000000
+    local arr = ffi.new('struct point [?]', n)
+
+    for _, policy in ipairs({'strong', 'weak', 'lru', 'off', 'cursor'}) do
+        ffi.cachepolicy(arr, policy)
+        collectgarbage('collect')
+
+        local kb = collectgarbage('count')
+
+        bench('arr[i].x ' .. policy, n, function(m)
+            for i = 0, m - 1 do
+                local _ = arr[i].x
+            end
+        end)
+
+        collectgarbage('collect')
+        print(string.format('  %.1f MB retained', (collectgarbage('count') - kb) / 1024))
+    end
+end)
+
+case('int64', function()
+    local inplace = ffi.inplace
+
+    bench('a = a + 1', 1000000, function(n)
+        local a = ffi.new('int64_t')
+        for _ = 1, n do
+            a = a + 1
+        end
+    end)
+
+    bench('ffi.inplace(a, "+", 1)', 1000000, function(n)
+        local a = ffi.new('int64_t')
+        for _ = 1, n do
+            inplace(a, '+', 1)
+        end
+    end)
+
+    bench('fnv-1a step inplace', 1000000, function(n)
+        local h = ffi.new('uint64_t')
+        for i = 1, n do
+            inplace(h, '~', i % 256, '*', 1099511628211)
+        end
+    end)
+end)
+
+case('pointer', function()
+    local n = 1000000
+    local buf = ffi.new('uint8_t [?]', n + 1)
+
+    bench('cast through size_t', n, function(m)
+        local p = ffi.cast('uint8_t *', buf)
+        for _ = 1, m do
+            p = ffi.cast('uint8_t *', ffi.cast('size_t', p) + 1)
+        end
+    end)
+
+    bench('p = p + 1', n, function(m)
+        local p = ffi.cast('uint8_t *', buf)
+        for _ = 1, m do
+            p = p + 1
+        end
+    end)
+
+    bench('ffi.advance(p, 1)', n, function(m)
+        local p = ffi.cast('uint8_t *', buf)
+        for _ = 1, m do
+            ffi.advance(p, 1)
+        end
+    end)
+end)
+
+local selected = { ... }
+
+if #selected == 0 then
+    selected = order
+end
+
+for _, name in ipairs(selected) do
+    local fn = cases[name]
+    if not fn then
+        error('unknown case: ' .. name)
+    end
+
+    print('== ' .. name)
+    fn()
+end
@@ -0,0 +1,95 @@
+// Built as the mtstress target of CMake, or:
+// gcc mtstress.c -o mtstress $(pkg-config --cflags --libs lua5.4) -pthread
+//
+// Runs independent Lua states on several threads, all parsing C declarations
+// and type strings at the same time.
+//
+// Usage: ./mtstress [threads] [iterations]
+// Run it from the directory holding ffi.so, or set LUA_CPATH.
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *script =
+    "local ffi = require 'ffi'\n"
+    "local id, n = ...\n"
+    "for i = 1, n do\n"
+    "    local name = string.format('t%d_%d', id, i)\n"
+    "    ffi.cdef(string.format([[\n"
+    "        struct %s { int a; char b[%d]; };\n"
+    "        typedef struct %s *%s_p;\n"
+    "    ]], name, i % 32 + 1, name, name))\n"
+    "    assert(ffi.sizeof('struct ' .. name) >= 4 + i % 32 + 1)\n"
+    "    local p = ffi.new('struct ' .. name .. ' [?]', 2)\n"
+    "    p[1].a = i\n"
+    "    assert(ffi.cast(name .. '_p', p)[1].a == i)\n"
+    "    assert(not pcall(ffi.cdef, 'struct ' .. name .. ' { int a; };'))\n"
+    "    assert(not pcall(ffi.new, 'struct ' .. name .. ' @'))\n"
+    "    assert(not pcall(ffi.cdef, '/* unterminated'))\n"
+    "end\n";
+
+struct worker {
+    pthread_t tid;
+    int id;
+    int iterations;
+    int failed;
+};
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    lua_State *L = luaL_newstate();
+
+    luaL_openlibs(L);
+
+    if (luaL_loadstring(L, script)) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        w->failed = 1;
+        goto done;
+    }
+
+    lua_pushinteger(L, w->id);
+    lua_pushinteger(L, w->iterations);
+
+    if (lua_pcall(L, 2, 0, 0)) {
+        fprintf(stderr, "thread %d: %s\n", w->id, lua_tostring(L, -1));
+        w->failed = 1;
+    }
+
+done:
+    lua_close(L);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int nthread = argc > 1 ? atoi(argv[1]) : 8;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+    struct worker *workers = calloc(nthread, sizeof(struct worker));
+    int failed = 0;
+    int i;
+
+    if (!workers)
+        return 1;
+
+    for (i = 0; i < nthread; i++) {
+        workers[i].id = i;
+        workers[i].iterations = iterations;
+        pthread_create(&workers[i].tid, NULL, worker_run, &workers[i]);
+    }
+
+    for (i = 0; i < nthread; i++) {
+        pthread_join(workers[i].tid, NULL);
+        failed |= workers[i].failed;
+    }
+
+    free(workers);
+
+    printf("%s\n", failed ? "Stress FAIL" : "Stress PASS");
+
+    return failed;
+}
@@ -1,5 +1,8 @@
-// gcc -shared -fPIC test.c -o libtest.so
+// gcc -shared -fPIC -pthread test.c -o libtest.so
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -31,6 +34,148 @@ struct student *student_new(int age, const char *name)
     return st;
 }
 
+struct point {
+    int x;
+    int y;
+};
+
+struct rect {
+    struct point min;
+    struct point max;
+    double area;
+    int tag[2];
+};
+
+struct point point_new(int x, int y)
+{
+    struct point p = {x, y};
+    return p;
+}
+
+struct rect rect_new(int w, int h)
+{
+    struct rect r = {{0, 0}, {w, h}, (double)w * h, {w + h, w - h}};
+    return r;
+}
+
+int divmod(int a, int b, int *q, int *r)
+{
+    if (b == 0)
+        return -1;
+
+    *q = a / b;
+    *r = a % b;
+
+    return 0;
+}
+
+void minmax(const double *v, int n, double *min, double *max)
+{
+    int i;
+
+    *min = *max = v[0];
+
+    for (i = 1; i < n; i++) {
+        if (v[i] < *min)
+            *min = v[i];
+        if (v[i] > *max)
+            *max = v[i];
+    }
+}
+
+const char *find_char(const char *s, int c, size_t *index)
+{
+    const char *p = strchr(s, c);
+
+    if (p)
+        *index = p - s;
+
+    return p;
+}
+
+int sum_ints(const int *v, int n)
+{
+    int i, sum = 0;
+
+    for (i = 0; i < n; i++)
+        sum += v[i];
+
+    return sum;
+}
+
+struct point point_sum(const int *v, int n)
+{
+    struct point p = {n, sum_ints(v, n)};
+
+    return p;
+}
+
+void scale_ints(int *v, int n, int k)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        v[i] *= k;
+}
+
+int sum_points(const struct point *p, int n)
+{
+    int i, sum = 0;
+
+    for (i = 0; i < n; i++)
+        sum += p[i].x + p[i].y;
+
+    return sum;
+}
+
+void point_swap(struct point *p)
+{
+    int x = p->x;
+
+    p->x = p->y;
+    p->y = x;
+}
+
+size_t total_len(const char **v, int n)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        len += strlen(v[i]);
+
+    return len;
+}
+
+struct ops {
+    int (*add)(int a, int b);
+    int (*neg)(int a);
+};
+
+struct plugin {
+    const char *name;
+    struct ops *ops;
+    struct ops inline_ops;
+};
+
+static int op_add(int a, int b)
+{
+    return a + b;
+}
+
+static int op_neg(int a)
+{
+    return -a;
+}
+
+static struct ops default_ops = {op_add, op_neg};
+
+struct plugin *plugin_get(void)
+{
+    static struct plugin p = {"demo", &default_ops, {op_add, NULL}};
+    return &p;
+}
+
 int *pass_array(int a[])
 {
     return a;
@@ -65,3 +210,168 @@ int call_f4(int x, int (*cb)(int i))
 {
     return cb(x);
 }
+
+int call_ctx(int (*cb)(int x, void *ctx), int x, void *ctx)
+{
+    return cb(x, ctx);
+}
+
+long add0(void)
+{
+    return 100;
+}
+
+long add1(long a)
+{
+    return a;
+}
+
+long add2(long a, long b)
+{
+    return a + b;
+}
+
+long add3(long a, long b, long c)
+{
+    return a + b + c;
+}
+
+long add4(long a, long b, long c, long d)
+{
+    return a + b + c + d;
+}
+
+long add5(long a, long b, long c, long d, long e)
+{
+    return a + b + c + d + e;
+}
+
+long add6(long a, long b, long c, long d, long e, long f)
+{
+    return a + b + c + d + e + f;
+}
+
+int mix_ints(signed char c, short s, unsigned char uc, unsigned short us, int i, bool b)
+{
+    return c + s + uc + us + i + b;
+}
+
+double ratio(long a, int b)
+{
+    return (double)a / b;
+}
+
+double mix_fp(int a, double b, long c, float d, short e, double f, long g, int h, long i, double j)
+{
+    return a + b + c + d + e + f + g + h + i + j;
+}
+
+float scalef(float x, int n)
+{
+    return x * n;
+}
+
+long add10(long a, long b, long c, long d, long e, long f, long g, long h, long i, long j)
+{
+    return a + b + c + d + e + f + g + h + i + j;
+}
+
+/* each argument weighted by its position, so misplaced ones show */
+long sum64(
+    long a0, long a1, long a2, long a3, long a4, long a5, long a6, long a7,
+    long a8, long a9, long a10, long a11, long a12, long a13, long a14, long a15,
+    long a16, long a17, long a18, long a19, long a20, long a21, long a22, long a23,
+    long a24, long a25, long a26, long a27, long a28, long a29, long a30, long a31,
+    long a32, long a33, long a34, long a35, long a36, long a37, long a38, long a39,
+    long a40, long a41, long a42, long a43, long a44, long a45, long a46, long a47,
+    long a48, long a49, long a50, long a51, long a52, long a53, long a54, long a55,
+    long a56, long a57, long a58, long a59, long a60, long a61, long a62, long a63)
+{
+    long v[] = {
+        a0, a1, a2, a3, a4, a5, a6, a7,
+        a8, a9, a10, a11, a12, a13, a14, a15,
+        a16, a17, a18, a19, a20, a21, a22, a23,
+        a24, a25, a26, a27, a28, a29, a30, a31,
+        a32, a33, a34, a35, a36, a37, a38, a39,
+        a40, a41, a42, a43, a44, a45, a46, a47,
+        a48, a49, a50, a51, a52, a53, a54, a55,
+        a56, a57, a58, a59, a60, a61, a62, a63
+    };
+    long sum = 0;
+    int i;
+
+    for (i = 0; i < 64; i++)
+        sum += v[i] * (i + 1);
+
+    return sum;
+}
+
+uint64_t u64_not(uint64_t v)
+{
+    return ~v;
+}
+
+uint64_t u64_neg(uint64_t v)
+{
+    return -v;
+}
+
+void i64_neg(int64_t v, int64_t *r)
+{
+    *r = -v;
+}
+
+struct worker {
+    pthread_t tid;
+    void (*notify)(int i);
+    int (*query)(int i);
+    int n;
+    int sum;
+    int done;
+};
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    int i;
+
+    for (i = 0; i < w->n; i++) {
+        if (w->notify)
+            w->notify(i);
+        else
+            w->sum += w->query(i);
+    }
+
+    __atomic_store_n(&w->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+struct worker *worker_start(void (*notify)(int i), int (*query)(int i), int n)
+{
+    struct worker *w = calloc(1, sizeof(struct worker));
+
+    w->notify = notify;
+    w->query = query;
+    w->n = n;
+
+    pthread_create(&w->tid, NULL, worker_run, w);
+
+    return w;
+}
+
+bool worker_done(struct worker *w)
+{
+    return __atomic_load_n(&w->done, __ATOMIC_ACQUIRE);
+}
+
+int worker_join(struct worker *w)
+{
+    int sum;
+
+    pthread_join(w->tid, NULL);
+    sum = w->sum;
+    free(w);
+
+    return sum;
+}
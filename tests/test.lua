@@ -2,6 +2,8 @@
 
 local ffi = require 'ffi'
 
+local unpack = table.unpack or unpack
+
 local function expect_error(fn, needle)
     local ok, err = pcall(fn)
     assert(not ok)
@@ -108,16 +110,56 @@ ffi.cdef([[
         int i;
     };
 
+    struct point {
+        int x;
+        int y;
+    };
+
+    struct rect {
+        struct point min;
+        struct point max;
+        double area;
+        int tag[2];
+    };
+
     int sprintf(char *str, const char *format, ...);
     void *malloc(size_t size);
     void free(void *ptr);
     int open(const char *pathname, int flags);
+    void qsort(void *base, size_t nmemb, size_t size, int (*compar)(const int *, const int *));
 
     int student_get_age(struct student st);
     int student_get_age_ptr(struct student *st);
     const char *student_get_name(struct student *st);
     struct student *student_new(int age, const char *name);
 
+    struct point point_new(int x, int y);
+    struct rect rect_new(int w, int h);
+
+    int divmod(int a, int b, __out int *q, __out int *r);
+    void minmax(const double *v, int n, __out double *min, __out double *max);
+    const char *find_char(const char *s, int c, __out size_t *index);
+
+    int sum_ints(const int *v, int n);
+    struct point point_sum(const int *v, int n);
+    void scale_ints(__inout int *v, int n, int k);
+    int sum_points(const struct point *p, int n);
+    void point_swap(__inout struct point *p);
+    size_t total_len(const char **v, int n);
+
+    struct ops {
+        int (*add)(int a, int b);
+        int (*neg)(int a);
+    };
+
+    struct plugin {
+        const char *name;
+        struct ops *ops;
+        struct ops inline_ops;
+    };
+
+    struct plugin *plugin_get(void);
+
     int *pass_array(int a[]);
 
     int cb_mul10(int i);
@@ -129,7 +171,26 @@ ffi.cdef([[
     typedef int (*callback_t)(int);
     int call_f4(int x, callback_t cb);
 
+    int call_ctx(int (*cb)(int x, void *ctx), int x, void *ctx);
+
+    void *worker_start(void (*notify)(int i), int (*query)(int i), int n);
+    bool worker_done(void *w);
+    int worker_join(void *w);
+
     int missing_symbol(void);
+
+    long add0(void);
+    long add1(long a);
+    long add2(long a, long b);
+    long add3(long a, long b, long c);
+    long add4(long a, long b, long c, long d);
+    long add5(long a, long b, long c, long d, long e);
+    long add6(long a, long b, long c, long d, long e, long f);
+    int mix_ints(int8_t c, short s, unsigned char uc, unsigned short us, int i, bool b);
+    double ratio(long a, int b);
+    double mix_fp(int a, double b, long c, float d, short e, double f, long g, int h, long i, double j);
+    float scalef(float x, int n);
+    long add10(long a, long b, long c, long d, long e, long f, long g, long h, long i, long j);
 ]])
 
 local tests = {
@@ -426,6 +487,991 @@ local tests = {
         assert(n == 17)
         assert(ffi.string(ffi.cast('const char *', buf)) == 'hello 1 2.00 3.30')
     end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+
+        local abs = ffi.bind(ffi.C.abs)
+        assert(type(abs) == 'function')
+        assert(abs(-3) == 3)
+        assert(abs(4.0) == 4)
+
+        local get_age = ffi.bind(lib, 'student_get_age_ptr')
+        local get_name = ffi.bind(lib.student_get_name)
+        local new = ffi.bind(lib, 'student_new')
+
+        local st = ffi.gc(new(7, 'bind'), ffi.C.free)
+        assert(get_age(st) == 7)
+        assert(ffi.string(get_name(st)) == 'bind')
+
+        local sprintf = ffi.bind(ffi.C.sprintf)
+        local buf = ffi.new('char [32]')
+        assert(sprintf(buf, '%d-%s', 5, 'x') == 3)
+        assert(ffi.string(buf) == '5-x')
+
+        expect_error(function()
+            abs()
+        end, 'wrong number of arguments')
+
+        expect_error(function()
+            abs('x')
+        end, 'cannot convert')
+
+        expect_error(function()
+            ffi.bind(ffi.new('int'))
+        end, 'function cdata expected')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+
+        local function check()
+            assert(lib.add0() == 100)
+            assert(lib.add1(-1) == -1)
+            assert(lib.add2(1, 2) == 3)
+            assert(lib.add3(1, 2, -3) == 0)
+            assert(lib.add4(1, 2, 3, 4) == 10)
+            assert(lib.add5(1, 2, 3, 4, 5) == 15)
+            assert(lib.add6(1, 2, 3, 4, 5, 6) == 21)
+            assert(lib.mix_ints(-5, -300, 200, 60000, -7, true) == 59889)
+            assert(lib.ratio(7, 2) == 3.5)
+        end
+
+        assert(ffi.callopt(lib.add6, 'backend') == 'auto')
+        check()
+
+        for _, fn in ipairs({lib.add0, lib.add3, lib.add6, lib.mix_ints, lib.ratio}) do
+            assert(ffi.callopt(fn, 'backend', 'libffi') == 'libffi')
+        end
+        check()
+
+        for _, fn in ipairs({lib.add0, lib.add3, lib.add6, lib.mix_ints, lib.ratio}) do
+            ffi.callopt(fn, 'backend', 'auto')
+        end
+
+        expect_error(function()
+            ffi.callopt(ffi.C.sprintf, 'backend', 'stub')
+        end, 'no call stub')
+
+        expect_error(function()
+            ffi.callopt(ffi.C.abs, 'backend', 'none')
+        end, 'invalid option')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+        local fns = {lib.add0, lib.add6, lib.mix_ints, lib.ratio, lib.mix_fp, lib.scalef, lib.add10}
+
+        local function check()
+            assert(lib.add0() == 100)
+            assert(lib.add6(1, 2, 3, 4, 5, -6) == 9)
+            assert(lib.mix_ints(-5, -300, 200, 60000, -7, true) == 59889)
+            assert(lib.ratio(7, 2) == 3.5)
+            assert(lib.mix_fp(1, 0.5, -2, 0.25, -3, 1.25, 4, 5, 6, 0.5) == 13.5)
+            assert(lib.scalef(1.5, -4) == -6)
+            assert(lib.add10(1, 2, 3, 4, 5, 6, 7, 8, 9, -10) == 35)
+        end
+
+        check()
+
+        -- the JIT may be disabled or unavailable on this platform
+        if not pcall(ffi.callopt, lib.mix_fp, 'backend', 'jit') then
+            return
+        end
+
+        for _, fn in ipairs(fns) do
+            assert(ffi.callopt(fn, 'backend', 'jit') == 'jit')
+        end
+        check()
+
+        for _, fn in ipairs(fns) do
+            ffi.callopt(fn, 'backend', 'auto')
+        end
+
+        expect_error(function()
+            ffi.callopt(ffi.C.sprintf, 'backend', 'jit')
+        end, 'no call trampoline')
+    end,
+    function()
+        local buf = ffi.new('char [64]')
+        local st0 = ffi.stats(ffi.C.sprintf)
+
+        for i = 1, 10 do
+            ffi.C.sprintf(buf, '%d %s', i, 'x')
+        end
+
+        ffi.C.sprintf(buf, '%.1f', 1.5)
+        assert(ffi.string(buf) == '1.5')
+
+        local st = ffi.stats(ffi.C.sprintf)
+        assert(st.va_cache_misses - st0.va_cache_misses == 2)
+        assert(st.va_cache_hits - st0.va_cache_hits == 9)
+
+        -- more argument shapes than cache slots must keep working
+        for i = 1, 20 do
+            local fmt = string.rep('%d', i)
+            local args = {}
+            for j = 1, i do
+                args[j] = j % 10
+            end
+            ffi.C.sprintf(buf, fmt, unpack(args))
+            assert(ffi.string(buf) == table.concat(args))
+        end
+
+        assert(ffi.stats().va_cache_hits >= st.va_cache_hits)
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+        local out = ffi.new('long [4]')
+
+        ffi.callmany(lib.add2, 4, out, {1, 2, 3, 4}, 10)
+        assert(out[0] == 11 and out[3] == 14)
+
+        local a = ffi.new('long [4]', {5, 6, 7, 8})
+        ffi.callmany(lib.add3, 4, out, a, {1, 1, 1, 1}, ffi.cast('long *', a))
+        assert(out[0] == 11 and out[3] == 17)
+
+        local d = ffi.new('double [3]')
+        ffi.callmany(lib.ratio, 3, d, {1, 2, 3}, 2)
+        assert(d[0] == 0.5 and d[2] == 1.5)
+
+        ffi.callmany(lib.ratio, 2, d, 3, {1, 2})
+        assert(d[0] == 3 and d[1] == 1.5)
+
+        ffi.callmany(lib.add1, 2, nil, {1, 2})
+        ffi.callmany(lib.add0, 0, nil)
+
+        expect_error(function()
+            ffi.callmany(lib.add2, 2, out, {1, 'x'}, 1)
+        end, 'row 2:')
+
+        local cb = ffi.cast('int (*)(int)', function(i)
+            if i == 3 then
+                error('bad row')
+            end
+            return i
+        end)
+
+        expect_error(function()
+            ffi.callmany(lib.call_f1, 4, nil, cb, {1, 2, 3, 4})
+        end, 'row 3: ')
+
+        expect_error(function()
+            ffi.callmany(lib.add2, 5, out, a, 1)
+        end, 'array too short')
+
+        expect_error(function()
+            ffi.callmany(lib.add2, 2, d, a, 1)
+        end, 'array of the return type expected')
+
+        expect_error(function()
+            ffi.callmany(ffi.C.sprintf, 1, nil, nil, '')
+        end, 'variadic')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+
+        local p = lib.point_new(1, 2)
+        assert(p.x == 1 and p.y == 2)
+
+        local q = ffi.new('struct point')
+        assert(ffi.into(q, lib.point_new, 3, 4) == q)
+        assert(q.x == 3 and q.y == 4)
+
+        ffi.into(ffi.addressof(q), lib.point_new, 5, 6)
+        assert(q.x == 5 and q.y == 6)
+
+        local x, y = ffi.unpack(lib.point_new, 7, 8)
+        assert(x == 7 and y == 8)
+
+        local x0, y0, x1, y1, area, tag = ffi.unpack(lib.rect_new, 3, 2)
+        assert(x0 == 0 and y0 == 0 and x1 == 3 and y1 == 2 and area == 6)
+        assert(tag[0] == 5 and tag[1] == 1)
+
+        local into = ffi.bind(lib.point_new, {ret = 'into'})
+        assert(into(q, 9, 10) == q and q.x == 9 and q.y == 10)
+
+        local unpack_point = ffi.bind(lib, 'point_new', {ret = 'unpack'})
+        x, y = unpack_point(11, 12)
+        assert(x == 11 and y == 12)
+
+        expect_error(function()
+            ffi.into(ffi.new('struct rect'), lib.point_new, 1, 2)
+        end, 'struct of the return type expected')
+
+        expect_error(function()
+            ffi.unpack(lib.add2, 1, 2)
+        end, 'function returning a struct expected')
+
+        expect_error(function()
+            ffi.bind(lib.add2, {ret = 'unpack'})
+        end, 'function returning a struct expected')
+
+        expect_error(function()
+            ffi.bind(lib.point_new, {ret = 'table'})
+        end, 'invalid ret option')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+
+        local rc, q, r = lib.divmod(17, 5)
+        assert(rc == 0 and q == 3 and r == 2)
+
+        rc, q, r = lib.divmod(1, 0)
+        assert(rc == -1 and q == 0 and r == 0)
+
+        local min, max = lib.minmax(ffi.new('double [3]', {2.5, -1, 7}), 3)
+        assert(min == -1 and max == 7)
+
+        local p, idx = lib.find_char('hello', string.byte('l'))
+        assert(ffi.string(p) == 'llo' and idx == 2)
+
+        local divmod = ffi.bind(lib.divmod)
+        rc, q, r = divmod(-7, 2)
+        assert(rc == 0 and q == -3 and r == -1)
+
+        assert(tostring(ffi.typeof(lib.divmod)):find('__out int', 1, true))
+
+        expect_error(function()
+            lib.divmod(1, 2, 3)
+        end, 'wrong number of arguments')
+
+        expect_error(function()
+            ffi.cdef('void bad_out(__out int x);')
+        end, '__out requires a pointer')
+
+        expect_error(function()
+            ffi.cdef('void bad_out2(__out const int *x);')
+        end, '__out requires a pointer')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+
+        assert(lib.sum_ints({1, 2, 3, 4}, 4) == 10)
+        assert(lib.sum_ints({}, 0) == 0)
+
+        local big = {}
+        for i = 1, 10000 do
+            big[i] = i
+        end
+        assert(lib.sum_ints(big, #big) == 50005000)
+
+        local n, sum = ffi.unpack(lib.point_sum, big, #big)
+        assert(n == 10000 and sum == 50005000)
+
+        local v = {1, 2, 3}
+        lib.scale_ints(v, 3, 10)
+        assert(v[1] == 10 and v[2] == 20 and v[3] == 30)
+
+        assert(lib.sum_points({{1, 2}, {x = 3, y = 4}}, 2) == 10)
+        assert(lib.sum_points({x = 5, y = 6}, 1) == 11)
+
+        local p = {x = 1, y = 2}
+        lib.point_swap(p)
+        assert(p.x == 2 and p.y == 1)
+
+        assert(lib.total_len({'ab', 'cde', ''}, 3) == 5)
+
+        local a = ffi.new('int [2]', {1, 2})
+        lib.scale_ints(a, 2, 3)
+        assert(a[0] == 3 and a[1] == 6)
+
+        expect_error(function()
+            ffi.cdef('void bad_inout(__inout const int *v);')
+        end, '__inout requires a pointer')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+        local pl = lib.plugin_get()
+
+        assert(pl.ops.add(2, 3) == 5)
+        assert(pl.inline_ops.add(4, 5) == 9)
+
+        assert(ffi.vcall(pl, 'ops.add', 2, 3) == 5)
+        assert(ffi.vcall(pl, 'ops.neg', 7) == -7)
+        assert(ffi.vcall(pl.ops, 'neg', -1) == 1)
+        assert(ffi.vcall(pl[0], 'inline_ops.add', 1, 1) == 2)
+
+        local add = ffi.bind(pl.ops.add)
+        assert(add(10, 20) == 30)
+
+        local cb = ffi.cast('int (*)(int)', function(i)
+            return i * 2
+        end)
+        assert(cb(21) == 42)
+
+        expect_error(function()
+            ffi.vcall(pl, 'inline_ops.neg', 1)
+        end, 'null function pointer')
+
+        expect_error(function()
+            pl.inline_ops.neg(1)
+        end, 'null function pointer')
+
+        expect_error(function()
+            ffi.vcall(pl, 'name')
+        end, 'is not callable')
+
+        expect_error(function()
+            ffi.vcall(pl, 'ops.nope', 1)
+        end, 'no member named')
+
+        expect_error(function()
+            ffi.vcall(pl, 'ops..add', 1)
+        end, 'invalid field path')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+        local ct = ffi.typeof('int (*)(int)')
+        local st0 = ffi.stats(ct)
+
+        for i = 1, 40 do
+            local cb = ffi.cast(ct, function(x)
+                return x + i
+            end)
+            assert(lib.call_f1(cb, 1) == 1 + i)
+            cb = nil
+            collectgarbage('collect')
+        end
+
+        local st = ffi.stats(ct)
+        assert(st.cb_reused - st0.cb_reused >= 30)
+        assert(st.cb_created - st0.cb_created <= 10)
+        assert(st.cb_idle >= 1)
+
+        local total = ffi.stats()
+        assert(total.cb_reused >= st.cb_reused)
+    end,
+    function()
+        local ct = ffi.typeof('int (*)(const int *, const int *)')
+        local v = ffi.new('int [5]', {4, 1, 5, 3, 2})
+        local seen = {}
+
+        local cmp = ffi.cast(ct, function(a, b)
+            seen[a], seen[b] = true, true
+            return a[0] - b[0]
+        end, {ptr = 'cursor'})
+
+        ffi.C.qsort(v, 5, ffi.sizeof('int'), cmp)
+
+        for i = 0, 4 do
+            assert(v[i] == i + 1)
+        end
+
+        local n = 0
+        for _ in pairs(seen) do
+            n = n + 1
+        end
+        assert(n == 2)
+
+        local raw = ffi.cast(ct, function(a, b)
+            assert(type(a) == 'userdata' and getmetatable(a) == nil)
+            return ffi.cast('const int *', b)[0] - ffi.cast('const int *', a)[0]
+        end, {ptr = 'raw'})
+
+        ffi.C.qsort(v, 5, ffi.sizeof('int'), raw)
+
+        for i = 0, 4 do
+            assert(v[i] == 5 - i)
+        end
+
+        local lib = ffi.load(LIB_PATH)
+        local cb = ffi.cast('int (*)(int)', function(x)
+            return x / 2
+        end, {ptr = 'cdata'})
+        assert(lib.call_f1(cb, 8) == 4)
+
+        expect_error(function()
+            ffi.cast(ct, function() end, {ptr = 'pointer'})
+        end, "invalid ptr option 'pointer'")
+
+        expect_error(function()
+            ffi.cast(ct, function() end, {ptr = true})
+        end, 'invalid ptr option')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+        local ct = ffi.typeof('int (*)(int x, void *ctx)')
+        local tramp = ffi.trampoline(ct, 2)
+        local st0 = ffi.stats(ct)
+        local handles = {}
+
+        assert(ffi.trampoline(ct, 2) == tramp)
+
+        for i = 1, 100 do
+            handles[i] = ffi.handle(function(x, ctx)
+                return x * i
+            end)
+        end
+
+        for i = 1, 100 do
+            assert(lib.call_ctx(tramp, 3, handles[i]) == 3 * i)
+        end
+
+        assert(ffi.stats(ct).cb_created == st0.cb_created)
+
+        ffi.unhandle(handles[7])
+
+        expect_error(function()
+            lib.call_ctx(tramp, 3, handles[7])
+        end, 'invalid callback handle')
+
+        expect_error(function()
+            ffi.unhandle(handles[7])
+        end, 'invalid callback handle')
+
+        for i = 1, 100 do
+            if i ~= 7 then
+                ffi.unhandle(handles[i])
+            end
+        end
+
+        expect_error(function()
+            ffi.trampoline(ct, 1)
+        end, 'pointer parameter expected')
+
+        expect_error(function()
+            ffi.trampoline(ct, 3)
+        end, 'parameter index out of range')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+        local seen = {}
+
+        local notify = ffi.cast('void (*)(int i)', function(i)
+            seen[#seen + 1] = i
+        end, {thread = 'async'})
+
+        local w = lib.worker_start(notify, nil, 50)
+        while not lib.worker_done(w) do end
+        lib.worker_join(w)
+
+        assert(#seen == 0)
+
+        repeat
+            ffi.poll(10)
+        until #seen == 50
+
+        for i = 1, 50 do
+            assert(seen[i] == i - 1)
+        end
+
+        local query = ffi.cast('int (*)(int)', function(i)
+            return i * 2
+        end, {thread = 'sync'})
+
+        w = lib.worker_start(nil, query, 20)
+        while not lib.worker_done(w) do
+            ffi.poll()
+        end
+        assert(lib.worker_join(w) == 380)
+
+        -- queued calls keep the callback alive after its cdata is collected
+        local ran = 0
+        w = lib.worker_start(ffi.cast('void (*)(int i)', function()
+            ran = ran + 1
+        end, {thread = 'async'}), nil, 5)
+        while not lib.worker_done(w) do end
+        lib.worker_join(w)
+        collectgarbage('collect')
+
+        local other = ffi.cast('void (*)(int i)', function()
+            error('wrong callback')
+        end, {thread = 'async'})
+        assert(ffi.poll() == 5 and ran == 5 and other)
+
+        -- the owning thread calls directly
+        assert(lib.call_f1(query, 4) == 8)
+        assert(ffi.poll() == 0)
+
+        expect_error(function()
+            ffi.cast('int (*)(int i)', function() end, {thread = 'async'})
+        end, 'async callbacks must return void')
+
+        expect_error(function()
+            ffi.cast('int (*)(int i)', function() end, {thread = 'pool'})
+        end, "invalid thread option 'pool'")
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+
+        -- created on a coroutine which is dead when the callback runs
+        local cb = coroutine.wrap(function()
+            return ffi.cast('int (*)(int)', function(x)
+                return x + 1
+            end)
+        end)()
+        collectgarbage('collect')
+
+        assert(lib.call_f1(cb, 1) == 2)
+
+        -- called from a coroutine, runs on it
+        local caller = coroutine.create(function()
+            local inner
+            local f = ffi.cast('int (*)(int)', function(x)
+                inner = coroutine.running()
+                return x * 3
+            end)
+            assert(lib.call_f1(f, 2) == 6)
+            return inner
+        end)
+        local ok, inner = coroutine.resume(caller)
+        assert(ok and inner == caller)
+
+        -- a callback whose caller waits cannot yield
+        local yielding = ffi.cast('int (*)(int)', function(x)
+            coroutine.yield()
+            return x
+        end)
+
+        expect_error(function()
+            lib.call_f1(yielding, 1)
+        end, 'attempt to yield')
+
+        -- queued async callbacks may yield and be resumed later
+        local parked = {}
+        local done = {}
+
+        local notify = ffi.cast('void (*)(int i)', function(i)
+            parked[#parked + 1] = coroutine.running()
+            coroutine.yield()
+            done[#done + 1] = i
+        end, {thread = 'async'})
+
+        local w = lib.worker_start(notify, nil, 3)
+        while not lib.worker_done(w) do end
+        lib.worker_join(w)
+
+        assert(ffi.poll() == 3)
+        assert(#parked == 3 and #done == 0)
+
+        for _, co in ipairs(parked) do
+            assert(coroutine.resume(co))
+        end
+
+        assert(#done == 3 and done[1] == 0 and done[3] == 2)
+    end,
+    function()
+        local decls = {}
+
+        for i = 1, 200 do
+            decls[#decls + 1] = string.format('struct intern%d { int v[%d]; };', i, i)
+        end
+        ffi.cdef(table.concat(decls, '\n'))
+
+        for i = 1, 200 do
+            local name = 'struct intern' .. i
+            local p = ffi.typeof(name .. ' *')
+
+            assert(rawequal(p, ffi.typeof(name .. ' *')))
+            assert(not rawequal(p, ffi.typeof(name .. ' * const')))
+            assert(rawequal(ffi.typeof('int [' .. i .. ']'), ffi.typeof('int [' .. i .. ']')))
+            assert(tostring(p) == 'ctype<' .. name .. ' *>')
+            assert(ffi.sizeof(name) == ffi.sizeof('int') * i)
+        end
+
+        local fp = ffi.typeof('int (*)(struct intern1 *, const char *)')
+        assert(rawequal(fp, ffi.typeof('int (*)(struct intern1 *, const char *)')))
+        assert(not rawequal(fp, ffi.typeof('int (*)(struct intern2 *, const char *)')))
+    end,
+    function()
+        local st0 = ffi.stats()
+
+        for i = 1, 10 do
+            assert(ffi.sizeof('struct point') == 8)
+            assert(ffi.typeof('uint8_t *') == ffi.typeof('uint8_t *'))
+        end
+
+        local st = ffi.stats()
+        assert(st.ct_cache_hits - st0.ct_cache_hits >= 28)
+        assert(st.ct_cache_misses - st0.ct_cache_misses <= 2)
+
+        for n = 1, 5 do
+            local a = ffi.new('int [?]', n)
+            assert(#a == n)
+        end
+
+        assert(ffi.sizeof(ffi.new('int [?]', 7)) == 7 * ffi.sizeof('int'))
+        assert(ffi.sizeof(ffi.new('int [3]')) == 3 * ffi.sizeof('int'))
+
+        expect_error(function()
+            ffi.typeof('int [?]')
+        end, 'flexible array not supported')
+
+        -- more strings than the cache holds
+        for i = 1, 1500 do
+            assert(ffi.sizeof('char [' .. i .. ']') == i)
+        end
+        assert(ffi.sizeof('char [1]') == 1)
+    end,
+    function()
+        local decl = {}
+
+        for i = 1, 1000 do
+            decl[i] = string.format('int f%d;', i)
+        end
+
+        ffi.cdef('struct wide1000 { ' .. table.concat(decl, ' ') .. ' };')
+        ffi.cdef('union wide1000u { ' .. table.concat(decl, ' ') .. ' };')
+
+        assert(ffi.sizeof('struct wide1000') == 4000)
+        assert(ffi.offsetof('struct wide1000', 'f1000') == 3996)
+        assert(ffi.sizeof('union wide1000u') == 4)
+
+        local w = ffi.new('struct wide1000')
+        w.f1, w.f33, w.f1000 = 1, 33, 1000
+        assert(w.f1 == 1 and w.f33 == 33 and w.f1000 == 1000 and w.f999 == 0)
+
+        expect_error(function()
+            ffi.cdef('struct wide_dup { ' .. table.concat(decl, ' ') .. ' int f700; };')
+        end, "duplicate member'f700'")
+    end,
+
+    function()
+        local lib = ffi.load(LIB_PATH)
+        local params, args = {}, {}
+        local expected = 0
+
+        for i = 1, 64 do
+            params[i] = 'long a' .. (i - 1)
+            args[i] = i
+            expected = expected + i * i
+        end
+
+        ffi.cdef('long sum64(' .. table.concat(params, ', ') .. ');')
+
+        for _, backend in ipairs({'auto', 'libffi', 'jit'}) do
+            if pcall(ffi.callopt, lib.sum64, 'backend', backend) then
+                assert(lib.sum64(unpack(args)) == expected)
+            end
+        end
+        ffi.callopt(lib.sum64, 'backend', 'auto')
+
+        expect_error(function()
+            lib.sum64(unpack(args, 1, 63))
+        end, 'wrong number of arguments')
+
+        local cb = ffi.cast('long (*)(' .. table.concat(params, ', ') .. ')', function(...)
+            assert(select('#', ...) == 64)
+            return select(64, ...) - select(1, ...)
+        end)
+        assert(cb(unpack(args)) == 63)
+
+        -- more variadic arguments than the inline lists hold
+        local buf = ffi.new('char [512]')
+        local fmt = string.rep('%d ', 40)
+        ffi.C.sprintf(buf, fmt, unpack(args, 1, 40))
+        assert(ffi.string(buf) == table.concat(args, ' ', 1, 40) .. ' ')
+    end,
+    function()
+        local a = ffi.offsetof('struct ComplexStruct', 'a')
+
+        assert(a)
+        assert(ffi.offsetof('struct ComplexStruct', 'b') == a + 4)
+        assert(ffi.offsetof('struct ComplexStruct', 'c') == a + 8)
+
+        local cs = ffi.new('struct ComplexStruct')
+        cs.c = 7
+        assert(cs.c == 7)
+
+        local long = 'field_' .. string.rep('x', 60)
+
+        ffi.cdef(string.format([[
+            struct long_names {
+                int a;
+                union {
+                    int %s;
+                    struct {
+                        short lo, hi;
+                    };
+                };
+            };
+        ]], long))
+
+        local ln = ffi.new('struct long_names')
+        ln[long .. ''] = 0x10002
+        assert(ln[table.concat({'field_', string.rep('x', 60)})] == 0x10002)
+        assert(ffi.offsetof('struct long_names', long) == 4)
+        assert(ffi.offsetof('struct long_names', 'hi') == 6)
+        assert(ln.lo + ln.hi == 3)
+
+        expect_error(function()
+            return ln.field_
+        end, "no member named 'field_'")
+    end,
+    function()
+        local get, set = ffi.accessor('struct ComplexStruct', 'boundingBox.bottomRight.y')
+        local cs = ffi.new('struct ComplexStruct')
+
+        set(cs, 42)
+        assert(cs.boundingBox.bottomRight.y == 42 and get(cs) == 42)
+        assert(get(ffi.cast('struct ComplexStruct *', cs)) == 42)
+
+        local score, set_score = ffi.accessor('struct ComplexStruct', 'scores[3]')
+        set_score(cs, 7)
+        assert(cs.scores[3] == 7 and score(cs) == 7)
+
+        local pt = ffi.new('Point', {1, 2})
+        local ly, set_ly = ffi.accessor(ffi.typeof('struct ComplexStruct *'), 'location.y')
+        cs.location = ffi.addressof(pt)
+        assert(ly(cs) == 2)
+        set_ly(cs, 5)
+        assert(pt.y == 5)
+        assert(ffi.accessor('struct ComplexStruct', 'location[0].x')(cs) == 1)
+
+        local c = ffi.accessor('struct ComplexStruct', 'c')
+        cs.c = 9
+        assert(c(cs) == 9)
+
+        cs.location = nil
+        expect_error(function() ly(cs) end, 'null pointer')
+        expect_error(function() get(ffi.new('Point')) end, 'unexpected ctype')
+
+        expect_error(function()
+            ffi.accessor('struct ComplexStruct', 'boundingBox')
+        end, 'non-scalar')
+        expect_error(function()
+            ffi.accessor('struct ComplexStruct', 'scores[10]')
+        end, 'out of range')
+        expect_error(function()
+            ffi.accessor('struct ComplexStruct', 'id.x')
+        end, 'cannot be indexed')
+        expect_error(function()
+            ffi.accessor('struct ComplexStruct', 'scores[')
+        end, 'invalid accessor path')
+        expect_error(function()
+            ffi.accessor('int', 'x')
+        end, 'struct or union type expected')
+
+        ffi.cdef('struct accessor_ro { const int a; int b; };')
+        local ro = ffi.new('struct accessor_ro')
+        local get_a, set_a = ffi.accessor('struct accessor_ro', 'a')
+        local _, set_b = ffi.accessor('struct accessor_ro', 'b')
+
+        assert(get_a(ro) == 0)
+        expect_error(function() set_a(ro, 3) end, 'read-only')
+        set_b(ro, 3)
+        assert(ro.b == 3)
+    end,
+    function()
+        local cs = ffi.new('struct ComplexStruct')
+        local bb = cs.boundingBox
+
+        assert(rawequal(bb, cs.boundingBox))
+        assert(rawequal(cs.scores, cs.scores))
+        assert(rawequal(bb.topLeft, cs.boundingBox.topLeft))
+
+        local pts = ffi.new('struct point [4]')
+        local p = ffi.cast('struct point *', pts)
+        assert(rawequal(pts[2], pts[2]))
+        assert(rawequal(p[1], p[1]))
+
+        pts[2].y = 5
+        collectgarbage()
+        assert(pts[2].y == 5 and p[2].y == 5)
+
+        for i = 1, 1000 do
+            assert(ffi.new('int', i) ~= nil)
+        end
+        collectgarbage()
+    end,
+    function()
+        ffi.cdef('struct cache_rec { int a; double b; };')
+
+        local n = 10000
+        local arr = ffi.new('struct cache_rec [?]', n)
+
+        ffi.cachepolicy(arr, 'off')
+        assert(not rawequal(arr[1], arr[1]))
+
+        for i = 0, n - 1 do
+            arr[i].a = i
+        end
+        assert(arr[n - 1].a == n - 1)
+
+        collectgarbage()
+        local kb = collectgarbage('count')
+        for i = 0, n - 1 do
+            assert(arr[i].a == i)
+        end
+        collectgarbage()
+        assert(collectgarbage('count') - kb < 64)
+
+        ffi.cachepolicy(arr, 'cursor')
+        local c1 = arr[1]
+        assert(c1.a == 1)
+        local c2 = arr[2]
+        assert(rawequal(c1, c2) and c1.a == 2)
+
+        ffi.cachepolicy(arr, 'lru', 4)
+        local e = arr[3]
+        assert(rawequal(e, arr[3]))
+        for i = 10, 20 do
+            assert(arr[i].a == i)
+        end
+        local f = arr[20]
+        assert(rawequal(f, arr[20]))
+
+        ffi.cachepolicy(arr, 'weak')
+        assert(rawequal(arr[5], arr[5]))
+
+        ffi.cachepolicy('struct cache_rec', 'cursor')
+        local p = ffi.cast('struct cache_rec *', arr)
+        assert(rawequal(p[1], p[2]) and p[2].a == 2)
+
+        ffi.cachepolicy('struct cache_rec', 'default')
+        assert(rawequal(p[1], p[1]) and not rawequal(p[1], p[2]))
+
+        expect_error(function()
+            ffi.cachepolicy(arr, 'bogus')
+        end, "invalid option 'bogus'")
+        expect_error(function()
+            ffi.cachepolicy('int', 'off')
+        end, 'struct or union type expected')
+    end,
+    function()
+        local lib = ffi.load(LIB_PATH)
+
+        ffi.cdef([[
+            uint64_t u64_not(uint64_t v);
+            uint64_t u64_neg(uint64_t v);
+            void i64_neg(int64_t v, __out int64_t *r);
+        ]])
+
+        local a = ffi.new('int64_t', 7)
+        local b = a + 3
+
+        assert(ffi.istype('int64_t', b) and b == ffi.new('int64_t', 10))
+        assert(tostring(b) == '10LL')
+        assert(tostring(a * -2) == '-14LL')
+        assert(tostring(a / 2) == '3LL' and tostring(-a / 2) == '-3LL')
+        assert(tostring(a % 4) == '3LL')
+        assert(tostring(ffi.new('int', 3) ^ 4) == '81LL')
+        assert(tostring(2 - a) == '-5LL')
+        expect_error(function() return a / 0 end, 'division by zero')
+
+        local max = ffi.new('uint64_t') - 1
+        assert(tostring(max) == '18446744073709551615ULL')
+        assert(tostring(max / 3) == '6148914691236517205ULL')
+        assert(tostring(ffi.new('int64_t', -1) + ffi.new('uint64_t')) == '18446744073709551615ULL')
+
+        assert(a < ffi.new('int64_t', 8) and a <= ffi.new('int', 7))
+        assert(not (max < ffi.new('uint64_t', 1)))
+        assert(ffi.new('int64_t', -1) < ffi.new('int64_t'))
+
+        -- numbers beyond int64_t are unsigned, as C integer constants
+        assert(tostring(ffi.new('int64_t', 1) + 2^63) == '9223372036854775809ULL')
+        assert(tostring(ffi.new('uint64_t') + 2^63) == '9223372036854775808ULL')
+
+        -- floating point operands give numbers
+        assert(a + 0.5 == 7.5)
+        assert(ffi.new('double', 1.5) * 2 == 3)
+
+        -- exact beyond 2^53 on every Lua version
+        local big = ffi.new('int64_t', 2) ^ 60 + 1
+        assert(tostring(big) == '1152921504606846977LL')
+        assert(ffi.new('int64_t', big) == big)
+
+        local buf = ffi.new('char [32]')
+        ffi.C.sprintf(buf, '%llu', max)
+        assert(ffi.string(buf) == '18446744073709551615')
+
+        if _VERSION >= 'Lua 5.3' then
+            local ops = load([[
+                local a, b = ...
+                assert(a < 8 and a >= 7)
+                assert(a < 2^63 and not (2^63 <= a))
+                return tostring(a & b), tostring(a | 1), tostring(a ~ b), tostring(~a),
+                    tostring(a << 4), tostring(-a >> 1), tostring(a // 2)
+            ]])
+            local r = {ops(a, ffi.new('uint64_t', 12))}
+            assert(table.concat(r, ' ') == '4ULL 7LL 11ULL -8LL 112LL -4LL 3LL')
+        end
+
+        -- FNV-1a
+        local h = ffi.inplace(ffi.new('uint64_t'), '=', 0xcbf29ce4, '<<', 32, '|', 0x84222325)
+        assert(tostring(h) == '14695981039346656037ULL')
+        for _, c in ipairs({('hello'):byte(1, -1)}) do
+            assert(rawequal(ffi.inplace(h, '~', c, '*', 1099511628211), h))
+        end
+        assert(tostring(h) == '11831194018420276491ULL')
+
+        local n = ffi.new('uint32_t')
+        ffi.inplace(n, '-', 1)
+        assert(ffi.tonumber(n) == 4294967295)
+        ffi.inplace(n, '+', 2, '>>', 1)
+        assert(ffi.tonumber(n) == 0)
+
+        local s = ffi.new('int64_t', -16)
+        ffi.inplace(s, '>>', 2)
+        assert(tostring(s) == '-4LL')
+
+        expect_error(function() ffi.inplace(n, '+', 0.5) end, 'number has no integer representation')
+        expect_error(function() ffi.inplace(ffi.new('double'), '+', 1) end, 'integer cdata expected')
+        expect_error(function() ffi.inplace(n, '**', 1) end, "invalid option '**'")
+        expect_error(function() ffi.inplace(n, '/', 0) end, 'division by zero')
+
+        assert(type(lib.u64_not(0)) == 'number')
+
+        local u64_not = ffi.bind(lib.u64_not, {int64 = 'cdata'})
+        local r = u64_not(1)
+        assert(ffi.istype('uint64_t', r) and tostring(r) == '18446744073709551614ULL')
+        assert(tostring(u64_not(r)) == '1ULL')
+
+        -- per binding: other functions of the same type still return numbers
+        assert(type(lib.u64_not(0)) == 'number' and type(lib.u64_neg(1)) == 'number')
+        assert(type(ffi.bind(lib.u64_neg)(1)) == 'number')
+        assert(tostring(ffi.bind(lib, 'u64_neg', {int64 = 'cdata'})(1)) == '18446744073709551615ULL')
+
+        local i64_neg = ffi.bind(lib.i64_neg, {int64 = 'cdata'})
+        assert(tostring(i64_neg(big)) == '-1152921504606846977LL')
+
+        expect_error(function()
+            ffi.bind(lib.u64_not, {int64 = 'box'})
+        end, "invalid int64 option 'box'")
+    end,
+    function()
+        local buf = ffi.new('uint8_t [16]', {1, 2, 3, 4, 5, 6, 7, 8})
+        local p = buf + 2
+
+        assert(ffi.istype('uint8_t *', p) and p[0] == 3)
+        assert((p + 3)[0] == 6 and (1 + p)[0] == 4 and (p - 1)[0] == 2)
+        assert(p - buf == 2 and buf - p == -2)
+        assert(buf < p and buf <= p and not (p < buf) and p <= p + 0)
+
+        local ints = ffi.cast('int *', buf)
+        assert(ffi.cast('uint8_t *', ints + 2) - buf == 8)
+        assert((ints + ffi.new('int64_t', 3)) - ints == 3)
+        assert(ffi.cast('const uint8_t *', buf) - p == -2)
+        assert(ffi.cast('uint8_t *', ffi.cast('void *', buf) + 5)[0] == 6)
+
+        expect_error(function() return p + buf end, 'attempt to add two pointers')
+        expect_error(function() return ints - p end, 'pointers to different types')
+        expect_error(function() return 1 - p end, 'attempt to subtract a pointer from a number')
+        expect_error(function() return p + 0.5 end, 'number has no integer representation')
+        expect_error(function()
+            return ffi.cast('int (*)(int)', ffi.C.abs) + 1
+        end, 'arithmetic on a function pointer')
+
+        local q = ffi.cast('uint8_t *', buf)
+        local sum = 0
+
+        for _ = 1, 8 do
+            sum = sum + q[0]
+            assert(rawequal(ffi.advance(q), q))
+        end
+        assert(sum == 36 and q - buf == 8)
+
+        ffi.advance(q, -8)
+        assert(q[0] == 1)
+
+        -- cached children follow the pointer
+        local pts = ffi.new('Point [3]', {{1, 2}, {3, 4}, {5, 6}})
+        local pp = ffi.cast('Point *', pts)
+        assert(pp[0].x == 1)
+        ffi.advance(pp, 2)
+        assert(pp[0].x == 5 and pp - pts == 2)
+
+        expect_error(function() ffi.advance(buf, 1) end, 'pointer cdata expected')
+        expect_error(function() ffi.advance(q, 0.5) end, 'number has no integer representation')
+    end,
 }
 
 for _, test in pairs(tests) do